@@ -9,29 +9,69 @@ import video_writer
 
 SHADER_DIR = os.path.dirname(__file__) + '/../shaders'
 
+# Uniform buffer binding point of the `FrameUniforms` block declared by the
+# built-in shaders (camera and lighting state shared by all meshes).
+FRAME_UNIFORMS_BINDING = 0
+
 class ShaderLibrary:
     """
     Load GLSL shaders from files, with caching.
     """
     def __init__(self, ctx):
         self.shaders = {}
+        self.failed = set()
         self.ctx = ctx
     def load(self, vtxFile, fragFile, geoFile = ""):
         files = [vtxFile, fragFile]
         if geoFile != "": files.append(geoFile)
         files = tuple(files)
         if files not in self.shaders:
-            self.shaders[files] = Shader(self.ctx, *[open(f).read() for f in files])
+            shader = Shader(self.ctx, *[open(f).read() for f in files])
+            shader.bindUniformBlock('FrameUniforms', FRAME_UNIFORMS_BINDING, optional=True)
+            self.shaders[files] = shader
         return self.shaders[files]
 
+    def tryLoad(self, vtxFile, fragFile, geoFile = ""):
+        """
+        Like `load`, but return `None` (remembering the failure) if the shader
+        cannot be built, e.g., because the context lacks geometry shaders.
+        """
+        key = (vtxFile, fragFile, geoFile)
+        if key in self.failed: return None
+        try: return self.load(vtxFile, fragFile, geoFile)
+        except Exception:
+            self.failed.add(key)
+            return None
+
 class OpenGLContext(_offscreen_renderer.OpenGLContext):
-    def array(self, unpremultiply = True):
+    def array(self, unpremultiply = True, out = None):
+        """
+        Get the rendered image as a (height, width, 4) array, flipped
+        vertically (since OpenGL's image coordinate system is vertically
+        flipped with respect to PIL/png/etc.)
+        If `out` is passed, the image is written into this preallocated
+        C-contiguous uint8 array (of shape (height, width, 3) to drop the alpha
+        channel); otherwise, a new array is allocated (or, if
+        `unpremultiply` is False, a zero-copy view of the context's internal
+        buffer is returned; this view is overwritten by the next `finish`).
+        """
         self.finish() # Copy image to internal buffer
-        # Reshape flat buffer into (height, width, components) 3D array
-        # and flip vertically (since OpenGL's image coordinate system is vertically flipped
-        # with respect to PIL/png/etc.)
-        buf = self.unpremultipliedBuffer() if unpremultiply else self.buffer()
-        return buf.reshape((self.height, self.width, 4))[::-1,:,:]
+        return self._readArray(unpremultiply, out)
+
+    def _readArray(self, unpremultiply, out):
+        if out is None:
+            if not unpremultiply: return np.asarray(self)
+            out = np.empty((self.height, self.width, 4), dtype=np.uint8)
+        self.readInto(out, unpremultiply)
+        return out
+
+    def acquireArray(self, unpremultiply = True, out = None):
+        """
+        Like `array`, but for the oldest frame queued with `requestReadback`
+        (blocks until that frame's readback completes).
+        """
+        self.acquireFrame() # Copy the queued image to internal buffer
+        return self._readArray(unpremultiply, out)
 
     def image(self, unpremultiply = True):
         from PIL import Image
@@ -44,6 +84,18 @@ class OpenGLContext(_offscreen_renderer.OpenGLContext):
         if ext == 'png': self.writePNG(path, unpremultiply)
         if ext == 'ppm': self.writePPM(path, unpremultiply)
 
+    def saveAsync(self, path, unpremultiply = True, compressionLevel = -1, filters = -1):
+        """
+        Like `save`, but the image is encoded and written on a background
+        thread pool (see `configureImageWriter`). Returns an `ImageWriteFuture`;
+        call `result()` on it to wait for the write and raise any error.
+        """
+        ext = os.path.splitext(path)[-1][1:].lower()
+        if (ext not in ['png', 'ppm']): raise Exception('Output file extension not supported')
+        self.finish() # Copy image to internal buffer
+        if ext == 'png': return self.writePNGAsync(path, unpremultiply, compressionLevel, filters)
+        if ext == 'ppm': return self.writePPMAsync(path, unpremultiply)
+
     def shaderLibrary(self):
         if not hasattr(self, '_shaderLib'):
             self._shaderLib = ShaderLibrary(self)
@@ -73,6 +125,18 @@ def decodeColor(c):
         else: raise Exception('Unrecognized color: ' + c)
     return c
 
+def interleave(*arrays):
+    """
+    Pack per-vertex arrays side by side into a single float32 array for
+    `VertexArrayObject.setInterleavedAttributes`.
+    """
+    out = np.empty((len(arrays[0]), sum(a.shape[1] for a in arrays)), dtype=np.float32)
+    c = 0
+    for a in arrays:
+        out[:, c:c + a.shape[1]] = a
+        c += a.shape[1]
+    return out
+
 def normalize(v):
     return v / np.linalg.norm(v)
 
@@ -89,10 +153,16 @@ def lookAtMatrix(position, target, up):
     return matView
 
 class Mesh:
+    # Whether translucent instances can be depth sorted and drawn with
+    # order-independent transparency (see `MeshRenderer.transparencyMode`)
+    supportsTranslucency = True
+
     def __init__(self, ctx, V, F, N, color):
         self.ctx = ctx
         self.shader = ctx.shaderLibrary().load(SHADER_DIR + '/phong_with_wireframe.vert',
                                                SHADER_DIR + '/phong_with_wireframe.frag')
+        self._surfaceShader = self.shader
+        self._wireframeShader = None # geometry shader variant (see `_selectShader`), once loaded
 
         # The triangle index array in active use to replicate vertex data to
         # per-corner data.
@@ -100,16 +170,34 @@ class Mesh:
 
         self.alpha = 1.0 # Global opacity of the mesh
         self._meshColorOpaque = True # to be determined from the user-passed color
-        self._sorted = False
+        self._geometryVersion = 0 # incremented whenever `V` or `F` change (invalidating depth sorts)
 
         self.setWireframe(0.0)
         self.matModel = np.identity(4)
         self.shininess = 20.0
 
         self.vao = None
+        self._streaming = False
 
         self.setMesh(V, F, N, color)
 
+    @property
+    def shader(self): return self._shader
+
+    @shader.setter
+    def shader(self, s):
+        self._shader = s
+        self._uniformHandles = {}
+
+    def _setUniform(self, name, val):
+        """
+        Set a uniform of `self.shader` (which must be in use) through a cached
+        handle, avoiding the name lookup and `glUseProgram` of `Shader.setUniform`.
+        """
+        h = self._uniformHandles.get(name)
+        if h is None: h = self._uniformHandles[name] = self.shader.uniformHandle(name)
+        self.shader.setUniform(h, val)
+
     def _validateSizes(self, V, F, N, color):
         """ Side effect: update constColor """
         ccolor = isinstance(color, str) or len(np.ravel(color)) in [3, 4] # `str` case probably corresponds to RGB hex code '#FFFFFF'
@@ -139,33 +227,31 @@ class Mesh:
 
         if self.F is not None:
             self.vao.setIndexBuffer(self.F)
+        else: self.vao.unsetIndexBuffer() # (discard any depth-sorted triangles)
 
         self.updateMeshData(V, N, color)
 
     def isOpaque(self): return (self.alpha == 1.0) and self._meshColorOpaque
     def needsDepthSort(self):
-        return not (self._sorted or self.isOpaque())
+        return not self.isOpaque()
 
-    def _depthSort(self, matView):
+    def _sortGeometry(self):
         """
-        If the mesh has translucency, sort the triangles from back to front.
-        To avoid shuffling vertex attribute data when the viewpoint changes, we
-        always use an index buffer when depth sorting.
+        Vertex positions and triangles to depth sort (the triangles of the
+        unindexed face set if `F` is `None`).
         """
-        if not self.needsDepthSort(): return
-
-        if self.F is None:
-            self.F = np.arange(self.numVertices)
-
-        # Sort the triangles in increasing order by their barycenters'
-        # z coordinates in eye space. Note, we discard the irrelevant
-        # translation part of `matModelView` to avoid working with
-        # homogeneous coordinates.
-        order = np.argsort((self.V[self.F].reshape((-1, 3, 3)).mean(axis=1) @ (matView @ self.matModel)[0:3, 0:3].T)[:, 2])
-        self.F = self.F.reshape((-1, 3))[order]
+        F = self.F if self.F is not None else np.arange(len(self.V))
+        return self.V, F.reshape((-1, 3))
 
+    def setSortedTriangles(self, sorter, index):
+        """
+        Draw the triangles in the order computed for mesh `index` by the
+        `TriangleDepthSorter` `sorter`. To avoid shuffling vertex attribute
+        data when the viewpoint changes, we always use an index buffer for
+        this (even when `F` is `None`).
+        """
         self.ctx.makeCurrent()
-        self.vao.setIndexBuffer(self.F)
+        sorter.writeIndexBuffer(index, self.vao)
 
     def updateMeshData(self, V, N, color = None):
         """
@@ -189,16 +275,28 @@ class Mesh:
         self.V = V
         self.N = N
         self.color = color
+        self._geometryVersion += 1
 
-        self.vao.setAttribute(0, V)
-        self.vao.setAttribute(1, N)
-
+        # Upload the per-vertex data as a single interleaved buffer.
         if self.constColor:
+            self.vao.setInterleavedAttributes([0, 1], [V.shape[1], N.shape[1]], interleave(V, N))
             self.vao.setConstantAttribute(2, color)
             self._meshColorOpaque = (len(color) == 3) or (color[3] == 1.0)
         else:
-            self.vao.setAttribute(2, color)
+            self.vao.setInterleavedAttributes([0, 1, 2], [V.shape[1], N.shape[1], color.shape[1]], interleave(V, N, color))
             self._meshColorOpaque = (color.shape[1] == 3) or (color[:, 3].min() == 1.0)
+        # (Re)apply the streaming mode in case the interleaved buffer was recreated.
+        if self._streaming: self.vao.setAttributeStreaming(0, True)
+
+    def setStreaming(self, enable = True):
+        """
+        Stream the vertex positions and normals, avoiding pipeline stalls when
+        they are replaced by `updateMeshData` on every frame (e.g., for
+        animations).
+        """
+        self._streaming = enable
+        self.ctx.makeCurrent()
+        self.vao.setAttributeStreaming(0, enable) # (interleaved with the normals)
 
     def setColor(self, color):
         """
@@ -226,8 +324,6 @@ class Mesh:
         self.matModel[0:3,   3] = position
         self.matModel[  3, 0:4] = [0, 0, 0, 1]
 
-        self._sorted = False # Changing the mesh orientation invalidates its depth sort
-
     def hasPerCornerVtxData(self):
         return (self.F is None) or (len(self.F.ravel()) == self.numVertices)
 
@@ -264,34 +360,72 @@ class Mesh:
         # Disable the index buffers
         self.F = None
         self.vao.unsetIndexBuffer()
+        self._geometryVersion += 1
 
-    def render(self, matView):
-        self.ctx.makeCurrent()
+    def _selectShader(self):
+        """
+        Our wireframe rendering technique needs barycentric coordinates for
+        each triangle corner. These are generated by a geometry shader when
+        available; otherwise we fall back to making distinct copies of
+        vertices for each incident triangle (which must happen before any
+        depth sorting).
+        A shader assigned to `self.shader` by the caller is left alone.
+        """
+        if (self.shader is not self._surfaceShader) and (self.shader is not self._wireframeShader): return
+        shader = self._surfaceShader
+        if self.lineWidth != 0:
+            self._wireframeShader = self.ctx.shaderLibrary().tryLoad(SHADER_DIR + '/phong_with_wireframe_gs.vert',
+                                                                     SHADER_DIR + '/phong_with_wireframe.frag',
+                                                                     SHADER_DIR + '/phong_with_wireframe.geom')
+            if self._wireframeShader is not None: shader = self._wireframeShader
+            else: self.replicatePerCorner()
+        if self.shader is not shader: self.shader = shader
+
+    def render(self, matView, oitPass = False, triangleRange = None):
+        """
+        Draw the mesh (or only `triangleRange[1]` triangles starting at
+        triangle `triangleRange[0]`); `oitPass` indicates that translucent
+        fragments are being accumulated for order-independent transparency.
+        """
+        self._setupDraw(matView, oitPass)
+        if triangleRange is None: self.vao.draw(self.shader)
+        else: self.vao.drawRange(self.shader, 3 * triangleRange[0], 3 * triangleRange[1])
 
-        # Sort triangles if needed
-        self._depthSort(matView)
+    def _constantAttributes(self):
+        """
+        (location, RGBA value) of the constant vertex attributes set by `_setupDraw`.
+        """
+        attrs = []
+        if self.constColor: attrs.append((2, self.color))
+        if self.constWFColor is not None: attrs.append((3, self.constWFColor))
+        return [(loc, np.append(c, 1.0) if len(c) == 3 else c) for loc, c in attrs]
 
-        # Our wireframe rendering technique needs distinct copies of vertices
-        # for each incident triangle.
-        if self.lineWidth != 0: self.replicatePerCorner()
+    def _setupDraw(self, matView, oitPass = False):
+        """
+        Select and configure the shader (uniforms and constant attributes) for drawing the mesh.
+        """
+        self.ctx.makeCurrent()
+        self._selectShader()
 
         modelViewMatrix = matView @ self.matModel
-        self.shader.setUniform('modelViewMatrix',   modelViewMatrix)
-        self.shader.setUniform('normalMatrix',      np.linalg.inv(modelViewMatrix[0:3, 0:3]).T)
+        self.shader.use()
+        self._setUniform('modelViewMatrix',   modelViewMatrix)
+        self._setUniform('normalMatrix',      np.linalg.inv(modelViewMatrix[0:3, 0:3]).T)
 
-        self.shader.setUniform('shininess',         self.shininess)
-        self.shader.setUniform('alpha',             self.alpha)
+        self._setUniform('shininess',         self.shininess)
+        self._setUniform('alpha',             self.alpha)
 
-        self.shader.setUniform('lineWidth',         self.lineWidth)
+        self._setUniform('lineWidth',         self.lineWidth)
+        self._setUniform('oitPass',           oitPass)
 
         # Any constant color configured is not part of the VAO state and must be set again to ensure it hasn't been overwritten
         if self.constColor: self.vao.setConstantAttribute(2, self.color)
 
         if self.constWFColor is not None: self.vao.setConstantAttribute(3, self.constWFColor)
 
-        self.vao.draw(self.shader)
-
 class VectorFieldMesh(Mesh):
+    supportsTranslucency = False
+
     def __init__(self, ctx, V, F, N, arrowPos, arrowVec, arrowColor,
                  arrowRelativeScreenSize, arrowAlignment, targetDepth):
         super().__init__(ctx, V, F, N, color=np.array([0, 0, 0, 1])) # color is overridden by arrowColor; but set alpha to 1.0 (opaque) to ensure vector field is drawn before transparent objects
@@ -312,14 +446,31 @@ class VectorFieldMesh(Mesh):
         self.ctx.makeCurrent()
         modelViewMatrix = matView @ self.matModel
         self.shader.use()
-        self.shader.setUniform('modelViewMatrix',   modelViewMatrix)
-        self.shader.setUniform('normalMatrix',      np.linalg.inv(modelViewMatrix[0:3, 0:3]).T)
-        self.shader.setUniform('alpha',             self.alpha)
+        self._setUniform('modelViewMatrix',   modelViewMatrix)
+        self._setUniform('normalMatrix',      np.linalg.inv(modelViewMatrix[0:3, 0:3]).T)
+        self._setUniform('alpha',             self.alpha)
         self.vao.draw(self.shader, self.instanceCount, ignoreExtraneousAttributes=True) # `color` attribute is unused by vector field shader!
 
+class RenderPool(_offscreen_renderer.RenderPool):
+    """
+    Renders frames in parallel on `numWorkers` threads (default: one per
+    core), each owning its own `OpenGLContext`. Jobs submitted with
+    `render(job)` are called as `job(ctx)` on whichever worker is free;
+    per-worker state (e.g., a `MeshRenderer(ctx=ctx)`) can be cached as an
+    attribute of `ctx`, which lives as long as the pool.
+    """
+    def __init__(self, width, height, numWorkers = 0, maxQueued = 0, contextFactory = OpenGLContext):
+        super().__init__(width, height, numWorkers, maxQueued, contextFactory)
+
 class MeshRenderer:
-    def __init__(self, width, height):
-        self.ctx = OpenGLContext(width, height)
+    def __init__(self, width, height, ctx = None):
+        """
+        Render into `ctx` if passed (e.g., a `RenderPool` worker's context,
+        which is resized to `width` x `height`); otherwise create a new context.
+        """
+        if ctx is None: ctx = OpenGLContext(width, height)
+        elif (ctx.width, ctx.height) != (width, height): ctx.resize(width, height)
+        self.ctx = ctx
         self.meshes = []
 
         self.matView       = np.identity(4)
@@ -333,6 +484,16 @@ class MeshRenderer:
 
         self.transparentBackground = True
 
+        # How translucent meshes are rendered: 'sort' (sorting all their
+        # triangles together back to front on the CPU) or 'oit' (weighted
+        # blended order-independent transparency)
+        self.transparencyMode = 'sort'
+        self._oit = None
+        self._depthSorter = TriangleDepthSorter()
+        self._sorterMeshes = [] # (mesh, geometry version) whose geometry `_depthSorter` holds
+
+        self.frameUniforms = None # Created (with the built-in shaders' `FrameUniforms` layout) at the first render
+
     def resize(self, width, height):
         self.ctx.resize(width, height)
 
@@ -369,9 +530,14 @@ class MeshRenderer:
         """
         self.meshes[which].updateMeshData(V, N, color)
 
+    def setStreaming(self, enable = True, which = 0):
+        """
+        Optimize mesh `which` for `updateMeshData` calls on every frame.
+        """
+        self.meshes[which].setStreaming(enable)
+
     def setViewMatrix(self, mat):
         self.matView = mat
-        self._sorted = False # Changing the viewpoint invalidates the depth sort
 
     def lookAt(self, position, target, up):
         self.cam_position = position
@@ -434,13 +600,31 @@ class MeshRenderer:
                            GLenum.GL_ONE,       GLenum.GL_ONE_MINUS_SRC_ALPHA)
 
 
-        # Render the opaque meshes first
-        # This will result in a perfectly rendered scene with N opaque objects and 1 transparent object.
-        # Proper ordering of triangles of multiple transparent objects is not implemented.
-        transparencySortedMeshes = sorted(self.meshes, key=lambda m: not m.isOpaque())
-
-        # Set mesh-independent shader attributes
-        for s in set([m.shader for m in transparencySortedMeshes]):
+        # Render the opaque meshes first, then the translucent ones: in
+        # 'sort' mode with all their triangles sorted together back to front,
+        # and in 'oit' mode accumulated (in any order) and composited at the end.
+        if self.transparencyMode not in ('sort', 'oit'): raise Exception(f'Unknown transparency mode {self.transparencyMode}')
+        translucentMeshes = [m for m in self.meshes if m.supportsTranslucency and not m.isOpaque()]
+        transparencySortedMeshes = sorted([m for m in self.meshes if m not in translucentMeshes], key=lambda m: not m.isOpaque())
+
+        # Upload the mesh-independent shader state once for all shaders
+        # declaring the `FrameUniforms` block (with the built-in shaders'
+        # std140 layout); shaders without it get plain uniforms.
+        if len(self.meshes) > 0:
+            if self.frameUniforms is None:
+                builtin = self.ctx.shaderLibrary().load(SHADER_DIR + '/phong_with_wireframe.vert',
+                                                        SHADER_DIR + '/phong_with_wireframe.frag')
+                self.frameUniforms = UniformBuffer(self.ctx, builtin.uniformBlock('FrameUniforms'), FRAME_UNIFORMS_BINDING)
+            fu = self.frameUniforms
+            fu.set('projectionMatrix',  self.matProjection)
+            fu.set('lightEyePos',       self.lightEyePos)
+            fu.set('diffuseIntensity',  self.diffuseIntensity)
+            fu.set('ambientIntensity',  self.ambientIntensity)
+            fu.set('specularIntensity', self.specularIntensity)
+            fu.upload()
+
+        for s in set([m.shader for m in self.meshes]):
+            if s.uniformBlock('FrameUniforms', optional=True) is not None: continue
             s.use()
             s.setUniform('projectionMatrix',  self.matProjection)
 
@@ -452,9 +636,44 @@ class MeshRenderer:
         for mesh in transparencySortedMeshes:
             mesh.render(self.matView)
 
-    def array(self      ): return self.ctx.array(     unpremultiply=self.transparentBackground)
+        if len(translucentMeshes) == 0: return
+        if self.transparencyMode == 'oit':
+            if self._oit is None: self._oit = WeightedBlendedOIT(self.ctx)
+            self._oit.beginTransparentPass()
+            for mesh in translucentMeshes:
+                mesh.render(self.matView, oitPass=True)
+            self._oit.composite()
+        else: self._renderDepthSorted(translucentMeshes)
+
+    def _renderDepthSorted(self, meshes):
+        """
+        Draw `meshes` with all their triangles sorted together back to front,
+        switching between meshes as often as the order requires.
+        """
+        sorter = self._depthSorter
+        sorter.numMeshes = len(meshes)
+        for i, m in enumerate(meshes):
+            m._selectShader() # (may change the geometry)
+            if (i >= len(self._sorterMeshes)) or (self._sorterMeshes[i] != (m, m._geometryVersion)):
+                sorter.setMesh(i, *m._sortGeometry())
+        self._sorterMeshes = [(m, m._geometryVersion) for m in meshes]
+
+        if sorter.sort([self.matView @ m.matModel for m in meshes]):
+            for i, m in enumerate(meshes): m.setSortedTriangles(sorter, i)
+
+        # Set up each mesh once (meshes may share a shader, so its uniforms
+        # are saved per mesh); the runs are then drawn natively.
+        uniforms = []
+        for m in meshes:
+            m._setupDraw(self.matView)
+            uniforms.append(m.shader.saveUniforms())
+        sorter.drawRuns([m.vao for m in meshes], [m.shader for m in meshes], uniforms,
+                        [m._constantAttributes() for m in meshes])
+
+    def array(self, out=None): return self.ctx.array(unpremultiply=self.transparentBackground, out=out)
     def image(self      ): return self.ctx.image(     unpremultiply=self.transparentBackground)
     def  save(self, path): return self.ctx.save(path, unpremultiply=self.transparentBackground)
+    def saveAsync(self, path, **kwargs): return self.ctx.saveAsync(path, unpremultiply=self.transparentBackground, **kwargs)
 
     def scaledImage(self, scaleFactor):
         img = self.image()
@@ -469,6 +688,7 @@ class MeshRenderer:
         for frame in range(nframes):
             frameCallback(self, frame)
             vw.writeFrame()
+        vw.finish()
 
         if display:
             from IPython.display import Video
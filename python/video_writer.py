@@ -1,6 +1,7 @@
 from enum import Enum
 import os
 import subprocess as sp
+import numpy as np
 
 # Enum class whose values hold the corresponding FFmpeg command line options
 class Codec(Enum):
@@ -12,10 +13,17 @@ class VideoWriter:
     """
     Writes a raw image stream to an image sequence or a compressed video
     """
-    def __init__(self, outPath, inWidth, inHeight, codec=Codec.H264, framerate=30, quality='-crf 23', streaming=False, outWidth=None, outHeight=None, additionalFlags=[]):
+    def __init__(self, outPath, inWidth, inHeight, codec=Codec.H264, framerate=30, quality='-crf 23', streaming=False, outWidth=None, outHeight=None, additionalFlags=[], ringSize=4, pipeFormat='y4m', background=None):
         """
-        streaming - Whether to write a fragmented MP4 that can be watched as it
+        streaming  - Whether to write a fragmented MP4 that can be watched as it
         is being written (and is usable if the writing job dies before it finishes).
+        ringSize   - Number of frames buffered for the (background) encoder.
+        pipeFormat - How frames are sent to ffmpeg: 'y4m' converts them to
+                     YUV 4:2:0 (BT.709) ourselves, sending 1.5 bytes per pixel,
+                     while 'rgba' sends raw RGBA and leaves the conversion to ffmpeg.
+        background - Color over which transparent frames are composited for
+                     'y4m' (default: none; as with 'rgba', their alpha is
+                     dropped).
         """
         self. outPath     = outPath
         self. inWidth     = inWidth
@@ -28,7 +36,8 @@ class VideoWriter:
 
         quality = '-crf 23' if quality is None else quality
 
-        self.ffmpegProc = None
+        self.sink = None
+        self.pendingWrites = []
 
         if codec == Codec.ImgSeq:
             os.makedirs(outPath, exist_ok=True)
@@ -36,14 +45,21 @@ class VideoWriter:
             ffmpegCommand = ['ffmpeg', '-y']
             if streaming:
                 ffmpegCommand += ['-probesize', '32', '-flags', 'low_delay']
-            # Input settings (read raw pixel data from stdin)
-            ffmpegCommand += [
-                    '-f', 'rawvideo', '-pixel_format', 'rgba',
-                    '-video_size', f'{inWidth}x{inHeight}',
-                    '-framerate', str(framerate),
-                    '-i', '-']
+            # Input settings (read pixel data from stdin)
+            if pipeFormat == 'y4m':
+                # Frame size/rate are given in the stream header
+                ffmpegCommand += ['-f', 'yuv4mpegpipe', '-i', '-']
+            elif pipeFormat == 'rgba':
+                ffmpegCommand += [
+                        '-f', 'rawvideo', '-pixel_format', 'rgba',
+                        '-video_size', f'{inWidth}x{inHeight}',
+                        '-framerate', str(framerate),
+                        '-i', '-']
+            else: raise Exception(f'Unsupported pipe format {pipeFormat}')
             # Output settings
             ffmpegCommand += ['-pix_fmt', 'yuv420p'] # Quicktime-compatible YUV pixel format
+            if pipeFormat == 'y4m':
+                ffmpegCommand += ['-colorspace', 'bt709', '-color_primaries', 'bt709', '-color_trc', 'bt709', '-color_range', 'tv']
             if self.isResizing():
                 ffmpegCommand += ['-vf', f'scale={self.outWidth}:{self.outHeight}']
             ffmpegCommand += ['-vcodec'] + codec.value # Codec CLI settings are stored in enum
@@ -61,7 +77,11 @@ class VideoWriter:
             ffmpegCommand.append(outPath)
 
             # print(f"ffmpeg command: {' '.join(ffmpegCommand)}")
-            self.ffmpegProc = sp.Popen(ffmpegCommand, stdin=sp.PIPE)
+            # Frames are streamed to ffmpeg's stdin by a native writer thread.
+            from _offscreen_renderer import VideoSink, FrameSink
+            sinkFormat = FrameSink.Format.Y4M if pipeFormat == 'y4m' else FrameSink.Format.RGBA
+            self.sink = VideoSink(ffmpegCommand, inWidth, inHeight, ringSize, sinkFormat, float(framerate))
+            if background is not None: self.sink.setBackground(background)
 
     def frameDataSize(self):
         return self.inWidth * self.inHeight * 4 # We assume RGBA input
@@ -76,19 +96,44 @@ class VideoWriter:
         frameData = frameData.ravel()
         if len(frameData) != self.frameDataSize(): raise Exception('Unexpected frame data size')
 
-        if self.ffmpegProc is not None:
-            self.ffmpegProc.stdin.write(frameData)
+        if self.sink is not None:
+            self.sink.writeFrame(frameData)
         else:
             from PIL import Image
             img = Image.fromarray(frameData.reshape((self.inHeight, self.inWidth, 4)))
             if self.isResizing(): img = img.resize((self.outWidth, self.outHeight))
-            img.save(f'{self.outPath}/frame_{self.frameCounter:06d}.png')
+            img.save(self.framePath())
+
+        self.frameCounter += 1
 
+    def writeContextFrame(self, ctx, unpremultiply = True):
+        """
+        Write the image rendered by OpenGLContext `ctx` without passing its
+        pixel data through Python.
+        """
+        ctx.finish() # Copy image to internal buffer
+        if self.sink is not None:
+            self.sink.writeFrame(ctx, unpremultiply)
+        elif not self.isResizing():
+            self.pendingWrites.append(ctx.writePNGAsync(self.framePath(), unpremultiply))
+        else:
+            # Resizing image sequences are written by PIL
+            # (`VideoWriter.writeFrame` increments the frame counter).
+            VideoWriter.writeFrame(self, ctx.array(unpremultiply))
+            return
         self.frameCounter += 1
 
+    def framePath(self):
+        return f'{self.outPath}/frame_{self.frameCounter:06d}.png'
+
     def finish(self):
-        if self.ffmpegProc is not None:
-            self.ffmpegProc.stdin.close()
+        """
+        Wait for all frames to be written (and the video to be finalized).
+        """
+        if self.sink is not None:
+            self.sink.finish()
+        for w in self.pendingWrites: w.result()
+        self.pendingWrites = []
 
     def __del__(self):
         self.finish()
@@ -97,19 +142,19 @@ class ContextVideoWriter(VideoWriter):
     """
     Renders an OpenGL context to an image sequence or a compressed video
     """
-    def __init__(self, outPath, ctx, codec=Codec.H264, framerate=30, streaming=False, outWidth=None, outHeight=None):
-        super().__init__(outPath, ctx.width, ctx.height, codec=codec, framerate=framerate, streaming=streaming, outWidth=outWidth, outHeight=outHeight)
+    def __init__(self, outPath, ctx, codec=Codec.H264, framerate=30, streaming=False, outWidth=None, outHeight=None, **kwargs):
+        super().__init__(outPath, ctx.width, ctx.height, codec=codec, framerate=framerate, streaming=streaming, outWidth=outWidth, outHeight=outHeight, **kwargs)
         self.ctx = ctx
 
     def writeFrame(self):
-        super().writeFrame(self.ctx.array())
+        self.writeContextFrame(self.ctx)
 
 class MeshRendererVideoWriter(VideoWriter):
     """
     Creates an image sequence or a compressed video from  a MeshRenderer
     """
-    def __init__(self, outPath, mrenderer, codec=Codec.H264, framerate=30, streaming=False, outWidth=None, outHeight=None, quality=None):
-        super().__init__(outPath, mrenderer.ctx.width, mrenderer.ctx.height, codec=codec, framerate=framerate, streaming=streaming, outWidth=outWidth, outHeight=outHeight, quality=quality)
+    def __init__(self, outPath, mrenderer, codec=Codec.H264, framerate=30, streaming=False, outWidth=None, outHeight=None, quality=None, **kwargs):
+        super().__init__(outPath, mrenderer.ctx.width, mrenderer.ctx.height, codec=codec, framerate=framerate, streaming=streaming, outWidth=outWidth, outHeight=outHeight, quality=quality, **kwargs)
         self.mrenderer = mrenderer
         if codec != Codec.ImgSeq:
             # FFmpeg doesn't support transparent H264/HEVC output--it just
@@ -121,21 +166,20 @@ class MeshRendererVideoWriter(VideoWriter):
         Render a new frame into the video.
         """
         self.mrenderer.render(True)
-        super().writeFrame(self.mrenderer.array())
+        self.writeContextFrame(self.mrenderer.ctx, unpremultiply=self.mrenderer.transparentBackground)
 
-import numpy as np
 class PlotVideoWriter(VideoWriter):
     """
     Creates an image sequence or a compressed video from  a MeshRenderer
     """
-    def __init__(self, outPath, fig, dpi = 72, codec=Codec.H264, framerate=30, streaming=False, outWidth=None, outHeight=None, quality=None, tight_layout=True):
+    def __init__(self, outPath, fig, dpi = 72, codec=Codec.H264, framerate=30, streaming=False, outWidth=None, outHeight=None, quality=None, tight_layout=True, **kwargs):
         fig.set_dpi(dpi)
         self.dpi = dpi
         if tight_layout: fig.tight_layout()
         self.tight_layout = tight_layout
         fig.canvas.draw()
         fig.canvas.buffer_rgba().tobytes()
-        super().__init__(outPath, *fig.canvas.get_width_height(), codec=codec, framerate=framerate, streaming=streaming, outWidth=outWidth, outHeight=outHeight, quality=quality)
+        super().__init__(outPath, *fig.canvas.get_width_height(), codec=codec, framerate=framerate, streaming=streaming, outWidth=outWidth, outHeight=outHeight, quality=quality, **kwargs)
 
     def writeFrame(self, fig):
         """
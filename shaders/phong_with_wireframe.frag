@@ -1,17 +1,28 @@
 // Improved implementation of "Single-Pass Wireframe Rendering" technique.
 // Author:  Julian Panetta (jpanetta), julian.panetta@gmail.com
 #version 140
+#extension GL_ARB_explicit_attrib_location : require
 
-// Light and material parameters
-uniform vec3 lightEyePos;
-uniform vec3 diffuseIntensity;
-uniform vec3 ambientIntensity;
-uniform vec3 specularIntensity;
+// Per-frame state shared by all programs (uploaded once per frame by
+// MeshRenderer into a uniform buffer attached to binding point 0)
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    vec3 lightEyePos;
+    vec3 diffuseIntensity;
+    vec3 ambientIntensity;
+    vec3 specularIntensity;
+};
+
+// Material parameters
 uniform float shininess;
 uniform float alpha;    // Transparency
 
 uniform float lineWidth;
 
+// Whether we are accumulating translucent fragments for weighted blended
+// order-independent transparency (see WeightedBlendedOIT.hh)
+uniform bool oitPass;
+
 // Fragment shader inputs
 in vec3 v2f_eyePos;
 in vec3 v2f_eyeNormal;
@@ -21,8 +32,9 @@ in vec4 v2f_wireframe_color;
 // For drawing wireframe
 noperspective in vec3 v2f_barycentric; // Barycentric coordinate functions.
 
-// Fragment shader output (pixel color)
-out vec4 result;
+// Fragment shader outputs (pixel color, or the OIT accumulation targets)
+layout(location = 0) out vec4 result;
+layout(location = 1) out vec4 oitWeight;
 
 void main() {
     vec3 L = normalize(lightEyePos - v2f_eyePos);
@@ -48,5 +60,12 @@ void main() {
                     exp(-pow(max(dist + 0.9124443057840285280, 0.0), 4))); // dist + log(2)^(1/4) centers transition from 1 to 0 around the edge.
     }
 
-    result = color;
+    if (oitPass) {
+        // Weight emphasizing nearby, opaque fragments (McGuire and Bavoil 2013, eq. 7)
+        float a = clamp(color.a, 0.0, 1.0);
+        float w = clamp(pow(min(1.0, a * 10.0) + 0.01, 3.0) * 1e8 * pow(1.0 - 0.9 * gl_FragCoord.z, 3.0), 1e-2, 3e3);
+        result    = vec4(color.rgb * a * w, a);
+        oitWeight = vec4(a * w);
+    }
+    else result = color;
 }
@@ -9,9 +9,18 @@ layout (location = 1) in vec3  v_normal;          // bind v_normal          to a
 layout (location = 2) in vec4  v_color;           // bind v_color           to attribute 2
 layout (location = 3) in vec4  v_wireframe_color; // bind v_wireframe_color to attribute 3
 
+// Per-frame state shared by all programs (uploaded once per frame by
+// MeshRenderer into a uniform buffer attached to binding point 0)
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    vec3 lightEyePos;
+    vec3 diffuseIntensity;
+    vec3 ambientIntensity;
+    vec3 specularIntensity;
+};
+
 // Transformation matrices
 uniform mat4 modelViewMatrix;
-uniform mat4 projectionMatrix;
 uniform mat3 normalMatrix;
 
 // Vertex shader outputs
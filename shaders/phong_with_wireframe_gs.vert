@@ -0,0 +1,42 @@
+// Vertex shader for the geometry shader variant of the wireframe rendering
+// in phong_with_wireframe.vert: the barycentric coordinates are generated per
+// triangle by phong_with_wireframe.geom, so indexed meshes can be drawn
+// without replicating their vertex data for each triangle corner.
+#version 150
+#extension GL_ARB_explicit_attrib_location : enable
+
+// Vertex attributes
+layout (location = 0) in vec3  v_position;        // bind v_position        to attribute 0
+layout (location = 1) in vec3  v_normal;          // bind v_normal          to attribute 1
+layout (location = 2) in vec4  v_color;           // bind v_color           to attribute 2
+layout (location = 3) in vec4  v_wireframe_color; // bind v_wireframe_color to attribute 3
+
+// Per-frame state shared by all programs (uploaded once per frame by
+// MeshRenderer into a uniform buffer attached to binding point 0)
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    vec3 lightEyePos;
+    vec3 diffuseIntensity;
+    vec3 ambientIntensity;
+    vec3 specularIntensity;
+};
+
+// Transformation matrices
+uniform mat4 modelViewMatrix;
+uniform mat3 normalMatrix;
+
+// Vertex shader outputs (passed through by the geometry shader)
+out vec3 vs_eyePos;
+out vec3 vs_eyeNormal;
+out vec4 vs_color;
+out vec4 vs_wireframe_color;
+
+void main() {
+    vec4 eyePos = modelViewMatrix * vec4(v_position, 1.0);
+    vs_eyePos          = vec3(eyePos);
+    vs_eyeNormal       = normalMatrix * v_normal;
+    vs_color           = v_color;
+    vs_wireframe_color = v_wireframe_color;
+
+    gl_Position = projectionMatrix * eyePos;
+}
@@ -16,15 +16,20 @@ uniform float arrowAlignment; // offset of tail from "arrowPos" in units of arro
 uniform float arrowRelativeScreenSize; // desired length in pixels of the longest arrow relative to the viewport size
 uniform float targetDepth;
 
-uniform vec3 lightEyePos;
-uniform vec3 diffuseIntensity;
-uniform vec3 ambientIntensity;
-uniform vec3 specularIntensity;
+// Per-frame state shared by all programs (uploaded once per frame by
+// MeshRenderer into a uniform buffer attached to binding point 0)
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    vec3 lightEyePos;
+    vec3 diffuseIntensity;
+    vec3 ambientIntensity;
+    vec3 specularIntensity;
+};
+
 uniform float alpha;    // Transparency
 
 // Transformation matrices
 uniform mat4 modelViewMatrix;
-uniform mat4 projectionMatrix;
 uniform mat3 normalMatrix;
 
 // output
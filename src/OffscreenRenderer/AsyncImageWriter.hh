@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////////
+// AsyncImageWriter.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Background encoding of rendered frames into PNG/PPM files.
+//  Each request snapshots the frame into a pooled buffer (a single memcpy
+//  on the calling thread); the unpremultiplication, PNG deflate and file
+//  output then happen on a bounded pool of worker threads. When the queue is
+//  full, new requests block until a worker catches up.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef ASYNCIMAGEWRITER_HH
+#define ASYNCIMAGEWRITER_HH
+
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if PNG_WRITER
+#include "write_png.h"
+#endif
+#include "write_ppm.h"
+#include "ImageConversion.hh"
+#include "ThreadPool.hh"
+
+struct AsyncImageWriter {
+    // See `ThreadPool` for the meaning of the parameters.
+    AsyncImageWriter(size_t numThreads = 0, size_t maxQueued = 0)
+        : m_pool(numThreads, maxQueued) { }
+
+    // Write the `width` x `height` premultiplied RGBA image `data` (in
+    // OpenGL's bottom-to-top row order) to `path`. The image is copied before
+    // returning, so the caller may immediately render the next frame.
+    // Errors (e.g., failure to open `path`) are reported by the future.
+    std::future<void> writePNG(const std::string &path, int width, int height, const unsigned char *data,
+                               bool unpremultiply = true, int compressionLevel = -1, int filters = -1) {
+#if PNG_WRITER
+        auto snapshot = m_snapshot(data, 4 * size_t(width) * height);
+        return m_pool.submit([this, path, width, height, snapshot, unpremultiply, compressionLevel, filters]() {
+            BufferReturner returner{this, snapshot};
+            if (!unpremultiply) {
+                write_png_RGBA(path, width, height, snapshot->data(), /* verticalFlip = */ true, compressionLevel, filters);
+                return;
+            }
+            Buffer &scratch = m_scratchBuffer(snapshot->size());
+            convertImage(snapshot->data(), width, height, scratch.data(), /* unpremultiply = */ true, /* flip = */ true);
+            write_png_RGBA(path, width, height, scratch.data(), /* verticalFlip = */ false, compressionLevel, filters);
+        });
+#else
+        throw std::runtime_error("writePNG disabled because libpng is not available");
+#endif
+    }
+
+    std::future<void> writePPM(const std::string &path, int width, int height, const unsigned char *data,
+                               bool unpremultiply = true) {
+        auto snapshot = m_snapshot(data, 4 * size_t(width) * height);
+        return m_pool.submit([this, path, width, height, snapshot, unpremultiply]() {
+            BufferReturner returner{this, snapshot};
+            Buffer &scratch = m_scratchBuffer(3 * size_t(width) * height);
+            convertImage(snapshot->data(), width, height, scratch.data(), unpremultiply, /* flip = */ true, /* dropAlpha = */ true);
+            write_ppm_RGB(path, width, height, scratch.data());
+        });
+    }
+
+    // Block until all queued writes have finished.
+    void wait() { m_pool.wait(); }
+
+    size_t numThreads() const { return m_pool.numThreads(); }
+    size_t maxQueued()  const { return m_pool.maxQueued(); }
+
+    // Writer shared by all contexts' `writePNGAsync`/`writePPMAsync`.
+    static AsyncImageWriter &global() { return *m_globalInstance(); }
+
+    // Replace the shared writer with one using the given pool parameters
+    // (after finishing the old writer's queued writes). This must not be
+    // called while other threads are submitting writes.
+    static void configureGlobal(size_t numThreads, size_t maxQueued = 0) {
+        auto &instance = m_globalInstance();
+        instance.reset();
+        instance.reset(new AsyncImageWriter(numThreads, maxQueued));
+    }
+
+private:
+    using Buffer = std::vector<unsigned char>;
+    using BufferPtr = std::shared_ptr<Buffer>;
+
+    // Copy `size` bytes of `data` into a buffer from the pool.
+    BufferPtr m_snapshot(const unsigned char *data, size_t size) {
+        BufferPtr result;
+        {
+            std::lock_guard<std::mutex> lock(m_bufferMutex);
+            if (!m_freeBuffers.empty()) {
+                result = std::move(m_freeBuffers.back());
+                m_freeBuffers.pop_back();
+            }
+        }
+        if (!result) result = std::make_shared<Buffer>();
+        result->resize(size);
+        std::memcpy(result->data(), data, size);
+        return result;
+    }
+
+    // Return a snapshot to the pool once its write has finished (or failed).
+    struct BufferReturner {
+        AsyncImageWriter *writer;
+        BufferPtr buffer;
+        ~BufferReturner() {
+            std::lock_guard<std::mutex> lock(writer->m_bufferMutex);
+            writer->m_freeBuffers.push_back(std::move(buffer));
+        }
+    };
+
+    // Per-worker storage for the converted image.
+    static Buffer &m_scratchBuffer(size_t size) {
+        static thread_local Buffer scratch;
+        scratch.resize(size);
+        return scratch;
+    }
+
+    static std::unique_ptr<AsyncImageWriter> &m_globalInstance() {
+        static std::unique_ptr<AsyncImageWriter> instance(new AsyncImageWriter());
+        return instance;
+    }
+
+    // The pool is declared last so that its destructor (which finishes the
+    // queued writes) runs before the buffer pool is destroyed.
+    std::mutex m_bufferMutex;
+    std::vector<BufferPtr> m_freeBuffers;
+    ThreadPool m_pool;
+};
+
+#endif /* end of include guard: ASYNCIMAGEWRITER_HH */
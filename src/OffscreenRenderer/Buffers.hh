@@ -3,6 +3,11 @@
 ////////////////////////////////////////////////////////////////////////////////
 /*! @file
 //  Manage VAOs, VBOs
+//
+//  Buffers are shared by the contexts of a share group, but VAOs are not: a
+//  mesh uploaded through a VAO in one context is drawn in another context
+//  of the group through a view VAO created there (see the
+//  `VertexArrayObject(ctx, source)` constructor).
 */
 //  Author:  Julian Panetta (jpanetta), julian.panetta@gmail.com
 //  Created:  09/23/2020 17:40:22
@@ -10,12 +15,19 @@
 #ifndef BUFFERS_HH
 #define BUFFERS_HH
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
 #include "GLTypeTraits.hh"
 #include "RAIIGLResource.hh"
 #include "UASetters.hh"
 
 // We need to use row-major types in order to interpret each row as giving a
 // vertex's attributes (following libigl conventions).
+template<typename T>
+using MXR   = Eigen::Matrix<T           , Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
 using MXfR  = Eigen::Matrix<float       , Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
 using MXuiR = Eigen::Matrix<unsigned int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
 
@@ -24,63 +36,289 @@ struct BufferObject : RAIIGLResource<BufferObject> {
     using Base::id;
 
     BufferObject() : Base(std::weak_ptr<OpenGLContext>()) { } // Allow creation of a dummy, unallocated buffer object not tied to any context
-    BufferObject(std::weak_ptr<OpenGLContext> ctx, const Eigen::Ref<const MXfR > &A) : Base(ctx) { glGenBuffers(1, &id); this->m_validateConstruction(); updateData(A); }
-    BufferObject(std::weak_ptr<OpenGLContext> ctx, const Eigen::Ref<const MXuiR> &A) : Base(ctx) { glGenBuffers(1, &id); this->m_validateConstruction(); updateData(A); }
+    template<class Derived>
+    BufferObject(std::weak_ptr<OpenGLContext> ctx, const Eigen::MatrixBase<Derived> &A) : Base(ctx) { glGenBuffers(1, &id); this->m_validateConstruction(); updateData(A); }
 
-    void bind(GLenum target) const { glBindBuffer(target, id); }
+    BufferObject(BufferObject &&) = default;
+    BufferObject &operator=(BufferObject &&) = default;
+    ~BufferObject() { this->m_release(); } // `m_enqueueDeletion` needs `m_fences`
+
+    void bind(GLenum target) const {
+        if (auto *cache = OpenGLContext::currentStateCache()) cache->bindBuffer(target, id);
+        else glBindBuffer(target, id);
+    }
 
+    // Replace the buffer's contents with the rows of `A`. The existing storage
+    // is reused when the size and usage are unchanged; note that overwriting
+    // data still needed by pending draw calls makes the driver wait for them
+    // (see `setStreaming` for data replaced every frame).
     template<class Derived>
     void updateData(const Eigen::MatrixBase<Derived> &A,
                     GLenum usage = GL_DYNAMIC_DRAW) { // In our typical use cases, buffers may change every frame...
+        const size_t rowBytes = A.cols() * sizeof(typename Derived::Scalar),
+                     bytes    = A.rows() * rowBytes;
+        const void *data = A.derived().data();
+        if (m_streaming && m_persistent) m_writeRing(data, bytes);
+        else {
+            if (m_mapped) m_releaseRing(); // streaming was disabled
+            bind(GL_ARRAY_BUFFER);
+            if (m_streaming) {
+                // Orphan the old store so that pending draw calls can keep
+                // reading it while we fill the new one.
+                glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, usage);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+            }
+            else if ((bytes == m_size) && (usage == m_usage)) glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+            else                                               glBufferData(GL_ARRAY_BUFFER, bytes, data, usage);
+        }
+        m_size     = bytes;
+        m_usage    = usage;
+        m_rowBytes = rowBytes;
+        m_count    = A.rows();
+    }
+
+    // Overwrite rows [rowBegin, rowBegin + A.rows()) of the buffer, keeping
+    // the rest of its contents.
+    template<class Derived>
+    void updateRange(size_t rowBegin, const Eigen::MatrixBase<Derived> &A) {
+        if (m_streaming) throw std::logic_error("updateRange is not supported for streaming buffers (use updateData)");
+        if (A.cols() * sizeof(typename Derived::Scalar) != m_rowBytes) throw std::runtime_error("updateRange row size mismatch");
+        if (rowBegin + A.rows() > m_count) throw std::runtime_error("updateRange rows out of bounds");
         bind(GL_ARRAY_BUFFER);
-        glBufferData(GL_ARRAY_BUFFER,
-                     A.size() * sizeof(typename Derived::Scalar),
-                     A.derived().data(),
-                     usage); // We assume buffers change rarely
-        m_count = A.rows();
+        glBufferSubData(GL_ARRAY_BUFFER, rowBegin * m_rowBytes, A.rows() * m_rowBytes, A.derived().data());
+        glCheckError("updateRange");
     }
 
+    // Streaming mode for data replaced on every frame: each `updateData`
+    // writes into storage not used by pending draw calls, avoiding stalls.
+    // When GL_ARB_buffer_storage is available, the buffer holds `numSegments`
+    // copies of the data in a persistently mapped ring, and a segment is
+    // reused only once the draw calls reading it have completed; otherwise, the
+    // store is orphaned (reallocated) on each update.
+    // The mode takes effect at the next `updateData`, which may change the
+    // buffer's name (`id`); draw calls must use the data at `offset()`.
+    void setStreaming(bool enable, size_t numSegments = 3) {
+        if (numSegments < 2) throw std::runtime_error("Streaming requires at least two segments");
+        auto ctx = m_context();
+        if (!ctx) throw std::runtime_error("Buffer is not allocated");
+        m_streaming = enable;
+        m_persistent = enable && ctx->hasExtension("GL_ARB_buffer_storage");
+        m_numSegments = numSegments;
+    }
+
+    bool streaming()          const { return m_streaming; }
+    bool persistentlyMapped() const { return m_mapped != nullptr; }
+
+    // Byte offset of the current data within the buffer.
+    size_t offset() const { return m_mapped ? m_segment * m_segmentStride : 0; }
+
     size_t count() const { return m_count; }
 
 private:
     friend struct RAIIGLResource<BufferObject>;
-    void m_delete() { glDeleteBuffers(1, &id); }
+    void m_enqueueDeletion(GLDeletionQueue::Batch &b) {
+        for (GLsync &f : m_fences) { b.add(f); f = nullptr; }
+        b.add(GLDeletionQueue::BUFFER, id); // deleting also unmaps the ring
+    }
+
+    void m_writeRing(const void *data, size_t bytes) {
+        if (m_mapped && (bytes <= m_segmentStride) && (m_fences.size() == m_numSegments)) {
+            // Fence the draw calls issued with the current segment, then move
+            // on to the next one, waiting for any draws still reading it.
+            m_fences[m_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            m_segment = (m_segment + 1) % m_fences.size();
+            if (GLsync &f = m_fences[m_segment]) {
+                GLenum status;
+                while ((status = glClientWaitSync(f, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) == GL_TIMEOUT_EXPIRED) { }
+                glDeleteSync(f);
+                f = nullptr;
+                if (status == GL_WAIT_FAILED) throw std::runtime_error("glClientWaitSync failed");
+            }
+        }
+        else {
+            if (m_mapped) m_releaseRing();
+            m_segmentStride = (bytes + 255) & ~size_t(255); // keep segment offsets aligned for any attribute type
+            const GLsizeiptr size = std::max<size_t>(m_segmentStride, 1) * m_numSegments;
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            bind(GL_ARRAY_BUFFER);
+            glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+            m_mapped = static_cast<unsigned char *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+            glCheckError("allocate streaming buffer");
+            if (!m_mapped) throw std::runtime_error("glMapBufferRange failed");
+            m_fences.assign(m_numSegments, nullptr);
+            m_segment = 0;
+        }
+        std::memcpy(m_mapped + m_segment * m_segmentStride, data, bytes);
+    }
+
+    // Discard the ring. Its storage is immutable, so we need a new buffer name.
+    void m_releaseRing() {
+        m_deleteFences();
+        m_fences.clear();
+        if (auto *cache = OpenGLContext::currentStateCache()) cache->forgetBuffer(id);
+        glDeleteBuffers(1, &id);
+        glGenBuffers(1, &id);
+        m_mapped = nullptr;
+        m_segment = 0;
+        m_size = 0;
+        m_usage = GL_NONE;
+    }
+
+    void m_deleteFences() {
+        for (GLsync &f : m_fences) {
+            if (f) glDeleteSync(f);
+            f = nullptr;
+        }
+    }
+
     size_t m_count = 0;
+    size_t m_size = 0, m_rowBytes = 0; // in bytes
+    GLenum m_usage = GL_NONE;
+
+    bool m_streaming = false, m_persistent = false;
+    size_t m_numSegments = 3, m_segment = 0, m_segmentStride = 0;
+    unsigned char *m_mapped = nullptr;
+    std::vector<GLsync> m_fences; // one per segment; null if the segment is free
 };
 
 struct VertexArrayObject : RAIIGLResource<VertexArrayObject> {
     using Base = RAIIGLResource<VertexArrayObject>;
     using Base::id;
+    static constexpr bool shareable = false; // container object
 
     VertexArrayObject(std::weak_ptr<OpenGLContext> ctx) : Base(ctx) {
         glGenVertexArrays(1, &id);
         this->m_validateConstruction();
     }
 
+    // View in context `ctx` of `source`, a VAO created by another context
+    // of the same share group: the view draws `source`'s (shared) attribute
+    // and index buffers, following any later changes to them, which must be
+    // made through `source`.
+    VertexArrayObject(std::weak_ptr<OpenGLContext> ctx, std::shared_ptr<const VertexArrayObject> source)
+        : VertexArrayObject(ctx)
+    {
+        if (!source) throw std::runtime_error("Null source VAO");
+        if (source->m_source) source = source->m_source; // view the original
+        if (!this->shareGroup() || (this->shareGroup() != source->shareGroup()))
+            throw std::runtime_error("A VAO view must be created in the share group of its source");
+        m_source = std::move(source);
+    }
+
+    bool isView() const { return m_source != nullptr; }
+
     // Create/update a buffer with data for attribute `loc`.
     // Each row of A is interpreted as a vertex attribute, so A's column size
     // determines the attribute size.
     // If `instanced` is `true` the buffer is interpreted as holding per-instance
     // rather than per-vertex data.
     void setAttribute(int loc, const Eigen::Ref<const MXfR> &A, bool instanced = false) {
+        m_setAttribute<float>(loc, A, instanced, A.cols(), GL_FLOAT, AttributeMode::Float);
+    }
+
+    // Compact attribute formats, trading precision for memory and bandwidth.
+    // Integer components read as floats in [0, 1] ([-1, 1] for signed types)
+    // by the shader, e.g., 8-bit colors:
+    template<typename T>
+    void setNormalizedAttribute(int loc, const Eigen::Ref<const MXR<T>> &A, bool instanced = false) {
+        static_assert(std::is_integral<T>::value, "Normalized attributes must have integer components");
+        m_setAttribute<T>(loc, A, instanced, A.cols(), GLComponentType<T>::type, AttributeMode::Normalized);
+    }
+
+    // Integer components read unconverted by `int`/`uint` (`ivec`/`uvec`) shader inputs:
+    template<typename T>
+    void setIntegerAttribute(int loc, const Eigen::Ref<const MXR<T>> &A, bool instanced = false) {
+        static_assert(std::is_integral<T>::value, "Integer attributes must have integer components");
+        m_setAttribute<T>(loc, A, instanced, A.cols(), GLComponentType<T>::type, AttributeMode::Integer);
+    }
+
+    // Half-precision floats (e.g., `A.cast<Eigen::half>()`):
+    void setHalfAttribute(int loc, const Eigen::Ref<const MXR<Eigen::half>> &A, bool instanced = false) {
+        m_setAttribute<Eigen::half>(loc, A, instanced, A.cols(), GL_HALF_FLOAT, AttributeMode::Float);
+    }
+
+    // Vectors with components in [-1, 1] (e.g., normals) packed into 32 bits:
+    // 10 bits for each of x, y, z and 2 bits for w (0 if `A` has 3 columns).
+    // The shader reads a vec4 (or a vec3, ignoring w).
+    void setPackedAttribute(int loc, const Eigen::Ref<const MXfR> &A, bool instanced = false) {
+        if ((A.cols() != 3) && (A.cols() != 4)) throw std::runtime_error("Packed attributes must have 3 or 4 components");
+        MXR<GLuint> packed(A.rows(), 1);
+        auto quantize = [](float x, float scale, int bits) {
+            const float q = std::round(std::min(std::max(x, -1.0f), 1.0f) * scale);
+            return GLuint(GLint(q)) & ((1u << bits) - 1); // two's complement
+        };
+        for (int i = 0; i < A.rows(); ++i) {
+            packed(i, 0) = quantize(A(i, 0), 511.0f, 10)
+                         | quantize(A(i, 1), 511.0f, 10) << 10
+                         | quantize(A(i, 2), 511.0f, 10) << 20
+                         | ((A.cols() == 4) ? quantize(A(i, 3), 1.0f, 2) << 30 : 0u);
+        }
+        m_setAttribute<GLuint>(loc, packed, instanced, 4, GL_INT_2_10_10_10_REV, AttributeMode::Normalized);
+    }
+
+    // Create/update a single buffer holding several interleaved attributes:
+    // row i of `A` holds vertex i's values for attributes `locs[0], locs[1], ...`,
+    // which occupy `sizes[0], sizes[1], ...` consecutive columns. This needs
+    // one upload and one buffer per draw, and keeps each vertex's data
+    // together in memory for the vertex fetch. Setting the same list of
+    // locations again updates the existing buffer.
+    void setInterleavedAttributes(const std::vector<int> &locs, const std::vector<int> &sizes,
+                                  const Eigen::Ref<const MXfR> &A, bool instanced = false) {
+        if (locs.empty() || (locs.size() != sizes.size())) throw std::runtime_error("Expected one size per interleaved attribute");
+        int cols = 0;
+        for (int size : sizes) {
+            if ((size < 1) || (size > 4)) throw std::runtime_error("Invalid attribute size " + std::to_string(size));
+            cols += size;
+        }
+        if (cols != A.cols()) throw std::runtime_error("Interleaved attribute sizes do not match the data's column count");
+        m_checkNotView();
+
         bind();
-        auto it = m_attributes.find(loc);
-        if (it == m_attributes.end()) it = m_attributes.emplace(loc, BufferObject(this->m_ctx, A)).first;
+        int g = m_interleavedIndex(locs[0]);
+        if ((g >= 0) && (m_interleaved[g].locs == locs) && m_interleaved[g].buffer.allocated())
+            m_interleaved[g].buffer.updateData(A);
         else {
-            if (!it->second.allocated()) it->second = BufferObject(this->m_ctx, A); // former attribute at `loc` was a dummy/empty; we must allocate a real one.
-            else                         it->second.updateData(A);
+            for (int loc : locs) {
+                m_detachInterleaved(loc);
+                m_attributes.erase(loc);
+                m_attributes.emplace(loc, BufferObject()); // placeholder for `draw`'s validation
+            }
+            m_interleaved.push_back(InterleavedBuffer{BufferObject(this->m_ctx, A), locs});
+            g = m_interleaved.size() - 1;
         }
-        const auto &buf = it->second;
+
+        const auto &buf = m_interleaved[g].buffer;
         buf.bind(GL_ARRAY_BUFFER);
-        glVertexAttribPointer(loc,
-                              A.cols(), GL_FLOAT, // # cols floats per vertex
-                              GL_FALSE,  // Don't normalize
-                              0, 0); // No gap between vertex data, and no offset from array beginning.
-        if (instanced)
-            glVertexAttribDivisor(loc, 1);
-        glCheckError();
-        glEnableVertexAttribArray(loc);
-        glCheckError();
+        size_t offset = buf.offset();
+        for (size_t i = 0; i < locs.size(); ++i) {
+            glVertexAttribPointer(locs[i], sizes[i], GL_FLOAT, GL_FALSE, A.cols() * sizeof(float), reinterpret_cast<const void *>(offset));
+            glVertexAttribDivisor(locs[i], instanced ? 1 : 0);
+            glEnableVertexAttribArray(locs[i]);
+            m_formats[locs[i]] = AttributeFormat{sizes[i], GL_FLOAT, AttributeMode::Float, GLsizei(A.cols() * sizeof(float)), offset, instanced, false};
+            offset += sizes[i] * sizeof(float);
+        }
+        ++m_layoutVersion;
+        glCheckError("setInterleavedAttributes");
+    }
+
+    // Overwrite rows [rowBegin, rowBegin + A.rows()) of attribute `loc`.
+    void updateAttributeRange(int loc, size_t rowBegin, const Eigen::Ref<const MXfR> &A) {
+        m_checkNotView();
+        if (m_interleavedIndex(loc) >= 0) throw std::runtime_error("Attribute " + std::to_string(loc) + " is interleaved (use setInterleavedAttributes)");
+        auto it = m_attributes.find(loc);
+        if ((it == m_attributes.end()) || !it->second.allocated()) throw std::runtime_error("Attribute " + std::to_string(loc) + " is not set in VAO");
+        it->second.updateRange(rowBegin, A);
+    }
+
+    // Enable/disable streaming (see `BufferObject::setStreaming`) for the
+    // buffer of attribute `loc`, which is replaced at every `setAttribute`.
+    void setAttributeStreaming(int loc, bool enable = true, size_t numSegments = 3) {
+        m_checkNotView();
+        int g = m_interleavedIndex(loc);
+        if (g >= 0) { m_interleaved[g].buffer.setStreaming(enable, numSegments); return; }
+        auto it = m_attributes.find(loc);
+        if ((it == m_attributes.end()) || !it->second.allocated()) throw std::runtime_error("Attribute " + std::to_string(loc) + " is not set in VAO");
+        it->second.setStreaming(enable, numSegments);
     }
 
     template<typename T>
@@ -89,45 +327,89 @@ struct VertexArrayObject : RAIIGLResource<VertexArrayObject> {
         // part of the VAO's state. Therefore this method should
         // be called before each draw of the VAO to make sure someone
         // else didn't change the value...
+        if (m_source) {
+            // The generic value is per context, so views set their own.
+            auto it = m_source->m_formats.find(loc);
+            if ((it == m_source->m_formats.end()) || !it->second.constant)
+                throw std::runtime_error("Attribute " + std::to_string(loc) + " is not constant in the view's source VAO");
+            bind();
+            detail::setAttribute(GLuint(loc), a);
+            glCheckError();
+            return;
+        }
         if (m_attributes.count(loc) == 0) {
             // Create a dummy, empty attribute to satisfy validation in `draw`
             m_attributes[loc] = BufferObject(); 
         }
 
         bind();
+        m_detachInterleaved(loc);
         glDisableVertexAttribArray(GLuint(loc));
         detail::setAttribute(GLuint(loc), a);
+        auto it = m_formats.find(loc);
+        if ((it == m_formats.end()) || !it->second.constant) {
+            m_formats[loc] = AttributeFormat{0, GL_NONE, AttributeMode::Float, 0, 0, false, true};
+            ++m_layoutVersion;
+        }
 
         glCheckError();
     }
 
+    // The indices are stored using the smallest type (8, 16 or 32 bits)
+    // able to represent the largest index.
     void setIndexBuffer(const Eigen::Ref<const MXuiR> &A) {
+        m_checkNotView();
         bind();
         glCheckError();
         Eigen::Map<const Eigen::Matrix<unsigned int, Eigen::Dynamic, 1>> flatA(A.data(), A.size());
-        if (m_indexBuffer.allocated()) m_indexBuffer.updateData(flatA);
-        else  m_indexBuffer = BufferObject(this->m_ctx, flatA);
+        const GLuint maxIndex = (A.size() > 0) ? flatA.maxCoeff() : 0;
+        if      (maxIndex <= 0xFF  ) { m_setIndexData(flatA.cast<GLubyte >().eval()); m_indexType = GL_UNSIGNED_BYTE;  }
+        else if (maxIndex <= 0xFFFF) { m_setIndexData(flatA.cast<GLushort>().eval()); m_indexType = GL_UNSIGNED_SHORT; }
+        else                         { m_setIndexData(flatA);                         m_indexType = GL_UNSIGNED_INT;   }
         m_indexBuffer.bind(GL_ELEMENT_ARRAY_BUFFER);
+        ++m_layoutVersion;
         glCheckError();
     }
 
+    GLenum indexType() const { return m_data().m_indexType; }
+
+    // Primitives assembled by `draw`: GL_TRIANGLES (default), GL_POINTS,
+    // GL_LINES, GL_LINE_STRIP, GL_LINE_LOOP, GL_TRIANGLE_STRIP, ...
+    void setPrimitiveMode(GLenum mode) { m_checkNotView(); m_primitiveMode = mode; }
+    GLenum primitiveMode() const { return m_data().m_primitiveMode; }
+
     void unsetIndexBuffer() {
+        m_checkNotView();
         bind();
         m_indexBuffer = BufferObject();
+        ++m_layoutVersion;
         glCheckError();
     }
 
-    void bind() const { glBindVertexArray(id); }
+    void bind() const {
+        if (auto *cache = OpenGLContext::currentStateCache()) cache->bindVertexArray(id);
+        else glBindVertexArray(id);
+        m_syncView();
+    }
 
     void draw(const Shader &s, size_t instances = 1, bool ignoreExtraneousAttributes = false) const {
+        drawRange(s, 0, numElements(), instances, ignoreExtraneousAttributes);
+    }
+
+    // Draw only elements [first, first + count): indices of the index buffer
+    // if there is one, vertices otherwise (e.g., a range of triangles of a
+    // depth-sorted index buffer).
+    void drawRange(const Shader &s, size_t first, size_t count, size_t instances = 1, bool ignoreExtraneousAttributes = false) const {
+        if (first + count > numElements()) throw std::runtime_error("Draw range out of bounds");
+        const VertexArrayObject &d = m_data();
         size_t numChecked = 0;
         for (const auto &attr : s.getAttributes()) {
-            if (m_attributes.count(attr.loc)) ++numChecked;
+            if (d.m_attributes.count(attr.loc)) ++numChecked;
             else if (!attr.isBuiltIn) { // Ignore auto-generated attributes like gl_VertexID
                 throw std::runtime_error("Attribute " + std::to_string(attr.loc) + " (" + attr.name + ") is not set in VAO");
             }
         }
-        if (!ignoreExtraneousAttributes && (numChecked != m_attributes.size())) throw std::runtime_error("Extraneous attributes found in VAO");
+        if (!ignoreExtraneousAttributes && (numChecked != d.m_attributes.size())) throw std::runtime_error("Extraneous attributes found in VAO");
         if (!s.allUniformsSet()) {
             std::string msg = "Unset uniform(s):";
             for (const Uniform &u : s.getUniforms())
@@ -141,25 +423,153 @@ struct VertexArrayObject : RAIIGLResource<VertexArrayObject> {
         bind();
         glCheckError();
 
-        if (m_indexBuffer.allocated()) {
+        if (d.m_indexBuffer.allocated()) {
             // std::cout << "glDrawElements (indexed)" << std::endl;
-            glDrawElementsInstanced(GL_TRIANGLES, m_indexBuffer.count(), GL_UNSIGNED_INT, NULL, instances);
+            const size_t indexSize = (d.m_indexType == GL_UNSIGNED_BYTE) ? 1 : ((d.m_indexType == GL_UNSIGNED_SHORT) ? 2 : 4);
+            glDrawElementsInstanced(d.m_primitiveMode, count, d.m_indexType, reinterpret_cast<const void *>(d.m_indexBuffer.offset() + first * indexSize), instances);
         }
         else {
             // std::cout << "glDrawArrays (unindexed)" << std::endl;
-            glDrawArraysInstanced(GL_TRIANGLES, 0, m_attributes.at(0).count(), instances);
+            glDrawArraysInstanced(d.m_primitiveMode, first, count, instances);
         }
         glCheckError();
     }
 
-    const std::map<int, BufferObject> &attributeBuffers() const { return m_attributes;  }
-    const BufferObject                &indexBuffer()      const { return m_indexBuffer; }
+    // Number of indices (if indexed) or vertices drawn by `draw`.
+    size_t numElements() const {
+        const VertexArrayObject &d = m_data();
+        if (d.m_indexBuffer.allocated()) return d.m_indexBuffer.count();
+        const int g = d.m_interleavedIndex(0);
+        return (g >= 0) ? d.m_interleaved[g].buffer.count() : d.m_attributes.at(0).count();
+    }
+
+    const std::map<int, BufferObject> &attributeBuffers() const { return m_data().m_attributes;  }
+
+    // Buffer holding attribute `loc`'s data (possibly interleaved with others).
+    const BufferObject &attributeBuffer(int loc) const {
+        const VertexArrayObject &d = m_data();
+        const int g = d.m_interleavedIndex(loc);
+        return (g >= 0) ? d.m_interleaved[g].buffer : d.m_attributes.at(loc);
+    }
+    const BufferObject                &indexBuffer()      const { return m_data().m_indexBuffer; }
 
 private:
+    enum class AttributeMode { Float, Normalized, Integer };
+
+    // How an attribute is sourced from its buffer (or a constant value),
+    // recorded so that views can replicate it.
+    struct AttributeFormat {
+        GLint size;
+        GLenum type;
+        AttributeMode mode;
+        GLsizei stride;
+        size_t offset;
+        bool instanced, constant;
+    };
+    std::map<int, AttributeFormat> m_formats;
+    size_t m_layoutVersion = 0; // incremented whenever `m_formats` or the buffers change
+
+    // For views: the VAO whose buffers are drawn, the version of its layout
+    // last applied to this VAO, and the attributes enabled by it.
+    std::shared_ptr<const VertexArrayObject> m_source;
+    mutable size_t m_syncedVersion = size_t(-1);
+    mutable std::vector<int> m_syncedLocs;
+
+    const VertexArrayObject &m_data() const { return m_source ? *m_source : *this; }
+
+    void m_checkNotView() const {
+        if (m_source) throw std::runtime_error("The attributes of a VAO view must be set through its source");
+    }
+
+    // Apply the source's current layout to this view (which must be bound).
+    void m_syncView() const {
+        if (!m_source || (m_syncedVersion == m_source->m_layoutVersion)) return;
+        for (int loc : m_syncedLocs)
+            if (m_source->m_formats.count(loc) == 0) glDisableVertexAttribArray(loc);
+        m_syncedLocs.clear();
+        for (const auto &entry : m_source->m_formats) {
+            const int loc = entry.first;
+            const AttributeFormat &f = entry.second;
+            m_syncedLocs.push_back(loc);
+            if (f.constant) { glDisableVertexAttribArray(loc); continue; }
+            m_source->attributeBuffer(loc).bind(GL_ARRAY_BUFFER);
+            const void *offset = reinterpret_cast<const void *>(f.offset);
+            if (f.mode == AttributeMode::Integer) glVertexAttribIPointer(loc, f.size, f.type, f.stride, offset);
+            else                                  glVertexAttribPointer (loc, f.size, f.type, (f.mode == AttributeMode::Normalized) ? GL_TRUE : GL_FALSE, f.stride, offset);
+            glVertexAttribDivisor(loc, f.instanced ? 1 : 0);
+            glEnableVertexAttribArray(loc);
+        }
+        if (m_source->m_indexBuffer.allocated()) m_source->m_indexBuffer.bind(GL_ELEMENT_ARRAY_BUFFER);
+        else glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        m_syncedVersion = m_source->m_layoutVersion;
+        glCheckError("sync VAO view");
+    }
+
+    // Create/update the buffer for attribute `loc` from the rows of `A`,
+    // each holding `size` components of type `type`.
+    template<typename T>
+    void m_setAttribute(int loc, const Eigen::Ref<const MXR<T>> &A, bool instanced, GLint size, GLenum type, AttributeMode mode) {
+        m_checkNotView();
+        bind();
+        m_detachInterleaved(loc);
+        auto it = m_attributes.find(loc);
+        if (it == m_attributes.end()) it = m_attributes.emplace(loc, BufferObject(this->m_ctx, A)).first;
+        else {
+            if (!it->second.allocated()) it->second = BufferObject(this->m_ctx, A); // former attribute at `loc` was a dummy/empty; we must allocate a real one.
+            else                         it->second.updateData(A);
+        }
+        const auto &buf = it->second;
+        buf.bind(GL_ARRAY_BUFFER);
+        // No gap between vertex data (streaming buffers' data may not start at the beginning)
+        const void *offset = reinterpret_cast<const void *>(buf.offset());
+        if (mode == AttributeMode::Integer) glVertexAttribIPointer(loc, size, type, 0, offset);
+        else                                glVertexAttribPointer (loc, size, type, (mode == AttributeMode::Normalized) ? GL_TRUE : GL_FALSE, 0, offset);
+        glVertexAttribDivisor(loc, instanced ? 1 : 0);
+        glCheckError();
+        glEnableVertexAttribArray(loc);
+        glCheckError();
+        m_formats[loc] = AttributeFormat{size, type, mode, 0, buf.offset(), instanced, false};
+        ++m_layoutVersion;
+    }
+
+    // Interleaved attributes have a placeholder entry in `m_attributes`.
     std::map<int, BufferObject> m_attributes;
     BufferObject m_indexBuffer;
+    GLenum m_indexType = GL_UNSIGNED_INT;
+    GLenum m_primitiveMode = GL_TRIANGLES;
+
+    template<class Derived>
+    void m_setIndexData(const Eigen::MatrixBase<Derived> &indices) {
+        if (m_indexBuffer.allocated()) m_indexBuffer.updateData(indices);
+        else m_indexBuffer = BufferObject(this->m_ctx, indices);
+    }
+
+    struct InterleavedBuffer {
+        BufferObject buffer;
+        std::vector<int> locs; // attributes still sourced from `buffer`
+    };
+    std::vector<InterleavedBuffer> m_interleaved;
+
+    // Index of the interleaved buffer holding attribute `loc`, or -1.
+    int m_interleavedIndex(int loc) const {
+        for (size_t g = 0; g < m_interleaved.size(); ++g)
+            for (int l : m_interleaved[g].locs)
+                if (l == loc) return int(g);
+        return -1;
+    }
+
+    // Stop sourcing attribute `loc` from an interleaved buffer, freeing the
+    // buffer once none of its attributes are left.
+    void m_detachInterleaved(int loc) {
+        const int g = m_interleavedIndex(loc);
+        if (g < 0) return;
+        auto &locs = m_interleaved[g].locs;
+        locs.erase(std::find(locs.begin(), locs.end(), loc));
+        if (locs.empty()) m_interleaved.erase(m_interleaved.begin() + g);
+    }
+
     friend struct RAIIGLResource<VertexArrayObject>;
-    void m_delete() { glDeleteVertexArrays(1, &id); /* std::cout << "Delete vertex array " << id << std::endl; */ }
+    void m_enqueueDeletion(GLDeletionQueue::Batch &b) { b.add(GLDeletionQueue::VERTEX_ARRAY, id); }
 };
 
 #endif /* end of include guard: BUFFERS_HH */
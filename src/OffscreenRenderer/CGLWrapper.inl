@@ -20,7 +20,8 @@
 
 struct CGLWrapper : public OpenGLContext {
     CGLWrapper(int width, int height, GLenum /* format */ = GL_RGBA,
-               GLint depthBits = 24, GLint stencilBits = 0, GLint accumBits = 0)
+               GLint depthBits = 24, GLint stencilBits = 0, GLint accumBits = 0,
+               const CGLWrapper *shareWith = nullptr)
     {
         // Initialize CGL
         CGLPixelFormatAttribute pixAttributes[12] = {
@@ -39,7 +40,7 @@ struct CGLWrapper : public OpenGLContext {
             CGLError errorCode = CGLChoosePixelFormat(pixAttributes, &pix, &num);
             if (errorCode != kCGLNoError) throw std::runtime_error("CGLChoosePixelFormat failure");
 
-            errorCode = CGLCreateContext(pix, NULL, &m_ctx);
+            errorCode = CGLCreateContext(pix, shareWith ? shareWith->m_ctx : NULL, &m_ctx);
             if (errorCode != kCGLNoError) throw std::runtime_error("CGLCreateContext failure");
 
             CGLDestroyPixelFormat(pix);
@@ -47,7 +48,7 @@ struct CGLWrapper : public OpenGLContext {
 
         // std::cout << "Initialize CGL " << m_ctx << std::endl;
 
-        m_makeCurrent();
+        makeCurrent();
 
         static bool firstTime = true;
         if (firstTime) {
@@ -58,11 +59,8 @@ struct CGLWrapper : public OpenGLContext {
         // Initialize GLEW entry points for our new context
         m_glewInit();
 
-        glGenFramebuffers(1,  &m_frameBufferID);
-        glGenRenderbuffers(1, &m_renderBufferID);
-        glGenRenderbuffers(1, &m_depthBufferID);
-
-        resize(width, height); // Trigger buffer generation/binding
+        m_renderTarget.create(RenderTarget::depthFormat(depthBits));
+        resize(width, height); // Trigger buffer allocation/binding
     }
 
     virtual ~CGLWrapper() {
@@ -73,14 +71,16 @@ struct CGLWrapper : public OpenGLContext {
         if (oldErrors.size())
             std::cerr << "Unreported errors found on context destruction:" << std::endl << oldErrors << std::endl;
 
-        glDeleteRenderbuffers(1, &m_renderBufferID);
-        glDeleteRenderbuffers(1, &m_depthBufferID);
-        glDeleteFramebuffers (1, &m_frameBufferID);
+        m_releaseReadbackBuffers();
+        m_renderTarget.release();
 
         // CGLSetCurrentContext(nullptr);
         CGLDestroyContext(m_ctx);
     }
 
+    virtual GLuint renderTargetFramebuffer() const override { return m_renderTarget.framebuffer(); }
+    virtual GLuint renderTargetDepthBuffer() const override { return m_renderTarget.depthBuffer(); }
+
 private:
     virtual void m_makeCurrent() override {
         // std::cout << "Make current CGL " << m_ctx << std::endl;
@@ -89,34 +89,20 @@ private:
             throw std::runtime_error("CGLSetCurrentContext failure");
     }
 
-    virtual void m_readImage() override {
-        glBindFramebuffer(GL_FRAMEBUFFER, m_frameBufferID);
-        glBindRenderbuffer(GL_RENDERBUFFER, m_renderBufferID);
-        glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, m_buffer.data());
-        glCheckError("Read image");
+    virtual void m_releaseCurrent() override {
+        if (CGLGetCurrentContext() == m_ctx)
+            CGLSetCurrentContext(nullptr);
     }
 
-    virtual void m_resizeImpl(int width, int height) override {
-        glBindRenderbuffer(GL_RENDERBUFFER, m_renderBufferID);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
-
-        glBindRenderbuffer(GL_RENDERBUFFER, m_depthBufferID);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    virtual void m_readImage() override { m_readPixels(m_buffer.data()); }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, m_frameBufferID);
-        glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_renderBufferID);
-        glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT , GL_RENDERBUFFER,  m_depthBufferID);
-
-        glCheckError("allocate framebuffers");
-
-        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-            throw std::runtime_error("framebuffer is not complete!");
+    virtual void m_resizeImpl(int width, int height) override {
+        makeCurrent();
+        m_renderTarget.resize(width, height);
     }
 
     CGLContextObj m_ctx = nullptr;
-    GLuint m_frameBufferID = 0,
-           m_renderBufferID = 0,
-           m_depthBufferID = 0;
+    RenderTarget m_renderTarget;
 };
 
 #endif /* end of include guard: EGLWRAPPER_HH */
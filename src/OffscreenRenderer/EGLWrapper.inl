@@ -4,6 +4,10 @@
 /*! @file
 //  Wrapper for RAII EGL context creation, rendering, and destruction.
 //  Adapted from https://developer.nvidia.com/blog/egl-eye-opengl-visualization-without-x-server/
+//
+//  Contexts can be placed on a specific device (e.g., one of several GPUs,
+//  or Mesa's software renderer) enumerated with EGL_EXT_device_enumeration;
+//  each device gets its own display, obtained with EGL_EXT_platform_device.
 */
 //  Author:  Julian Panetta (jpanetta), julian.panetta@gmail.com
 //  Created:  09/22/2020 05:15:43
@@ -12,30 +16,110 @@
 #define EGLWRAPPER_HH
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 namespace detail {
-    // All contexts share an EGL display...
+    // The devices reported by EGL_EXT_device_enumeration (none if the
+    // extension or EGL_EXT_platform_device is unsupported).
+    struct EGLDevices {
+        static EGLDevices &getInstance() {
+            // Initialization of a function-local static is thread-safe.
+            static std::unique_ptr<EGLDevices> devices(new EGLDevices); // make_unique cannot call private constructor
+            return *devices;
+        }
+
+        const std::vector<OpenGLContext::DeviceInfo> &info() const { return m_info; }
+        EGLDeviceEXT get(int device) const { return m_devices.at(resolve(device)); }
+
+        int resolve(int device) const {
+            if (device == OpenGLContext::SOFTWARE_DEVICE) {
+                for (const auto &d : m_info)
+                    if (d.software) return d.index;
+                throw std::runtime_error("No software rendering device available");
+            }
+            if ((device != OpenGLContext::DEFAULT_DEVICE) && ((device < 0) || (size_t(device) >= m_devices.size())))
+                throw std::runtime_error("Invalid EGL device index " + std::to_string(device));
+            return device;
+        }
+
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = nullptr;
+
+    private:
+        EGLDevices() {
+            const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+            if (clientExtensions == nullptr) { eglGetError(); return; } // EGL_EXT_client_extensions unsupported
+            const std::string padded = " " + std::string(clientExtensions) + " ";
+            for (const char *ext : {"EGL_EXT_device_enumeration", "EGL_EXT_platform_device"})
+                if (padded.find(" " + std::string(ext) + " ") == std::string::npos) return;
+
+            auto queryDevices     = reinterpret_cast<PFNEGLQUERYDEVICESEXTPROC     >(eglGetProcAddress("eglQueryDevicesEXT"));
+            auto queryDeviceString = reinterpret_cast<PFNEGLQUERYDEVICESTRINGEXTPROC>(eglGetProcAddress("eglQueryDeviceStringEXT"));
+            getPlatformDisplay    = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+            if (!queryDevices || !queryDeviceString || !getPlatformDisplay) return;
+
+            EGLint numDevices = 0;
+            if (!queryDevices(0, nullptr, &numDevices) || (numDevices <= 0)) return;
+            m_devices.resize(numDevices);
+            if (!queryDevices(numDevices, m_devices.data(), &numDevices)) { m_devices.clear(); return; }
+            m_devices.resize(numDevices);
+
+            for (EGLint i = 0; i < numDevices; ++i) {
+                OpenGLContext::DeviceInfo d;
+                d.index = i;
+                const char *ext = queryDeviceString(m_devices[i], EGL_EXTENSIONS);
+                d.extensions = ext ? ext : "";
+                const std::string paddedExt = " " + d.extensions + " ";
+                d.software = paddedExt.find(" EGL_MESA_device_software ") != std::string::npos;
+                const char *drm = (paddedExt.find(" EGL_EXT_device_drm ") != std::string::npos) ? queryDeviceString(m_devices[i], EGL_DRM_DEVICE_FILE_EXT) : nullptr;
+                d.drmDeviceFile = drm ? drm : "";
+                m_info.push_back(d);
+            }
+        }
+
+        std::vector<EGLDeviceEXT> m_devices;
+        std::vector<OpenGLContext::DeviceInfo> m_info;
+    };
+
+    // All contexts on a device share an EGL display...
     struct EGLDisplaySingleton {
-        static EGLDisplaySingleton &getInstance() {
-            static std::unique_ptr<EGLDisplaySingleton> display;
-            if (display == nullptr) display = std::unique_ptr<EGLDisplaySingleton>(new EGLDisplaySingleton); // make_unique cannot call private constructor
+        // Display for `device` (an index into `EGLDevices` or
+        // OpenGLContext::DEFAULT_DEVICE), created on first use.
+        static EGLDisplaySingleton &getInstance(int device = OpenGLContext::DEFAULT_DEVICE) {
+            static std::mutex mutex;
+            static std::map<int, std::unique_ptr<EGLDisplaySingleton>> displays;
+            std::lock_guard<std::mutex> lock(mutex);
+            auto &display = displays[device];
+            if (!display) display.reset(new EGLDisplaySingleton(device)); // make_unique cannot call private constructor
             return *display;
         }
 
         EGLDisplay get() const { return m_display; }
 
+        bool hasExtension(const std::string &name) const {
+            const char *extensions = eglQueryString(m_display, EGL_EXTENSIONS);
+            if (extensions == nullptr) return false;
+            const std::string padded = " " + std::string(extensions) + " ";
+            return padded.find(" " + name + " ") != std::string::npos;
+        }
+
         ~EGLDisplaySingleton() {
             eglTerminate(m_display);
         }
     private:
         EGLDisplay m_display;
 
-        EGLDisplaySingleton() {
+        EGLDisplaySingleton(int device) {
             // Initialize EGL
-            m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+            if (device == OpenGLContext::DEFAULT_DEVICE) m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+            else {
+                const EGLDevices &devices = EGLDevices::getInstance();
+                m_display = devices.getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices.get(device), nullptr);
+            }
+            if (m_display == EGL_NO_DISPLAY) throw std::runtime_error("Failed to get EGL display for device " + std::to_string(device));
 
             EGLint major, minor;
-            eglInitialize(m_display, &major, &minor);
+            if (!eglInitialize(m_display, &major, &minor))
+                throw std::runtime_error("eglInitialize failed for device " + std::to_string(device));
             // std::cout << major << ", " << minor << std::endl;
 
             // Bind the API
@@ -44,11 +128,22 @@ namespace detail {
 	};
 }
 
+// The context is created once and renders into a framebuffer object (see
+// RenderTarget.hh) rather than an EGL surface, so that resizing only
+// reallocates the FBO's attachments and keeps all GL resources alive.
+// When EGL_KHR_surfaceless_context is unavailable, the context is bound to a
+// dummy 1x1 pbuffer surface.
 struct EGLWrapper : public OpenGLContext {
     EGLWrapper(int width, int height, GLenum /* format */ = GL_RGBA,
-               GLint depthBits = 24, GLint /* stencilBits */ = 0, GLint /* accumBits */ = 0)
-        : m_display(detail::EGLDisplaySingleton::getInstance())
+               GLint depthBits = 24, GLint /* stencilBits */ = 0, GLint /* accumBits */ = 0,
+               int device = DEFAULT_DEVICE, const OpenGLContext *shareWith = nullptr)
+        : m_display(detail::EGLDisplaySingleton::getInstance(resolveDevice(device)))
     {
+        m_setDevice(resolveDevice(device));
+        const EGLWrapper *share = m_shareContext<EGLWrapper>(shareWith);
+        if (share && (share->device() != this->device()))
+            throw std::runtime_error("Contexts in a share group must be on the same device");
+
         // Select an appropriate configuration
         EGLint numConfigs;
 
@@ -58,25 +153,63 @@ struct EGLWrapper : public OpenGLContext {
             EGL_GREEN_SIZE, 8,
             EGL_RED_SIZE, 8,
             EGL_ALPHA_SIZE, 8,
-            EGL_DEPTH_SIZE, depthBits,
             EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
             EGL_NONE
         };
 
-        eglChooseConfig(m_display.get(), configAttribs, &m_config, 1, &numConfigs);
+        if (!eglChooseConfig(m_display.get(), configAttribs, &m_config, 1, &numConfigs) || (numConfigs == 0))
+            throw std::runtime_error("eglChooseConfig failed");
+
+        if (!m_display.hasExtension("EGL_KHR_surfaceless_context")) {
+            const EGLint pbufferAttribs[] = {
+                EGL_WIDTH, 1,
+                EGL_HEIGHT, 1,
+                EGL_NONE,
+            };
+            m_surf = eglCreatePbufferSurface(m_display.get(), m_config, pbufferAttribs);
+            if (!m_surf) throw std::runtime_error("eglCreatePbufferSurface failed");
+        }
+
+        // The bound API is per-thread state, and contexts may be created on
+        // threads other than the one that initialized the display.
+        eglBindAPI(EGL_OPENGL_API);
+
+        // Create a 3.3 context and make it current
+        EGLint contextAttribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_NONE
+        };
+        m_ctx = eglCreateContext(m_display.get(), m_config, share ? share->m_ctx : EGL_NO_CONTEXT, contextAttribs);
+        if (!m_ctx) throw std::runtime_error("eglCreateContext failed");
+
+        EGLint version;
+        eglQueryContext(m_display.get(), m_ctx, EGL_CONTEXT_CLIENT_VERSION, &version);
+        std::cout << "Created EGL context with version " << version << std::endl;
 
-        resize(width, height);
         makeCurrent();
-        // std::cout << "gl version: " << glGetString(GL_VERSION) << std::endl;
+
+        // Initialize GLEW entry points for our new context
+        m_glewInit();
+
+        m_renderTarget.create(RenderTarget::depthFormat(depthBits));
+        resize(width, height);
     }
 
     virtual ~EGLWrapper() {
-        m_destroy_size_specific();
+        // The context's objects (including the render target) die with it.
+        m_releaseCurrent();
+        if (m_ctx  != nullptr) eglDestroyContext(m_display.get(), m_ctx );
+        if (m_surf != nullptr) eglDestroySurface(m_display.get(), m_surf);
     }
 
+    virtual GLuint renderTargetFramebuffer() const override { return m_renderTarget.framebuffer(); }
+    virtual GLuint renderTargetDepthBuffer() const override { return m_renderTarget.depthBuffer(); }
+
 private:
     virtual void m_makeCurrent() override {
-        eglMakeCurrent(m_display.get(), m_surf, m_surf, m_ctx);
+        EGLSurface surf = (m_surf != nullptr) ? m_surf : EGL_NO_SURFACE;
+        eglMakeCurrent(m_display.get(), surf, surf, m_ctx);
 		EGLint lastError = eglGetError();
 		if (lastError != EGL_SUCCESS)
 			std::cerr << "Error " << lastError << " in eglMakeCurrent" << std::endl;
@@ -84,51 +217,23 @@ private:
         // std::cout << "Made current " << this << std::endl;
     }
 
-    void m_destroy_size_specific() {
-        if (m_ctx  != nullptr) { eglDestroyContext(m_display.get(), m_ctx ); m_ctx  = nullptr; }
-        if (m_surf != nullptr) { eglDestroySurface(m_display.get(), m_surf); m_surf = nullptr; }
+    virtual void m_releaseCurrent() override {
+        if (eglGetCurrentContext() == m_ctx)
+            eglMakeCurrent(m_display.get(), EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
     }
 
-    virtual void m_readImage() override {
-        glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, m_buffer.data());
-    }
+    virtual void m_readImage() override { m_readPixels(m_buffer.data()); }
 
     virtual void m_resizeImpl(int width, int height) override {
-        m_destroy_size_specific();
-
-        const EGLint pbufferAttribs[] = {
-            EGL_WIDTH, width,
-            EGL_HEIGHT, height,
-            EGL_NONE,
-        };
-
-        // Create a surface
-        m_surf = eglCreatePbufferSurface(m_display.get(), m_config, pbufferAttribs);
-        if (!m_surf) throw std::runtime_error("eglCreatePbufferSurface failed");
-
-        // Create a 3.3 context and make it current
-        EGLint contextAttribs[] = {
-            EGL_CONTEXT_MAJOR_VERSION, 3,
-            EGL_CONTEXT_MINOR_VERSION, 3,
-            EGL_NONE
-        };
-        m_ctx = eglCreateContext(m_display.get(), m_config, EGL_NO_CONTEXT, contextAttribs);
-        if (!m_ctx) throw std::runtime_error("eglCreateContext failed");
-
-        EGLint version;
-        eglQueryContext(m_display.get(), m_ctx, EGL_CONTEXT_CLIENT_VERSION, &version);
-        std::cout << "Created EGL context with version " << version << std::endl;
-
-        m_makeCurrent();
-
-        // Initialize GLEW entry points for our new context
-        m_glewInit();
+        makeCurrent();
+        m_renderTarget.resize(width, height);
     }
 
     const detail::EGLDisplaySingleton &m_display;
     EGLConfig  m_config  = nullptr;
     EGLSurface m_surf    = nullptr;
     EGLContext m_ctx     = nullptr;
+    RenderTarget m_renderTarget;
 };
 
 #endif /* end of include guard: EGLWRAPPER_HH */
@@ -0,0 +1,414 @@
+////////////////////////////////////////////////////////////////////////////////
+// FrameSink.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Streaming of rendered frames to a file descriptor (e.g., a video encoder's
+//  stdin) from a background writer thread.
+//
+//  `FrameSink` owns a ring of preallocated frame slots: `writeFrame` converts
+//  the context's image directly into the next free slot (blocking only if
+//  all slots are still waiting to be written), and the writer thread drains
+//  the filled slots, so that the encoder consumes frame `i` while frame `i + 1`
+//  is being rendered. `VideoSink` additionally launches the consuming process
+//  (typically `ffmpeg -f rawvideo ... -i -`) with a pipe to its stdin.
+//
+//  Frames can be streamed as raw RGBA, or converted to YUV 4:2:0 (raw
+//  `yuv420p` or a Y4M stream) while copying them into the ring; the latter
+//  needs 1.5 instead of 4 bytes per pixel and lets the encoder skip its own
+//  color conversion.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef FRAMESINK_HH
+#define FRAMESINK_HH
+
+#include <condition_variable>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "OpenGLContext.hh"
+#include "YUVConversion.hh"
+
+extern char **environ;
+
+struct FrameSink {
+    enum class Format {
+        RGBA,   // raw RGBA (ffmpeg's `-f rawvideo -pixel_format rgba`)
+        YUV420, // raw planar YUV 4:2:0, BT.709 limited range (`-f rawvideo -pixel_format yuv420p`)
+        Y4M     // YUV 4:2:0 in a YUV4MPEG2 stream (`-f yuv4mpegpipe`)
+    };
+
+    // Frame rate `num / den` frames per second. A rate given as a double is
+    // approximated by the nearest rational; rates just below an integer by a
+    // factor of 1000/1001 (e.g., 29.97 or 23.976) are taken to be the NTSC
+    // rates (30000/1001, 24000/1001). Rates below 1/1001 fps are rounded up
+    // to it.
+    struct FrameRate {
+        FrameRate(int n, int d = 1) : num(n), den(d) {
+            if ((num <= 0) || (den <= 0)) throw std::runtime_error("Invalid frame rate");
+        }
+        FrameRate(double fps) {
+            if (!(fps > 0) || !(fps <= std::numeric_limits<int>::max() / 1001)) throw std::runtime_error("Invalid frame rate");
+            const double ntsc = std::round(fps * 1.001);
+            if ((ntsc >= 1) && (std::abs(fps - std::round(fps)) > 1e-6) && (std::abs(fps - ntsc * 1000 / 1001) < 5e-3)) {
+                num = int(ntsc) * 1000;
+                den = 1001;
+                return;
+            }
+            // Best rational approximation with denominator at most 1001 (continued fractions).
+            long p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+            double x = fps;
+            while (true) {
+                const long a = long(std::floor(x));
+                const long p2 = a * p1 + p0, q2 = a * q1 + q0;
+                if (q2 > 1001) break;
+                p0 = p1; q0 = q1; p1 = p2; q1 = q2;
+                if (std::abs(x - a) < 1e-9) break;
+                x = 1.0 / (x - a);
+            }
+            num = int(p1);
+            den = int(q1);
+            if (num == 0) { num = 1; den = 1001; }
+        }
+        double fps() const { return double(num) / den; }
+        int num = 30, den = 1;
+    };
+
+    // Stream `width` x `height` frames (in top-to-bottom scanline order) to
+    // the file descriptor `fd` in the given format, buffering up to
+    // `ringSize` frames. If `closeFD` is true, the sink takes ownership of `fd`
+    // (closing it even if construction fails).
+    // `framerate` is only used for the Y4M stream header.
+    FrameSink(int fd, int width, int height, size_t ringSize = 4, bool closeFD = true,
+              Format format = Format::RGBA, FrameRate framerate = 30)
+        : m_fd(fd), m_closeFD(closeFD), m_width(width), m_height(height), m_format(format), m_framerate(framerate)
+    {
+        if (fd < 0)         throw std::runtime_error("Invalid file descriptor");
+        try {
+            if (ringSize == 0)  throw std::runtime_error("Frame ring must hold at least one frame");
+            m_slots.assign(ringSize, std::vector<unsigned char>(frameSize()));
+            if (m_format == Format::Y4M) {
+                for (auto &slot : m_slots)
+                    std::memcpy(slot.data(), "FRAME\n", Y4M_FRAME_HEADER_SIZE);
+            }
+            m_writer = std::thread([this]() { m_writerLoop(); });
+        }
+        catch (...) {
+            if (m_closeFD) ::close(m_fd);
+            throw;
+        }
+    }
+
+    // Stream to a newly created file at `path` (e.g., a named pipe, or a
+    // raw video dump for later encoding).
+    static std::unique_ptr<FrameSink> open(const std::string &path, int width, int height, size_t ringSize = 4,
+                                           Format format = Format::RGBA, FrameRate framerate = 30) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::runtime_error("Could not open " + path + ": " + std::strerror(errno));
+        return std::unique_ptr<FrameSink>(new FrameSink(fd, width, height, ringSize, true, format, framerate));
+    }
+
+    FrameSink(const FrameSink &) = delete;
+    FrameSink &operator=(const FrameSink &) = delete;
+
+    // Errors cannot be reported from the destructor; call `finish()` to
+    // detect them.
+    virtual ~FrameSink() {
+        try { finish(); }
+        catch (std::exception &e) { std::cerr << "FrameSink: " << e.what() << std::endl; }
+    }
+
+    int getWidth()  const { return m_width;  }
+    int getHeight() const { return m_height; }
+    Format format() const { return m_format; }
+    FrameRate framerate() const { return m_framerate; }
+
+    // Bytes written per frame
+    size_t frameSize() const {
+        switch (m_format) {
+            case Format::RGBA:   return 4 * size_t(m_width) * m_height;
+            case Format::YUV420: return yuv420Size(m_width, m_height);
+            case Format::Y4M:    return Y4M_FRAME_HEADER_SIZE + yuv420Size(m_width, m_height);
+        }
+        return 0;
+    }
+    size_t ringSize()  const { return m_slots.size(); }
+    size_t framesWritten() const { std::lock_guard<std::mutex> lock(m_mutex); return m_numWritten; }
+
+    // Composite the (premultiplied) frames over `color` when converting
+    // them to YUV; by default their alpha is dropped (see `writeFrame`).
+    // Raw RGBA output is unaffected.
+    void setBackground(const Eigen::Vector3f &color) {
+        auto toByte = [](float c) { return uint8_t(std::round(255.0f * std::min(std::max(c, 0.0f), 1.0f))); };
+        m_background.enabled = true;
+        m_background.r = toByte(color[0]);
+        m_background.g = toByte(color[1]);
+        m_background.b = toByte(color[2]);
+    }
+    void clearBackground() { m_background = detail::YUVBackground(); }
+
+    // Queue the image most recently read back by `ctx` (via `finish` or
+    // `acquireFrame`), converting it into the output format as it is copied
+    // into the ring. Like an encoder fed with RGBA frames, YUV output keeps
+    // the (unpremultiplied, if requested) colors and drops alpha, unless a
+    // background is set: then the premultiplied frame is composited over it
+    // and `unpremultiply` is ignored.
+    void writeFrame(const OpenGLContext &ctx, bool unpremultiply = true) {
+        if ((ctx.getWidth() != m_width) || (ctx.getHeight() != m_height))
+            throw std::runtime_error("Context size does not match the sink's frame size");
+        m_fillSlot([&](unsigned char *slot) {
+            if (m_format == Format::RGBA) ctx.readInto(slot, unpremultiply, /* flip = */ true);
+            else if (unpremultiply && !m_background.enabled) {
+                m_unpremultiplied.resize(4 * size_t(m_width) * m_height);
+                ctx.readInto(m_unpremultiplied.data(), /* unpremultiply = */ true, /* flip = */ false);
+                m_convertYUV(m_unpremultiplied.data(), slot, /* flip = */ true);
+            }
+            else m_convertYUV(ctx.buffer().data(), slot, /* flip = */ true);
+        });
+    }
+
+    // Queue a frame of top-to-bottom RGBA pixels (treated as premultiplied
+    // when converting to YUV, which makes no difference for opaque images).
+    void writeFrame(const unsigned char *rgba) {
+        m_fillSlot([&](unsigned char *slot) {
+            if (m_format == Format::RGBA) std::memcpy(slot, rgba, frameSize());
+            else m_convertYUV(rgba, slot, /* flip = */ false);
+        });
+    }
+
+    // Write all queued frames and close the output. Rethrows the first error
+    // encountered by the writer thread. Further writes are not permitted.
+    virtual void finish() {
+        if (!m_writer.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_finishing = true;
+        }
+        m_frameQueued.notify_one();
+        m_writer.join();
+        if (m_closeFD) ::close(m_fd);
+        m_rethrowWriterError();
+    }
+
+protected:
+    // Every Y4M frame is preceded by "FRAME\n"
+    enum : size_t { Y4M_FRAME_HEADER_SIZE = 6 };
+
+    void m_convertYUV(const unsigned char *rgba, unsigned char *slot, bool flip) const {
+        if (m_format == Format::Y4M) slot += Y4M_FRAME_HEADER_SIZE; // header was written at construction
+        rgbaToYUV420(rgba, m_width, m_height, slot, flip, m_background);
+    }
+
+    // Acquire the next free slot (waiting for the writer if necessary), fill
+    // it with `fill(slotData)` and hand it to the writer.
+    template<class F>
+    void m_fillSlot(F &&fill) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_finishing) throw std::runtime_error("FrameSink is already finished");
+            m_slotFreed.wait(lock, [this]() { return (m_numFilled < m_slots.size()) || m_writerError; });
+            m_rethrowWriterError();
+        }
+        // Only this thread fills slots, and the writer never touches
+        // slot `m_fillIdx` until it is counted in `m_numFilled`.
+        fill(m_slots[m_fillIdx].data());
+        m_fillIdx = (m_fillIdx + 1) % m_slots.size();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_numFilled;
+        }
+        m_frameQueued.notify_one();
+    }
+
+    void m_writerLoop() {
+        // A consumer that exits early (e.g., a crashed ffmpeg) should produce
+        // an EPIPE error, not terminate the process with SIGPIPE.
+        sigset_t pipeSignal;
+        sigemptyset(&pipeSignal);
+        sigaddset(&pipeSignal, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipeSignal, nullptr);
+
+        if (m_format == Format::Y4M) {
+            // 4:2:0 with centered chroma, progressive, square pixels.
+            const std::string header = "YUV4MPEG2 W" + std::to_string(m_width) + " H" + std::to_string(m_height)
+                                     + " F" + std::to_string(m_framerate.num) + ":" + std::to_string(m_framerate.den) + " Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n";
+            try { m_writeAll(reinterpret_cast<const unsigned char *>(header.data()), header.size()); }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_writerError = std::current_exception();
+                m_slotFreed.notify_all();
+                return;
+            }
+        }
+
+        size_t drainIdx = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_frameQueued.wait(lock, [this]() { return m_finishing || (m_numFilled > 0); });
+                if (m_numFilled == 0) return; // finishing and fully drained
+            }
+            try { m_writeAll(m_slots[drainIdx].data(), frameSize()); }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_writerError = std::current_exception();
+                m_slotFreed.notify_all();
+                return;
+            }
+            drainIdx = (drainIdx + 1) % m_slots.size();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_numFilled;
+                ++m_numWritten;
+            }
+            m_slotFreed.notify_one();
+        }
+    }
+
+    void m_writeAll(const unsigned char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(m_fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Failed to write frame: ") + std::strerror(errno));
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    void m_rethrowWriterError() {
+        if (m_writerError) std::rethrow_exception(m_writerError);
+    }
+
+    int m_fd;
+    bool m_closeFD;
+    int m_width, m_height;
+    Format m_format;
+    FrameRate m_framerate;
+    detail::YUVBackground m_background;
+    std::vector<unsigned char> m_unpremultiplied; // scratch image for YUV conversion (filling thread only)
+
+    std::vector<std::vector<unsigned char>> m_slots;
+    size_t m_fillIdx = 0, m_numFilled = 0, m_numWritten = 0;
+    bool m_finishing = false;
+    std::exception_ptr m_writerError;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_frameQueued, m_slotFreed;
+    std::thread m_writer;
+};
+
+// Frame sink piping into the stdin of a child process, e.g.
+//  {"ffmpeg", "-y", "-f", "rawvideo", "-pixel_format", "rgba",
+//   "-video_size", "640x480", "-framerate", "30", "-i", "-", "out.mp4"}
+struct VideoSink : public FrameSink {
+    VideoSink(const std::vector<std::string> &command, int width, int height, size_t ringSize = 4,
+              Format format = Format::RGBA, FrameRate framerate = 30)
+        : VideoSink(m_spawn(command), width, height, ringSize, format, framerate) { }
+
+    // Also waits for the child process to exit, reporting failures.
+    void finish() override {
+        if (m_pid <= 0) return;
+        std::exception_ptr writeError;
+        try { FrameSink::finish(); } // closes the pipe, signaling EOF to the child
+        catch (...) { writeError = std::current_exception(); }
+
+        int status;
+        while ((waitpid(m_pid, &status, 0) < 0) && (errno == EINTR)) { }
+        m_pid = -1;
+        if (writeError) std::rethrow_exception(writeError);
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+            throw std::runtime_error("Video encoder process " + m_program + " failed");
+    }
+
+    ~VideoSink() {
+        try { finish(); }
+        catch (std::exception &e) { std::cerr << "VideoSink: " << e.what() << std::endl; }
+    }
+
+private:
+    // A spawned child, reaped on destruction unless `release`d: if the sink
+    // cannot be constructed, the FrameSink constructor closes the child's
+    // stdin, and the child exits once it sees EOF.
+    struct Child {
+        Child(pid_t p, int fd, const std::string &prog) : pid(p), stdinFD(fd), program(prog) { }
+        Child(Child &&c) : pid(c.pid), stdinFD(c.stdinFD), program(std::move(c.program)) { c.pid = -1; }
+        Child(const Child &) = delete;
+        ~Child() {
+            int status;
+            if (pid > 0) while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR)) { }
+        }
+        pid_t release() { pid_t p = pid; pid = -1; return p; }
+
+        pid_t pid;
+        int stdinFD;
+        std::string program;
+    };
+
+    VideoSink(Child &&child, int width, int height, size_t ringSize, Format format, FrameRate framerate)
+        : FrameSink(child.stdinFD, width, height, ringSize, /* closeFD = */ true, format, framerate),
+          m_pid(-1), m_program(child.program)
+    {
+        m_pid = child.release();
+    }
+
+    pid_t m_pid;
+    std::string m_program;
+
+    // Launch `command` with its stdin connected to a new pipe.
+    static Child m_spawn(const std::vector<std::string> &command) {
+        if (command.empty()) throw std::runtime_error("Empty command");
+        // Neither end may leak into another child (in particular one spawned
+        // concurrently for another sink, whose copy of our write end would
+        // keep our child from ever seeing EOF); `adddup2` clears the flag on
+        // this child's stdin.
+        int fds[2];
+#ifdef __linux__
+        if (pipe2(fds, O_CLOEXEC) != 0) throw std::runtime_error(std::string("pipe2 failed: ") + std::strerror(errno));
+#else
+        // No `pipe2`: at least keep sinks spawned concurrently from racing.
+        static std::mutex spawnMutex;
+        std::lock_guard<std::mutex> spawnLock(spawnMutex);
+        if (pipe(fds) != 0) throw std::runtime_error(std::string("pipe failed: ") + std::strerror(errno));
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+        std::vector<char *> argv;
+        for (const auto &arg : command) argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        ::close(fds[0]);
+        if (err != 0) {
+            ::close(fds[1]);
+            throw std::runtime_error("Failed to launch " + command[0] + ": " + std::strerror(err));
+        }
+        return Child{pid, fds[1], command[0]};
+    }
+};
+
+#endif /* end of include guard: FRAMESINK_HH */
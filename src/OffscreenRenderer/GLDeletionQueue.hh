@@ -0,0 +1,107 @@
+////////////////////////////////////////////////////////////////////////////////
+// GLDeletionQueue.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Names of GL objects awaiting deletion by a context. Resources released on
+//  any thread (see `RAIIGLResource`) only queue their names, without making
+//  the context current; the context deletes them in batches (one
+//  `glDelete*` call per object type) the next time it is made current or
+//  finishes a frame.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef GLDELETIONQUEUE_HH
+#define GLDELETIONQUEUE_HH
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <GL/glew.h>
+
+#include "GLErrors.hh"
+#include "GLStateCache.hh"
+
+struct GLDeletionQueue {
+    enum Kind { BUFFER, VERTEX_ARRAY, PROGRAM, SHADER, TEXTURE, FRAMEBUFFER, RENDERBUFFER, NUM_KINDS };
+
+    struct Batch {
+        std::array<std::vector<GLuint>, NUM_KINDS> names;
+        std::vector<GLsync> syncs;
+
+        void add(Kind kind, GLuint name) { if (name) names[kind].push_back(name); }
+        void add(GLsync sync) { if (sync) syncs.push_back(sync); }
+
+        bool empty() const {
+            for (const auto &n : names) if (!n.empty()) return false;
+            return syncs.empty();
+        }
+
+        // Move the objects that are shared between contexts (everything
+        // but container objects) into `b`.
+        void moveShared(Batch &b) {
+            for (int k = 0; k < NUM_KINDS; ++k) {
+                if ((k == VERTEX_ARRAY) || (k == FRAMEBUFFER)) continue;
+                b.names[k].insert(b.names[k].end(), names[k].begin(), names[k].end());
+                names[k].clear();
+            }
+            b.syncs.insert(b.syncs.end(), syncs.begin(), syncs.end());
+            syncs.clear();
+        }
+    };
+
+    // Queue names for deletion (thread-safe): `f(batch)` adds them to the
+    // pending batch.
+    template<class F>
+    void enqueue(F &&f) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        f(m_pending);
+        m_hasPending.store(!m_pending.empty(), std::memory_order_release);
+    }
+
+    bool empty() const { return !m_hasPending.load(std::memory_order_acquire); }
+
+    // Remove and return the pending batch.
+    Batch take() {
+        Batch b;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::swap(b, m_pending);
+        m_hasPending.store(false, std::memory_order_release);
+        return b;
+    }
+
+    // Delete the pending objects (the owning context must be current) and
+    // forget them in its state cache. Returns whether any buffers or
+    // programs, whose bindings other contexts may have cached, were deleted.
+    bool flush(GLStateCache &cache) {
+        if (empty()) return false;
+        Batch b = take();
+        for (GLsync s : b.syncs) glDeleteSync(s);
+        for (GLuint p : b.names[PROGRAM]) { cache.forgetProgram(p); glDeleteProgram(p); }
+        for (GLuint s : b.names[SHADER]) glDeleteShader(s);
+        for (GLuint v : b.names[VERTEX_ARRAY]) cache.forgetVertexArray(v);
+        for (GLuint buf : b.names[BUFFER]) cache.forgetBuffer(buf);
+        auto count = [&](Kind kind) { return GLsizei(b.names[kind].size()); };
+        if (count(VERTEX_ARRAY)) glDeleteVertexArrays (count(VERTEX_ARRAY), b.names[VERTEX_ARRAY].data());
+        if (count(BUFFER))       glDeleteBuffers      (count(BUFFER),       b.names[BUFFER].data());
+        if (count(TEXTURE))      glDeleteTextures     (count(TEXTURE),      b.names[TEXTURE].data());
+        if (count(FRAMEBUFFER))  glDeleteFramebuffers (count(FRAMEBUFFER),  b.names[FRAMEBUFFER].data());
+        if (count(RENDERBUFFER)) glDeleteRenderbuffers(count(RENDERBUFFER), b.names[RENDERBUFFER].data());
+        glCheckError("flush deletion queue");
+        m_numFlushed += b.syncs.size();
+        for (const auto &n : b.names) m_numFlushed += n.size();
+        ++m_numFlushes;
+        return !b.names[BUFFER].empty() || !b.names[PROGRAM].empty();
+    }
+
+    // Objects deleted and batches flushed so far (by the owning context's thread).
+    size_t numFlushed() const { return m_numFlushed; }
+    size_t numFlushes() const { return m_numFlushes; }
+
+private:
+    std::mutex m_mutex;
+    Batch m_pending;
+    std::atomic<bool> m_hasPending{false};
+    size_t m_numFlushed = 0, m_numFlushes = 0;
+};
+
+#endif /* end of include guard: GLDELETIONQUEUE_HH */
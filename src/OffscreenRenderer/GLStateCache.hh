@@ -0,0 +1,157 @@
+////////////////////////////////////////////////////////////////////////////////
+// GLStateCache.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Shadow copy of the GL state most frequently set by this library
+//  (capabilities, blend function, cull face, clear color, bound program,
+//  vertex array and array/element buffers), used to skip calls that would not
+//  change anything. State starts out unknown, so the first call setting each
+//  value is always issued.
+//
+//  The cache is only correct if all changes to the tracked state go through
+//  it; code issuing such GL calls directly must call `invalidate()` afterward
+//  (see `OpenGLContext::invalidateStateCache`).
+//
+//  Program and buffer names are shared by the contexts of a share group, so
+//  an object deleted through another context may have its name reused while
+//  still cached as bound here; the cached program and buffer bindings are
+//  therefore dropped whenever the group's deletion counter changes.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef GLSTATECACHE_HH
+#define GLSTATECACHE_HH
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <GL/glew.h>
+
+struct GLStateCache {
+    struct Counters {
+        size_t issued = 0, elided = 0;
+    };
+
+    void enable (GLenum cap) { setCapability(cap, true ); }
+    void disable(GLenum cap) { setCapability(cap, false); }
+
+    void setCapability(GLenum cap, bool enabled) {
+        auto it = m_capabilities.find(cap);
+        if ((it != m_capabilities.end()) && (it->second == enabled)) { ++m_counters.elided; return; }
+        if (enabled) glEnable(cap);
+        else         glDisable(cap);
+        m_capabilities[cap] = enabled;
+        ++m_counters.issued;
+    }
+
+    void blendFuncSeparate(GLenum sfactor, GLenum dfactor, GLenum alpha_sfactor, GLenum alpha_dfactor) {
+        const std::array<GLenum, 4> func{{sfactor, dfactor, alpha_sfactor, alpha_dfactor}};
+        if (m_blendFuncKnown && (m_blendFunc == func)) { ++m_counters.elided; return; }
+        glBlendFuncSeparate(sfactor, dfactor, alpha_sfactor, alpha_dfactor);
+        m_blendFunc = func;
+        m_blendFuncKnown = true;
+        ++m_counters.issued;
+    }
+
+    void cullFace(GLenum face) {
+        if (m_track(m_cullFace, face)) glCullFace(face);
+    }
+
+    void clearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+        const std::array<GLfloat, 4> color{{r, g, b, a}};
+        if (m_clearColorKnown && (m_clearColor == color)) { ++m_counters.elided; return; }
+        glClearColor(r, g, b, a);
+        m_clearColor = color;
+        m_clearColorKnown = true;
+        ++m_counters.issued;
+    }
+
+    void useProgram(GLuint prog) {
+        m_checkSharedDeletions();
+        if (m_track(m_program, prog)) glUseProgram(prog);
+    }
+
+    void bindVertexArray(GLuint vao) {
+        if (!m_track(m_vertexArray, vao)) return;
+        glBindVertexArray(vao);
+        m_elementArrayBuffer = UNKNOWN; // the element array binding is part of the VAO's state
+    }
+
+    // Only GL_ARRAY_BUFFER and GL_ELEMENT_ARRAY_BUFFER bindings are tracked.
+    void bindBuffer(GLenum target, GLuint buffer) {
+        GLint64 *binding = (target == GL_ARRAY_BUFFER)         ? &m_arrayBuffer
+                         : (target == GL_ELEMENT_ARRAY_BUFFER) ? &m_elementArrayBuffer
+                         : nullptr;
+        if (binding == nullptr) { glBindBuffer(target, buffer); return; }
+        m_checkSharedDeletions();
+        if (m_track(*binding, buffer)) glBindBuffer(target, buffer);
+    }
+
+    // Deleting a bound object resets the binding to 0, and its name may be
+    // reused by a new object; these must be called when deleting objects.
+    void forgetProgram(GLuint prog) { if (m_program == GLint64(prog)) m_program = UNKNOWN; }
+    void forgetVertexArray(GLuint vao) {
+        if (m_vertexArray == GLint64(vao)) { m_vertexArray = 0; m_elementArrayBuffer = UNKNOWN; }
+    }
+    void forgetBuffer(GLuint buffer) {
+        if (m_arrayBuffer        == GLint64(buffer)) m_arrayBuffer        = 0;
+        if (m_elementArrayBuffer == GLint64(buffer)) m_elementArrayBuffer = UNKNOWN;
+    }
+
+    // Counter incremented by the context's share group whenever one of its
+    // shared objects is deleted (null if not shared).
+    void trackSharedDeletions(const std::atomic<size_t> *counter) {
+        m_sharedDeletions = counter;
+        if (counter) m_seenDeletions = counter->load();
+    }
+
+    // Forget all cached state (after it may have been modified behind the
+    // cache's back).
+    void invalidate() {
+        m_capabilities.clear();
+        m_blendFuncKnown = m_clearColorKnown = false;
+        m_cullFace = m_program = m_vertexArray = m_arrayBuffer = m_elementArrayBuffer = UNKNOWN;
+    }
+
+    // Counts of calls issued to the driver and skipped (including the
+    // `makeCurrent` calls of the contexts using this cache).
+    const Counters &counters() const { return m_counters; }
+    void resetCounters() { m_counters = Counters(); }
+    void countIssued() { ++m_counters.issued; }
+    void countElided() { ++m_counters.elided; }
+
+private:
+    static constexpr GLint64 UNKNOWN = -1; // never a valid GL name or enum
+
+    // Update a tracked value, returning whether the call must be issued.
+    bool m_track(GLint64 &cached, GLint64 val) {
+        if (cached == val) { ++m_counters.elided; return false; }
+        cached = val;
+        ++m_counters.issued;
+        return true;
+    }
+
+    void m_checkSharedDeletions() {
+        if (m_sharedDeletions == nullptr) return;
+        const size_t deletions = m_sharedDeletions->load(std::memory_order_acquire);
+        if (deletions == m_seenDeletions) return;
+        m_seenDeletions = deletions;
+        // (Bindings to 0 stay valid.)
+        for (GLint64 *binding : {&m_program, &m_arrayBuffer, &m_elementArrayBuffer})
+            if (*binding > 0) *binding = UNKNOWN;
+    }
+
+    std::map<GLenum, bool> m_capabilities;
+    std::array<GLenum, 4> m_blendFunc;
+    std::array<GLfloat, 4> m_clearColor;
+    bool m_blendFuncKnown = false, m_clearColorKnown = false;
+    GLint64 m_cullFace = UNKNOWN,
+            m_program = UNKNOWN,
+            m_vertexArray = UNKNOWN,
+            m_arrayBuffer = UNKNOWN,
+            m_elementArrayBuffer = UNKNOWN;
+    Counters m_counters;
+    const std::atomic<size_t> *m_sharedDeletions = nullptr;
+    size_t m_seenDeletions = 0;
+};
+
+#endif /* end of include guard: GLSTATECACHE_HH */
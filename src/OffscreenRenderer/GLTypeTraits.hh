@@ -17,6 +17,8 @@
 #include <GL/glew.h>
 #include <type_traits>
 #include <map>
+#include <stdexcept>
+#include <string>
 
 inline const char *getGLTypeName(GLenum type) {
     static const std::map<GLenum, const char *> lut {
@@ -36,6 +38,39 @@ inline const char *getGLTypeName(GLenum type) {
     return it->second;
 }
 
+// Component type ('f', 'i' or 'u', as read by glGetUniform{f,i,ui}v) and
+// number of components of a uniform of type `type`. Types not listed are
+// samplers/images, whose value is a single texture unit.
+struct GLTypeComponents { char kind; int count; };
+inline GLTypeComponents getGLTypeComponents(GLenum type) {
+    switch (type) {
+        case GL_FLOAT:             return {'f',  1};
+        case GL_FLOAT_VEC2:        return {'f',  2};
+        case GL_FLOAT_VEC3:        return {'f',  3};
+        case GL_FLOAT_VEC4:        return {'f',  4};
+        case GL_FLOAT_MAT2:        return {'f',  4};
+        case GL_FLOAT_MAT3:        return {'f',  9};
+        case GL_FLOAT_MAT4:        return {'f', 16};
+        case GL_BOOL:
+        case GL_INT:               return {'i',  1};
+        case GL_BOOL_VEC2:
+        case GL_INT_VEC2:          return {'i',  2};
+        case GL_BOOL_VEC3:
+        case GL_INT_VEC3:          return {'i',  3};
+        case GL_BOOL_VEC4:
+        case GL_INT_VEC4:          return {'i',  4};
+        case GL_UNSIGNED_INT:      return {'u',  1};
+        case GL_UNSIGNED_INT_VEC2: return {'u',  2};
+        case GL_UNSIGNED_INT_VEC3: return {'u',  3};
+        case GL_UNSIGNED_INT_VEC4: return {'u',  4};
+        case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT2x4: case GL_FLOAT_MAT3x2:
+        case GL_FLOAT_MAT3x4: case GL_FLOAT_MAT4x2: case GL_FLOAT_MAT4x3:
+        case GL_DOUBLE: case GL_DOUBLE_VEC2: case GL_DOUBLE_VEC3: case GL_DOUBLE_VEC4:
+            throw std::runtime_error("Unhandled type id: " + std::to_string(type));
+        default:                   return {'i',  1};
+    }
+}
+
 template<typename T>
 struct GLTypeTraitsImpl;
 
@@ -50,6 +85,19 @@ template<> struct GLTypeTraitsImpl<Eigen::Matrix2f> { static constexpr GLenum ty
 template<> struct GLTypeTraitsImpl<Eigen::Matrix3f> { static constexpr GLenum type = GL_FLOAT_MAT3  ; };
 template<> struct GLTypeTraitsImpl<Eigen::Matrix4f> { static constexpr GLenum type = GL_FLOAT_MAT4  ; };
 
+// Component type of vertex attribute data stored as `T`.
+template<typename T>
+struct GLComponentType;
+
+template<> struct GLComponentType<GLbyte>      { static constexpr GLenum type = GL_BYTE          ; };
+template<> struct GLComponentType<GLubyte>     { static constexpr GLenum type = GL_UNSIGNED_BYTE ; };
+template<> struct GLComponentType<GLshort>     { static constexpr GLenum type = GL_SHORT         ; };
+template<> struct GLComponentType<GLushort>    { static constexpr GLenum type = GL_UNSIGNED_SHORT; };
+template<> struct GLComponentType<GLint>       { static constexpr GLenum type = GL_INT           ; };
+template<> struct GLComponentType<GLuint>      { static constexpr GLenum type = GL_UNSIGNED_INT  ; };
+template<> struct GLComponentType<GLfloat>     { static constexpr GLenum type = GL_FLOAT         ; };
+template<> struct GLComponentType<Eigen::half> { static constexpr GLenum type = GL_HALF_FLOAT    ; };
+
 // "Decay" Eigen expression templates to their underlying evaluated type.
 // Leave non-Eigen types unchanged.
 template<typename T>
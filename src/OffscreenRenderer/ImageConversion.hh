@@ -0,0 +1,320 @@
+////////////////////////////////////////////////////////////////////////////////
+// ImageConversion.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Fused conversion of the premultiplied RGBA images read back from OpenGL
+//  into the formats we write out: optionally unpremultiplying the colors,
+//  flipping the image vertically, and dropping the alpha channel, all in a
+//  single pass.
+//
+//  The per-row kernels are vectorized with SSE4.1/AVX2/AVX-512 (selected at
+//  runtime according to the CPU's features, so the library need not be
+//  compiled with `-march=native`) or NEON (on aarch64, where it is always
+//  available). Setting the environment variable
+//  `OFFSCREEN_RENDERER_IMAGE_KERNEL` to one of `scalar`, `sse4.1`, `avx2`,
+//  `avx512`, `neon` overrides the automatic choice (e.g., for benchmarking).
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef IMAGECONVERSION_HH
+#define IMAGECONVERSION_HH
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define OSR_X86_DISPATCH 1
+#include <immintrin.h>
+#define OSR_TARGET(isa) __attribute__((target(isa)))
+// Helpers must be inlined into their callers: otherwise calls from AVX code
+// into legacy-SSE encoded functions incur costly state transitions.
+#define OSR_INLINE_TARGET(isa) __attribute__((target(isa), always_inline)) inline
+#elif defined(__aarch64__)
+#define OSR_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace detail {
+
+// Convert `numPixels` premultiplied RGBA pixels from `src` into `dst`.
+using ConvertRowFn = void (*)(const uint8_t *src, uint8_t *dst, size_t numPixels);
+
+struct ImageKernel {
+    const char *name;
+    ConvertRowFn rgb,                  // drop alpha
+                 rgbaUnpremultiply,    // unpremultiply
+                 rgbUnpremultiply;     // unpremultiply and drop alpha
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar reference implementation (also used for the tails of the SIMD rows)
+////////////////////////////////////////////////////////////////////////////////
+// For transparent images, the render output has a "premultiplied alpha"
+// (i.e., the color components are scaled by the alpha component, and
+// the image has already effectively been composited against a black background).
+// We must divide by the alpha channel before saving.
+//
+// All kernels compute the exactly rounded result
+//      min(255, floor(255 * c / a + 1/2)) = min(255, floor((510 c + a) / (2 a)))
+// in integer arithmetic (so that they agree bit-for-bit regardless of
+// -ffast-math), leaving fully transparent pixels unchanged. This is
+// conveniently implemented by substituting a = 255 when a = 0.
+// The clamp handles blending modes that produce colors exceeding the alpha.
+template<bool Unpremultiply, bool DropAlpha>
+inline void convertRowScalar(const uint8_t *src, uint8_t *dst, size_t numPixels) {
+    constexpr size_t dstStride = DropAlpha ? 3 : 4;
+    for (size_t i = 0; i < numPixels; ++i, src += 4, dst += dstStride) {
+        if (Unpremultiply) {
+            const uint32_t a = (src[3] == 0) ? 255 : src[3];
+            for (int c = 0; c < 3; ++c) {
+                const uint32_t q = (510 * uint32_t(src[c]) + a) / (2 * a);
+                dst[c] = uint8_t((q < 255) ? q : 255);
+            }
+        }
+        else { dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; }
+        if (!DropAlpha) dst[3] = src[3];
+    }
+}
+
+#if OSR_X86_DISPATCH
+////////////////////////////////////////////////////////////////////////////////
+// SSE4.1: 4 pixels at a time.
+// Each pixel is treated as a little-endian 32 bit integer 0xAABBGGRR.
+////////////////////////////////////////////////////////////////////////////////
+// The SIMD kernels estimate each quotient n / d with a single precision
+// reciprocal of d (accurate to well within 1 since n < 2^17) and then correct
+// it using the exact integer remainder.
+OSR_INLINE_TARGET("sse4.1") __m128i unpremultiplySSE(__m128i px) {
+    const __m128i byteMask = _mm_set1_epi32(0xFF), one = _mm_set1_epi32(1), zero = _mm_setzero_si128();
+    const __m128i a    = _mm_srli_epi32(px, 24);
+    const __m128i aEff = _mm_blendv_epi8(a, byteMask, _mm_cmpeq_epi32(a, zero));
+    const __m128i d    = _mm_add_epi32(aEff, aEff);
+    const __m128  dInv = _mm_div_ps(_mm_set1_ps(1.0f), _mm_cvtepi32_ps(d));
+    __m128i result = _mm_slli_epi32(a, 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        const __m128i c = _mm_and_si128(_mm_srli_epi32(px, shift), byteMask);
+        const __m128i n = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(c, 9), _mm_slli_epi32(c, 1)), aEff); // 510 c + a
+        __m128i q = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(n), dInv));
+        const __m128i r = _mm_sub_epi32(n, _mm_mullo_epi32(q, d));
+        q = _mm_sub_epi32(q, _mm_cmpgt_epi32(r, _mm_sub_epi32(d, one))); // r >= d: increment
+        q = _mm_add_epi32(q, _mm_cmplt_epi32(r, zero));                  // r <  0: decrement
+        result = _mm_or_si128(result, _mm_slli_epi32(_mm_min_epi32(q, byteMask), shift));
+    }
+    return result;
+}
+
+// Pack 4 RGBA pixels into 12 RGB bytes at `dst`.
+OSR_INLINE_TARGET("sse4.1") void storeRGBSSE(uint8_t *dst, __m128i px) {
+    const __m128i rgb = _mm_shuffle_epi8(px, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), rgb);
+    const int32_t last = _mm_extract_epi32(rgb, 2);
+    std::memcpy(dst + 8, &last, 4);
+}
+
+template<bool Unpremultiply, bool DropAlpha>
+OSR_TARGET("sse4.1") void convertRowSSE41(const uint8_t *src, uint8_t *dst, size_t numPixels) {
+    constexpr size_t dstStride = DropAlpha ? 3 : 4;
+    size_t i = 0;
+    for (; i + 4 <= numPixels; i += 4) {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i));
+        if (Unpremultiply) px = unpremultiplySSE(px);
+        if (DropAlpha) storeRGBSSE(dst + dstStride * i, px);
+        else           _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + dstStride * i), px);
+    }
+    convertRowScalar<Unpremultiply, DropAlpha>(src + 4 * i, dst + dstStride * i, numPixels - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 pixels at a time.
+////////////////////////////////////////////////////////////////////////////////
+OSR_INLINE_TARGET("avx2") __m256i unpremultiplyAVX2(__m256i px) {
+    const __m256i byteMask = _mm256_set1_epi32(0xFF), one = _mm256_set1_epi32(1), zero = _mm256_setzero_si256();
+    const __m256i a    = _mm256_srli_epi32(px, 24);
+    const __m256i aEff = _mm256_blendv_epi8(a, byteMask, _mm256_cmpeq_epi32(a, zero));
+    const __m256i d    = _mm256_add_epi32(aEff, aEff);
+    const __m256  dInv = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_cvtepi32_ps(d));
+    __m256i result = _mm256_slli_epi32(a, 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        const __m256i c = _mm256_and_si256(_mm256_srli_epi32(px, shift), byteMask);
+        const __m256i n = _mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(c, 9), _mm256_slli_epi32(c, 1)), aEff);
+        __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(n), dInv));
+        const __m256i r = _mm256_sub_epi32(n, _mm256_mullo_epi32(q, d));
+        q = _mm256_sub_epi32(q, _mm256_cmpgt_epi32(r, _mm256_sub_epi32(d, one)));
+        q = _mm256_add_epi32(q, _mm256_cmpgt_epi32(zero, r));
+        result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_min_epi32(q, byteMask), shift));
+    }
+    return result;
+}
+
+template<bool Unpremultiply, bool DropAlpha>
+OSR_TARGET("avx2") void convertRowAVX2(const uint8_t *src, uint8_t *dst, size_t numPixels) {
+    constexpr size_t dstStride = DropAlpha ? 3 : 4;
+    size_t i = 0;
+    for (; i + 8 <= numPixels; i += 8) {
+        __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * i));
+        if (Unpremultiply) px = unpremultiplyAVX2(px);
+        if (DropAlpha) {
+            storeRGBSSE(dst + dstStride * i,      _mm256_castsi256_si128(px));
+            storeRGBSSE(dst + dstStride * i + 12, _mm256_extracti128_si256(px, 1));
+        }
+        else _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + dstStride * i), px);
+    }
+    convertRowSSE41<Unpremultiply, DropAlpha>(src + 4 * i, dst + dstStride * i, numPixels - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512: 16 pixels at a time.
+////////////////////////////////////////////////////////////////////////////////
+// GCC's AVX-512 intrinsics headers trigger spurious -Wmaybe-uninitialized
+// warnings (from their internal use of `_mm512_undefined_*`) when optimizing.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+OSR_INLINE_TARGET("avx512f") __m512i unpremultiplyAVX512(__m512i px) {
+    const __m512i byteMask = _mm512_set1_epi32(0xFF), one = _mm512_set1_epi32(1), zero = _mm512_setzero_si512();
+    const __m512i a    = _mm512_srli_epi32(px, 24);
+    const __m512i aEff = _mm512_mask_blend_epi32(_mm512_cmpeq_epi32_mask(a, zero), a, byteMask);
+    const __m512i d    = _mm512_add_epi32(aEff, aEff);
+    const __m512  dInv = _mm512_div_ps(_mm512_set1_ps(1.0f), _mm512_cvtepi32_ps(d));
+    __m512i result = _mm512_slli_epi32(a, 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        const __m512i c = _mm512_and_si512(_mm512_srli_epi32(px, shift), byteMask);
+        const __m512i n = _mm512_add_epi32(_mm512_sub_epi32(_mm512_slli_epi32(c, 9), _mm512_slli_epi32(c, 1)), aEff);
+        __m512i q = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(n), dInv));
+        const __m512i r = _mm512_sub_epi32(n, _mm512_mullo_epi32(q, d));
+        q = _mm512_mask_add_epi32(q, _mm512_cmpge_epi32_mask(r, d),    q, one);
+        q = _mm512_mask_sub_epi32(q, _mm512_cmplt_epi32_mask(r, zero), q, one);
+        result = _mm512_or_si512(result, _mm512_slli_epi32(_mm512_min_epi32(q, byteMask), shift));
+    }
+    return result;
+}
+
+template<bool Unpremultiply, bool DropAlpha>
+OSR_TARGET("avx512f") void convertRowAVX512(const uint8_t *src, uint8_t *dst, size_t numPixels) {
+    constexpr size_t dstStride = DropAlpha ? 3 : 4;
+    size_t i = 0;
+    for (; i + 16 <= numPixels; i += 16) {
+        __m512i px = _mm512_loadu_si512(src + 4 * i);
+        if (Unpremultiply) px = unpremultiplyAVX512(px);
+        if (DropAlpha) {
+            uint8_t *d = dst + dstStride * i;
+            storeRGBSSE(d,      _mm512_extracti32x4_epi32(px, 0));
+            storeRGBSSE(d + 12, _mm512_extracti32x4_epi32(px, 1));
+            storeRGBSSE(d + 24, _mm512_extracti32x4_epi32(px, 2));
+            storeRGBSSE(d + 36, _mm512_extracti32x4_epi32(px, 3));
+        }
+        else _mm512_storeu_si512(dst + dstStride * i, px);
+    }
+    convertRowAVX2<Unpremultiply, DropAlpha>(src + 4 * i, dst + dstStride * i, numPixels - i);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif // OSR_X86_DISPATCH
+
+#if OSR_NEON
+////////////////////////////////////////////////////////////////////////////////
+// NEON: 16 pixels at a time, deinterleaved into channel planes by vld4q.
+////////////////////////////////////////////////////////////////////////////////
+// Unpremultiply the 16 color values in `c` given the (substituted) alphas
+// `aEff`, widened to four groups of 4 lanes, and the corresponding
+// reciprocals `dInv` of `d = 2 aEff`.
+inline uint8x16_t unpremultiplyChannelNEON(uint8x16_t c, const int32x4_t aEff[4], const float32x4_t dInv[4]) {
+    const uint16x8_t lo = vmovl_u8(vget_low_u8(c)), hi = vmovl_u8(vget_high_u8(c));
+    const int32x4_t parts[4] = { vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(lo))), vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(lo))),
+                                 vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(hi))), vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(hi))) };
+    uint16x4_t result[4];
+    for (int k = 0; k < 4; ++k) {
+        const int32x4_t d = vaddq_s32(aEff[k], aEff[k]);
+        const int32x4_t n = vmlaq_n_s32(aEff[k], parts[k], 510);
+        int32x4_t q = vcvtq_s32_f32(vmulq_f32(vcvtq_f32_s32(n), dInv[k]));
+        const int32x4_t r = vmlsq_s32(n, q, d);
+        q = vsubq_s32(q, vreinterpretq_s32_u32(vcgeq_s32(r, d)));           // r >= d: increment
+        q = vaddq_s32(q, vreinterpretq_s32_u32(vcltq_s32(r, vdupq_n_s32(0)))); // r <  0: decrement
+        result[k] = vqmovun_s32(vminq_s32(q, vdupq_n_s32(255)));
+    }
+    return vcombine_u8(vmovn_u16(vcombine_u16(result[0], result[1])),
+                       vmovn_u16(vcombine_u16(result[2], result[3])));
+}
+
+template<bool Unpremultiply, bool DropAlpha>
+void convertRowNEON(const uint8_t *src, uint8_t *dst, size_t numPixels) {
+    constexpr size_t dstStride = DropAlpha ? 3 : 4;
+    size_t i = 0;
+    for (; i + 16 <= numPixels; i += 16) {
+        uint8x16x4_t px = vld4q_u8(src + 4 * i);
+        if (Unpremultiply) {
+            const uint16x8_t alo = vmovl_u8(vget_low_u8(px.val[3])), ahi = vmovl_u8(vget_high_u8(px.val[3]));
+            const uint32x4_t a[4] = { vmovl_u16(vget_low_u16(alo)), vmovl_u16(vget_high_u16(alo)),
+                                      vmovl_u16(vget_low_u16(ahi)), vmovl_u16(vget_high_u16(ahi)) };
+            int32x4_t aEff[4];
+            float32x4_t dInv[4];
+            for (int k = 0; k < 4; ++k) {
+                aEff[k] = vreinterpretq_s32_u32(vbslq_u32(vceqq_u32(a[k], vdupq_n_u32(0)), vdupq_n_u32(255), a[k]));
+                dInv[k] = vdivq_f32(vdupq_n_f32(1.0f), vcvtq_f32_s32(vaddq_s32(aEff[k], aEff[k])));
+            }
+            for (int c = 0; c < 3; ++c) px.val[c] = unpremultiplyChannelNEON(px.val[c], aEff, dInv);
+        }
+        if (DropAlpha) {
+            uint8x16x3_t rgb = {{ px.val[0], px.val[1], px.val[2] }};
+            vst3q_u8(dst + dstStride * i, rgb);
+        }
+        else vst4q_u8(dst + dstStride * i, px);
+    }
+    convertRowScalar<Unpremultiply, DropAlpha>(src + 4 * i, dst + dstStride * i, numPixels - i);
+}
+#endif // OSR_NEON
+
+#define OSR_IMAGE_KERNEL(name, fn) ImageKernel{ name, fn<false, true>, fn<true, false>, fn<true, true> }
+
+inline ImageKernel selectImageKernel() {
+    const char *requested = std::getenv("OFFSCREEN_RENDERER_IMAGE_KERNEL");
+    const std::string req = requested ? requested : "";
+    auto allowed = [&](const char *name) { return req.empty() || (req == name); };
+#if OSR_X86_DISPATCH
+    __builtin_cpu_init();
+    if (allowed("avx512") && __builtin_cpu_supports("avx512f")) return OSR_IMAGE_KERNEL("avx512", convertRowAVX512);
+    if (allowed("avx2")   && __builtin_cpu_supports("avx2"   )) return OSR_IMAGE_KERNEL("avx2",   convertRowAVX2);
+    if (allowed("sse4.1") && __builtin_cpu_supports("sse4.1" )) return OSR_IMAGE_KERNEL("sse4.1", convertRowSSE41);
+#elif OSR_NEON
+    if (allowed("neon")) return OSR_IMAGE_KERNEL("neon", convertRowNEON);
+#endif
+    if (!allowed("scalar")) throw std::runtime_error("Image kernel " + req + " is not supported on this CPU");
+    return OSR_IMAGE_KERNEL("scalar", convertRowScalar);
+}
+
+#undef OSR_IMAGE_KERNEL
+
+inline const ImageKernel &imageKernel() {
+    static const ImageKernel kernel = selectImageKernel();
+    return kernel;
+}
+
+} // namespace detail
+
+// Name of the SIMD kernel selected for this CPU.
+inline const char *imageKernelName() { return detail::imageKernel().name; }
+
+// Convert a `width` x `height` premultiplied RGBA image `src` (in OpenGL's
+// bottom-to-top row order if `flip` is true) into `dst`, which must hold
+// `width * height * (dropAlpha ? 3 : 4)` bytes.
+inline void convertImage(const unsigned char *src, int width, int height, unsigned char *dst,
+                         bool unpremultiply, bool flip, bool dropAlpha = false) {
+    const detail::ImageKernel &k = detail::imageKernel();
+    detail::ConvertRowFn convertRow = unpremultiply ? (dropAlpha ? k.rgbUnpremultiply : k.rgbaUnpremultiply)
+                                                    : (dropAlpha ? k.rgb              : nullptr);
+    const size_t srcRowSize = 4 * size_t(width),
+                 dstRowSize = (dropAlpha ? 3 : 4) * size_t(width);
+    if (!convertRow && !flip) { std::memcpy(dst, src, srcRowSize * height); return; }
+    for (int row = 0; row < height; ++row) {
+        const uint8_t *s = src + srcRowSize * (flip ? (height - 1 - row) : row);
+        uint8_t       *d = dst + dstRowSize * row;
+        if (convertRow) convertRow(s, d, width);
+        else            std::memcpy(d, s, srcRowSize);
+    }
+}
+
+#endif /* end of include guard: IMAGECONVERSION_HH */
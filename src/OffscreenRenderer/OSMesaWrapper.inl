@@ -14,14 +14,37 @@
 //  with one large buffer and make instances of our derived OSMesaWrapper class
 //  draw into and read from sub-rectangles of this buffer.
 //  We refer to these instances "virtual contexts".
-//  For simplicity, we concatenate the buffers vertically (even though
-//  this will be wasteful for virtual contexts with differing widths; a
-//  future improvement could employ some more efficient packing strategy.)
+//  The virtual contexts' rectangles are placed in the canvas by a shelf
+//  packer (see `RectPacker.hh`), so the canvas stays close to the contexts'
+//  total area even for differing sizes. A context's rectangle never moves
+//  while it exists, and the canvas contents are preserved when it is
+//  reallocated, so adding, resizing or deleting a context leaves the other
+//  contexts' images intact. (A resized context's own image is undefined
+//  until it is re-rendered.)
 //
-//  As a side effect, ***adding or deleting contexts will overwrite the
-//  contents of the other contexts with undefined values***; these other
-//  contexts must be re-rendered before calling `finish()` to copy out their
-//  image data.
+//  Alternatively, a virtual context can render directly into its own image
+//  buffer (see `OSMesaWrapper::setPerContextBuffers`): the OSMesa context is
+//  rebound to that buffer when the virtual context is made current, so
+//  `finish()` needs no copy out of the canvas. OSMesa keeps a single color and
+//  depth buffer for whatever memory it is bound to, so on switching between
+//  buffers the outgoing one's rendering is flushed and its depth buffer saved,
+//  and the incoming one's color and depth are loaded back. This costs a few
+//  full-frame copies per switch, so the mode pays off when each context is
+//  used by its own long-running worker (or is the only context).
+//  The canvas takes part in these switches like any other buffer, except that
+//  its depth is not preserved when it is reallocated.
+//
+//  The singleton's bookkeeping is thread-safe, but since all virtual contexts
+//  share one real context, only one thread may render with them at a time.
+//
+//  Modern Mesa does support independent contexts used concurrently by
+//  different threads; `OSMesaWrapper::setIndependentContexts(true)` makes
+//  `OpenGLContext::construct` create `OSMesaIndependentWrapper`s, each with an
+//  OSMesa context of its own (e.g., one per `RenderPool` worker). The
+//  llvmpipe rasterizer threads used by each context can be configured
+//  (per process) with `OSMesaWrapper::setRasterizerThreadCount`; see
+//  `benchmark_osmesa_threads.cc` for finding the best split of the cores
+//  between contexts and rasterizer threads.
 */
 //  Author:  Julian Panetta (jpanetta), julian.panetta@gmail.com
 //  Created:  09/22/2020 02:47:20
@@ -29,77 +52,118 @@
 #ifndef OSMESAWRAPPER_HH
 #define OSMESAWRAPPER_HH
 
+#include <atomic>
+#include <thread>
+
 #include <GL/gl.h>
 #define GLAPI extern // Annoyingly, GLEW undefs this macro, breaking osmesa...
 #include <GL/osmesa.h>
 
+#include "RectPacker.hh"
+
 struct OSMesaWrapper;
 
 namespace detail {
+    // Set once the first OSMesa context is created (llvmpipe reads its
+    // configuration then).
+    inline std::atomic<bool> &osmesaContextCreated() {
+        static std::atomic<bool> created(false);
+        return created;
+    }
+
+    inline const GLint *osmesaContextAttribs() {
+        static const GLint attribs[] = {
+            OSMESA_FORMAT,                GLint(OSMESA_RGBA),
+            OSMESA_DEPTH_BITS,            GLint(24),
+            OSMESA_STENCIL_BITS,          GLint(0),
+            OSMESA_ACCUM_BITS,            GLint(0),
+            OSMESA_CONTEXT_MAJOR_VERSION, 3,
+            OSMESA_CONTEXT_MINOR_VERSION, 1,
+            0
+        };
+        return attribs;
+    }
+
     struct OSMesaContextSingleton {
         static OSMesaContextSingleton &getInstance() {
-            static std::unique_ptr<OSMesaContextSingleton> ctx;
-            if (ctx == nullptr) ctx = std::unique_ptr<OSMesaContextSingleton>(new OSMesaContextSingleton); // make_unique cannot call private constructor
+            // Initialization of a function-local static is thread-safe.
+            static std::unique_ptr<OSMesaContextSingleton> ctx(new OSMesaContextSingleton); // make_unique cannot call private constructor
             return *ctx;
         }
 
-        std::tuple<int, int, int, int> rectForVirtualContext(const OSMesaWrapper *vctx) const;
-        void resizeToFit();
+        std::tuple<int, int, int, int> rectForVirtualContext(const OSMesaWrapper *vctx) const {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            auto it = m_virtualContexts.find(vctx);
+            if (it == m_virtualContexts.end()) throw std::runtime_error("Virtual context is not registered with this OSMesa context");
+            const RectPacker::Rect &r = it->second;
+            return std::make_tuple(r.x, r.y, r.width, r.height);
+        }
 
+        // Make the context current, rendering into virtual context `vctx`'s
+        // rectangle of the canvas.
         void makeCurrent(const OSMesaWrapper *vctx) {
-            if (!OSMesaMakeCurrent(m_ctx, m_buffer.data(), GL_UNSIGNED_BYTE, m_width, m_height))
-                throw std::runtime_error("OSMesaMakeCurrent failed!");
-
-            static bool firstTime = true;
-            if (firstTime) {
-                // Initialize GLEW entry points for our new context
-                GLenum status = glewInit();
-                // Silence spurious error with headless EGL
-                // https://github.com/nigels-com/glew/issues/273
-                if ((status != GLEW_OK) && (status != GLEW_ERROR_NO_GLX_DISPLAY)) {
-                    std::cerr << "GLEW Error: " << glewGetErrorString(status) << std::endl;
-                    throw std::runtime_error("glewInit failure");
-                }
-                std::cout << "gl version: " << glGetString(GL_VERSION) << std::endl;
-                firstTime = false;
-            }
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            m_noteUser(vctx);
+            m_bind(this, m_buffer.data(), m_width, m_height);
 
             GLint x, y, w, h;
             std::tie(x, y, w, h) = rectForVirtualContext(vctx);
             // Render to the correct rectangular region of the context's buffer
             glViewport(x, y, w, h); 
             glScissor (x, y, w, h);
-            glEnable(GL_SCISSOR_TEST);
+            m_stateCache.enable(GL_SCISSOR_TEST);
+        }
+
+        // Make the context current, rendering into the `width` x `height`
+        // RGBA `buffer` owned by virtual context `vctx`.
+        void makeCurrent(const OSMesaWrapper *vctx, unsigned char *buffer, int width, int height) {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            m_noteUser(vctx);
+            m_bind(vctx, buffer, width, height);
+            glViewport(0, 0, width, height);
+            m_stateCache.disable(GL_SCISSOR_TEST);
+        }
+
+        // Forget the buffer of virtual context `vctx` (rendering into its own
+        // buffer), which is about to be reallocated or freed.
+        void releaseBuffer(const OSMesaWrapper *vctx) {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            m_saved.erase(vctx);
+            if (m_bound.owner == vctx) m_bound = Binding();
+            ++m_generation;
         }
 
+        // Incremented whenever the binding set up by a virtual context's
+        // `makeCurrent` may have been undone: the canvas or a buffer was
+        // reallocated, or another virtual context or thread made the real
+        // context current. Virtual contexts then skip `makeCurrent`'s fast
+        // path, including on threads other than the one causing the change.
+        uint64_t generation() const { return m_generation.load(std::memory_order_acquire); }
+
+        // All virtual contexts share the real context's GL state.
+        GLStateCache &stateCache() { return m_stateCache; }
+
         int getWidth()  const { return m_width;  }
         int getHeight() const { return m_height; }
 
-        void addVirtualContext(const OSMesaWrapper *vctx) {
-            // std::cout << "Adding virtual context " << vctx << std::endl;
-            m_virtualContexts.push_back(vctx);
-            resizeToFit();
-        }
+        void addVirtualContext(const OSMesaWrapper *vctx);
 
         void removeVirtualContext(const OSMesaWrapper *vctx) {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
             // std::cout << "Removing virtual context " << vctx << std::endl;
-            size_t pos = m_virtualContexts.size();
-            for (size_t i = 0; i < m_virtualContexts.size(); ++i) {
-                if (m_virtualContexts[i] == vctx) {
-                    if (pos != m_virtualContexts.size()) throw std::logic_error("Virtual context registered multiple times");
-                    pos = i;
-                }
-            }
-            if (pos == m_virtualContexts.size()) throw std::runtime_error("Virtual context is not registered with this OSMesa context");
-            m_virtualContexts.erase(m_virtualContexts.begin() + pos);
-
-            resizeToFit();
+            auto it = m_virtualContexts.find(vctx);
+            if (it == m_virtualContexts.end()) throw std::runtime_error("Virtual context is not registered with this OSMesa context");
+            m_packer.release(it->second);
+            m_virtualContexts.erase(it);
+            m_resizeCanvas();
         }
 
+        // Reallocate the rectangle of a virtual context whose size changed.
+        void resizeVirtualContext(const OSMesaWrapper *vctx);
+
         bool virtualContextIsRegistered(const OSMesaWrapper *vctx) const {
-            for (auto vctx_i : m_virtualContexts)
-                if (vctx_i == vctx) return true;
-            return false;
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            return m_virtualContexts.count(vctx) > 0;
         }
 
         using Image = Eigen::Array<unsigned char, Eigen::Dynamic, Eigen::Dynamic>;
@@ -107,8 +171,9 @@ namespace detail {
             int x, y, w, h;
             std::tie(x, y, w, h) = rectForVirtualContext(vctx);
             // std::cout << "Accessing " << w << " x " << h << " image at " << x << ", " << y << std::endl;
+            // Each column of `fullCanvas` holds a row of RGBA bytes.
             Eigen::Map<const Image> fullCanvas(m_buffer.data(), 4 * m_width, m_height);
-            return fullCanvas.block(x, y, 4 * w, h);
+            return fullCanvas.block(4 * x, y, 4 * w, h);
         }
 
         // Write out the whole canvas (for debugging)
@@ -122,52 +187,360 @@ namespace detail {
 
     private:
         OSMesaContextSingleton() {
-            const GLint ctxAttribs[] = {
-                OSMESA_FORMAT,                GLint(OSMESA_RGBA),
-                OSMESA_DEPTH_BITS,            GLint(24),
-                OSMESA_STENCIL_BITS,          GLint(0),
-                OSMESA_ACCUM_BITS,            GLint(0),
-                OSMESA_CONTEXT_MAJOR_VERSION, 3,
-                OSMESA_CONTEXT_MINOR_VERSION, 1,
-                0
-            };
-            m_ctx = OSMesaCreateContextAttribs(ctxAttribs, /* sharelist = */ NULL);
+            osmesaContextCreated() = true;
+            m_ctx = OSMesaCreateContextAttribs(osmesaContextAttribs(), /* sharelist = */ NULL);
             if (!m_ctx) throw std::runtime_error("OSMesaCreateContext failed!");
         }
 
+        // Memory the OSMesa context renders into, and the virtual context
+        // owning it (or the singleton itself for the canvas).
+        struct Binding {
+            const void *owner = nullptr;
+            unsigned char *data = nullptr;
+            int width = 0, height = 0;
+            bool operator==(const Binding &b) const { return (owner == b.owner) && (data == b.data) && (width == b.width) && (height == b.height); }
+        };
+
+        // Contents of a buffer that is not currently bound: its color is in
+        // the buffer itself once flushed, and its depth (if any) is saved here.
+        struct SavedState { std::vector<GLuint> depth; };
+
+        void m_bind(const void *owner, unsigned char *data, int width, int height) {
+            Binding b;
+            b.owner = owner; b.data = data; b.width = width; b.height = height;
+            const bool switching = !(b == m_bound);
+            if (switching && m_bound.owner) {
+                m_makeCurrent(m_bound); // (in case another thread made it current last)
+                m_saveBound();
+            }
+            m_makeCurrent(b);
+            if (switching) {
+                m_bound = b;
+                auto it = m_saved.find(owner);
+                if (it != m_saved.end()) m_restoreBound(it->second);
+            }
+        }
+
+        void m_makeCurrent(const Binding &b) {
+            if (!OSMesaMakeCurrent(m_ctx, b.data, GL_UNSIGNED_BYTE, b.width, b.height))
+                throw std::runtime_error("OSMesaMakeCurrent failed!");
+
+            if (!m_glewInitialized) {
+                // Initialize GLEW entry points for our new context
+                GLenum status = glewInit();
+                // Silence spurious error with headless EGL
+                // https://github.com/nigels-com/glew/issues/273
+                if ((status != GLEW_OK) && (status != GLEW_ERROR_NO_GLX_DISPLAY)) {
+                    std::cerr << "GLEW Error: " << glewGetErrorString(status) << std::endl;
+                    throw std::runtime_error("glewInit failure");
+                }
+                std::cout << "gl version: " << glGetString(GL_VERSION) << std::endl;
+                m_glewInitialized = true;
+            }
+        }
+
+        // Flush the bound buffer's rendering into its memory and save its depth.
+        void m_saveBound() {
+            glFinish();
+            SavedState &s = m_saved[m_bound.owner];
+            s.depth.resize(size_t(m_bound.width) * m_bound.height);
+            GLint readFramebuffer, packBuffer;
+            glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFramebuffer);
+            glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+            m_defaultPixelStore();
+            glReadPixels(0, 0, m_bound.width, m_bound.height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, s.depth.data());
+            glPopClientAttrib();
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+            glCheckError("save OSMesa buffer");
+        }
+
+        // Load the newly bound buffer's color (from its memory) and saved
+        // depth into OSMesa's framebuffer, leaving all other state unchanged.
+        void m_restoreBound(const SavedState &s) {
+            GLint drawFramebuffer, unpackBuffer, program;
+            glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFramebuffer);
+            glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &unpackBuffer);
+            glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            glUseProgram(0);
+            glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_CURRENT_BIT | GL_PIXEL_MODE_BIT);
+            glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+            m_defaultPixelStore();
+            glDisable(GL_SCISSOR_TEST);
+            glDisable(GL_BLEND);
+            glDisable(GL_STENCIL_TEST);
+            glPixelZoom(1.0f, 1.0f);
+            glWindowPos2i(0, 0);
+
+            glDisable(GL_DEPTH_TEST);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            glDrawPixels(m_bound.width, m_bound.height, GL_RGBA, GL_UNSIGNED_BYTE, m_bound.data);
+            if (s.depth.size() == size_t(m_bound.width) * m_bound.height) {
+                // Depth is only written with the depth test enabled.
+                glEnable(GL_DEPTH_TEST);
+                glDepthFunc(GL_ALWAYS);
+                glDepthMask(GL_TRUE);
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                glDrawPixels(m_bound.width, m_bound.height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, s.depth.data());
+            }
+
+            glPopClientAttrib();
+            glPopAttrib();
+            glUseProgram(program);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuffer);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFramebuffer);
+            glCheckError("restore OSMesa buffer");
+        }
+
+        static void m_defaultPixelStore() {
+            for (GLenum pname : {GL_PACK_ROW_LENGTH, GL_PACK_SKIP_ROWS, GL_PACK_SKIP_PIXELS, GL_UNPACK_ROW_LENGTH, GL_UNPACK_SKIP_ROWS, GL_UNPACK_SKIP_PIXELS})
+                glPixelStorei(pname, 0);
+            glPixelStorei(GL_PACK_ALIGNMENT, 4);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
+
+        // Reallocate the canvas to the size required by the packer, copying
+        // over the existing contents (which stay at the same coordinates).
+        void m_resizeCanvas() {
+            if (m_virtualContexts.empty()) return; // keep the buffer the OSMesa context may still be bound to
+            const int width = m_packer.width(), height = m_packer.height();
+            if ((width == m_width) && (height == m_height)) return;
+            if (m_bound.owner == this) {
+                // Flush pending rendering into the old canvas before copying it.
+                m_makeCurrent(m_bound);
+                glFinish();
+            }
+            OpenGLContext::ImageBuffer buffer(4 * width * height);
+            const int copyWidth = std::min(width, m_width), copyHeight = std::min(height, m_height);
+            for (int y = 0; y < copyHeight; ++y)
+                buffer.segment(4 * width * y, 4 * copyWidth) = m_buffer.segment(4 * m_width * y, 4 * copyWidth);
+            m_buffer.swap(buffer);
+            m_width = width;
+            m_height = height;
+            // The canvas is rebound (and its color loaded back) when a virtual
+            // context is next made current.
+            m_saved[this] = SavedState();
+            if (m_bound.owner == this) m_bound = Binding();
+            ++m_generation;
+            // std::cout << "Resized to " << m_width << " x " << m_height << std::endl;
+        }
+
         int m_width = 0, m_height = 0;
         OpenGLContext::ImageBuffer m_buffer;
-        std::vector<const OSMesaWrapper *> m_virtualContexts; // virtual contexts will register/remove themselves from this ordered list
+        RectPacker m_packer;
+        std::map<const OSMesaWrapper *, RectPacker::Rect> m_virtualContexts; // virtual contexts will register/remove themselves
+        Binding m_bound;
+        std::map<const void *, SavedState> m_saved; // keyed by buffer owner
+        std::atomic<uint64_t> m_generation{0};
+        const OSMesaWrapper *m_lastUser = nullptr;
+        std::thread::id m_lastThread;
+
+        void m_noteUser(const OSMesaWrapper *vctx) {
+            const std::thread::id thread = std::this_thread::get_id();
+            if ((vctx == m_lastUser) && (thread == m_lastThread)) return;
+            m_lastUser = vctx;
+            m_lastThread = thread;
+            ++m_generation;
+        }
         OSMesaContext m_ctx;
+        bool m_glewInitialized = false;
+        GLStateCache m_stateCache;
+        mutable std::recursive_mutex m_mutex; // guards the canvas and virtual context list
     };
 }
 
 struct OSMesaWrapper : public OpenGLContext {
-    OSMesaWrapper(int width, int height) {
+    OSMesaWrapper(int width, int height)
+        : m_perContextBuffer(perContextBuffers())
+    {
         resize(width, height);
-        ctx().addVirtualContext(this);
+        if (!m_perContextBuffer) ctx().addVirtualContext(this);
+        ++m_numInstances();
     }
 
     virtual ~OSMesaWrapper() {
-        ctx().removeVirtualContext(this);
+        --m_numInstances();
+        // Our objects live in the real context, which outlives us: delete
+        // them (and the names still queued for deletion) ourselves.
+        makeCurrent();
+        if (m_readbackPBOs.size()) m_releaseReadbackBuffers();
+        if (m_perContextBuffer) ctx().releaseBuffer(this);
+        else                    ctx().removeVirtualContext(this);
     }
 
     detail::OSMesaContextSingleton &ctx() { return detail::OSMesaContextSingleton::getInstance(); }
 
+    virtual GLStateCache &stateCache() override { return ctx().stateCache(); }
+
+    // Whether contexts constructed from now on render directly into their own
+    // image buffer instead of a sub-rectangle of the shared canvas (see the
+    // file comment). Defaults to whether $OFFSCREEN_RENDERER_OSMESA_PER_CONTEXT_BUFFERS
+    // is set to a value other than "0".
+    static bool perContextBuffers() { return m_perContextBuffersDefault(); }
+    static void setPerContextBuffers(bool enable) { m_perContextBuffersDefault() = enable; }
+
+    bool hasPerContextBuffer() const { return m_perContextBuffer; }
+
+    // Whether `OpenGLContext::construct` creates independent OSMesa contexts
+    // (`OSMesaIndependentWrapper`) that can render concurrently on different
+    // threads, rather than virtual contexts sharing the singleton's context.
+    // Defaults to whether $OFFSCREEN_RENDERER_OSMESA_INDEPENDENT_CONTEXTS is
+    // set to a value other than "0".
+    static bool independentContexts() { return m_independentContextsDefault(); }
+    static void setIndependentContexts(bool enable) { m_independentContextsDefault() = enable; }
+
+    // Number of virtual contexts currently sharing the singleton's context
+    // (which must not be used by several threads at once).
+    static size_t numVirtualContexts() { return m_numInstances(); }
+
+    // Number of llvmpipe rasterizer threads each OSMesa context uses (0:
+    // rasterize on the thread issuing the GL calls), or -1 for llvmpipe's
+    // default (one per CPU). llvmpipe reads this setting ($LP_NUM_THREADS)
+    // once, when the first OSMesa context is created, so it can only be
+    // changed before then.
+    static int rasterizerThreadCount() {
+        const char *env = std::getenv("LP_NUM_THREADS");
+        if ((env == nullptr) || (*env == '\0')) return -1;
+        return std::atoi(env);
+    }
+
+    static void setRasterizerThreadCount(int numThreads) {
+        if (detail::osmesaContextCreated())
+            throw std::runtime_error("The rasterizer thread count must be set before the first OSMesa context is created");
+        if (numThreads < 0) unsetenv("LP_NUM_THREADS");
+        else                setenv("LP_NUM_THREADS", std::to_string(numThreads).c_str(), /* overwrite = */ 1);
+    }
+
 private:
+    static bool m_envFlag(const char *name) {
+        const char *env = std::getenv(name);
+        return (env != nullptr) && (*env != '\0') && (std::string(env) != "0");
+    }
+
+    static std::atomic<bool> &m_perContextBuffersDefault() {
+        static std::atomic<bool> enabled(m_envFlag("OFFSCREEN_RENDERER_OSMESA_PER_CONTEXT_BUFFERS"));
+        return enabled;
+    }
+
+    static std::atomic<bool> &m_independentContextsDefault() {
+        static std::atomic<bool> enabled(m_envFlag("OFFSCREEN_RENDERER_OSMESA_INDEPENDENT_CONTEXTS"));
+        return enabled;
+    }
+
+    static std::atomic<size_t> &m_numInstances() {
+        static std::atomic<size_t> count(0);
+        return count;
+    }
+
     virtual void m_resizeImpl(int /* width */, int /* height */) override {
+        // Our buffer has been reallocated; it is rebound at the next `makeCurrent`.
+        if (m_perContextBuffer) {
+            ctx().releaseBuffer(this);
+            return;
+        }
         // Notify osmesa context of our new size if we are already registered
         // (but not if this call is triggered by the OSMesaWrapper constructor).
         if (ctx().virtualContextIsRegistered(this)) {
-            ctx().resizeToFit();
+            ctx().resizeVirtualContext(this);
         }
     }
 
-    virtual void m_makeCurrent() override { ctx().makeCurrent(this); }
+    virtual uint64_t m_bindingGeneration() const override { return detail::OSMesaContextSingleton::getInstance().generation(); }
+
+    virtual void m_makeCurrent() override {
+        if (m_perContextBuffer) ctx().makeCurrent(this, m_buffer.data(), m_width, m_height);
+        else                    ctx().makeCurrent(this);
+    }
 
-    virtual void m_readImage() {
+    virtual void m_readImage() override {
+        if (m_perContextBuffer) return; // `glFinish` already flushed the rendering into `m_buffer`
         Eigen::Map<detail::OSMesaContextSingleton::Image>(m_buffer.data(), m_width * 4, m_height) = ctx().imageForVirtualContext(this);
     }
+
+    virtual void m_readImageAsync() override {
+        int x = 0, y = 0, w = m_width, h = m_height;
+        if (!m_perContextBuffer) std::tie(x, y, w, h) = ctx().rectForVirtualContext(this);
+        glReadPixels(x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    const bool m_perContextBuffer;
+};
+
+// An OSMesa context of its own, which may render concurrently with other
+// such contexts on other threads. Like `EGLWrapper`, it renders into a
+// framebuffer object (see RenderTarget.hh). OSMesa shares the buffer state
+// it binds among all contexts binding buffers of the same size and format,
+// so each context binds a private dummy buffer of a distinct size (1 x id).
+struct OSMesaIndependentWrapper : public OpenGLContext {
+    OSMesaIndependentWrapper(int width, int height, const OSMesaIndependentWrapper *shareWith = nullptr, GLint depthBits = 24)
+        : m_id(m_allocateId()), m_dummy(4 * m_id, 0)
+    {
+        detail::osmesaContextCreated() = true;
+        m_ctx = OSMesaCreateContextAttribs(detail::osmesaContextAttribs(), /* sharelist = */ shareWith ? shareWith->m_ctx : NULL);
+        if (!m_ctx) {
+            m_releaseId(m_id);
+            throw std::runtime_error("OSMesaCreateContext failed!");
+        }
+
+        makeCurrent();
+        m_glewInit();
+
+        m_renderTarget.create(RenderTarget::depthFormat(depthBits));
+        resize(width, height);
+    }
+
+    virtual ~OSMesaIndependentWrapper() {
+        // The context's objects (including the render target) die with it.
+        m_releaseCurrent();
+        OSMesaDestroyContext(m_ctx);
+        m_releaseId(m_id);
+    }
+
+    virtual GLuint renderTargetFramebuffer() const override { return m_renderTarget.framebuffer(); }
+    virtual GLuint renderTargetDepthBuffer() const override { return m_renderTarget.depthBuffer(); }
+
+private:
+    virtual void m_makeCurrent() override {
+        if (!OSMesaMakeCurrent(m_ctx, m_dummy.data(), GL_UNSIGNED_BYTE, 1, m_id))
+            throw std::runtime_error("OSMesaMakeCurrent failed!");
+    }
+
+    virtual void m_releaseCurrent() override {
+        if (OSMesaGetCurrentContext() == m_ctx)
+            OSMesaMakeCurrent(NULL, NULL, GL_UNSIGNED_BYTE, 0, 0);
+    }
+
+    virtual void m_readImage() override { m_readPixels(m_buffer.data()); }
+
+    virtual void m_resizeImpl(int width, int height) override {
+        makeCurrent();
+        m_renderTarget.resize(width, height);
+    }
+
+    // Smallest ids not used by a live context (keeping the dummy buffers small).
+    static std::mutex &m_idMutex() { static std::mutex mutex; return mutex; }
+    static std::set<int> &m_usedIds() { static std::set<int> ids; return ids; }
+    static int m_allocateId() {
+        std::lock_guard<std::mutex> lock(m_idMutex());
+        int id = 1;
+        for (int used : m_usedIds()) { if (used != id) break; ++id; }
+        m_usedIds().insert(id);
+        return id;
+    }
+    static void m_releaseId(int id) {
+        std::lock_guard<std::mutex> lock(m_idMutex());
+        m_usedIds().erase(id);
+    }
+
+    const int m_id;
+    std::vector<unsigned char> m_dummy;
+    OSMesaContext m_ctx = nullptr;
+    RenderTarget m_renderTarget;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -175,29 +548,23 @@ private:
 // OSMesaWrapper as a non-incomplete type.
 ////////////////////////////////////////////////////////////////////////////////
 namespace detail{
-    std::tuple<int, int, int, int> OSMesaContextSingleton::rectForVirtualContext(const OSMesaWrapper *vctx) const {
-        int x = 0, y = 0;
-        for (auto vctx_i : m_virtualContexts) {
-            if (vctx_i == vctx)
-                return std::make_tuple(x, y, vctx->getWidth(), vctx->getHeight());
-            y += vctx_i->getHeight();
-        }
-        throw std::runtime_error("Virtual context is not registered with this OSMesa context");
+    void OSMesaContextSingleton::addVirtualContext(const OSMesaWrapper *vctx) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        // std::cout << "Adding virtual context " << vctx << std::endl;
+        if (m_virtualContexts.count(vctx)) throw std::logic_error("Virtual context registered multiple times");
+        m_virtualContexts.emplace(vctx, m_packer.allocate(vctx->getWidth(), vctx->getHeight()));
+        m_resizeCanvas();
     }
 
-    void OSMesaContextSingleton::resizeToFit() {
-        if (m_virtualContexts.size() == 0) return;
-        m_width = 0;
-        m_height = 0;
-        for (auto vctx_i : m_virtualContexts) {
-            m_height += vctx_i->getHeight();
-            m_width   = std::max(m_width, vctx_i->getWidth());
-        }
-        m_buffer.resize(m_width * m_height * 4);
-        makeCurrent(m_virtualContexts.back()); // side-effect: apply the updated size to the OSMesa context.
-        // std::cout << "Resized to " << m_width << " x " << m_height << std::endl;
+    void OSMesaContextSingleton::resizeVirtualContext(const OSMesaWrapper *vctx) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        auto it = m_virtualContexts.find(vctx);
+        if (it == m_virtualContexts.end()) throw std::runtime_error("Virtual context is not registered with this OSMesa context");
+        m_packer.release(it->second);
+        it->second = m_packer.allocate(vctx->getWidth(), vctx->getHeight());
+        m_resizeCanvas();
+        ++m_generation; // move the viewport to the context's new rectangle
     }
 }
 
-
 #endif /* end of include guard: OSMESAWRAPPER_HH */
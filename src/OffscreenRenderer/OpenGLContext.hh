@@ -14,17 +14,61 @@
 #include <fstream>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <cstring>
 #include <stdexcept>
 #include <string>
+#include <atomic>
 #include <memory>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
 
-#if PNG_WRITER
-#include "write_png.h"
-#endif
+#include "AsyncImageWriter.hh"
+#include "GLDeletionQueue.hh"
 #include "GLErrors.hh"
+#include "GLStateCache.hh"
+#include "ImageConversion.hh"
+#include "RenderTarget.hh"
 
 #include <GL/glew.h>
 
+struct OpenGLContext;
+
+// Contexts created into the same share group (see `OpenGLContext::construct`)
+// share their programs, shaders, buffers and textures, so these need to be
+// created/uploaded only once; container objects (vertex array and framebuffer
+// objects) remain per context. Shared resources stay alive until the last
+// context of the group is destroyed, not just the context that created them.
+// All contexts of a group must live on the same device.
+//
+// GL only guarantees that a change to a shared object made through one
+// context is seen by another once the changing context has flushed its
+// commands (e.g., `finish()`). Uniform values are program state, so
+// contexts rendering concurrently should not set different uniforms on
+// the same `Shader`.
+struct ShareGroup {
+    // Number of live contexts in the group.
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+
+    // A live context of the group, preferably the one current on this
+    // thread (null if the group is empty).
+    std::shared_ptr<OpenGLContext> anyContext() const;
+
+    // Record that a shared object was deleted (so its name may be reused);
+    // the contexts' state caches then forget their program/buffer bindings.
+    void noteDeletion() { m_deletions.fetch_add(1, std::memory_order_release); }
+
+private:
+    friend struct OpenGLContext;
+    mutable std::mutex m_mutex; // guards `m_members`
+    std::mutex m_joinMutex;     // held while a new context is created into the group
+    mutable std::vector<std::weak_ptr<OpenGLContext>> m_members;
+    std::atomic<size_t> m_deletions{0};
+};
+
 struct OpenGLContext {
     using ImageBuffer = Eigen::Array<unsigned char, Eigen::Dynamic, 1>;
     // Convenience types for accessing a single component of each RGBA pixel or
@@ -34,10 +78,52 @@ struct OpenGLContext {
     using MapColor      = Eigen::Map<      Eigen::Array<unsigned char, Eigen::Dynamic, 3, Eigen::RowMajor>, 0, Eigen::OuterStride<4>>;
     using MapConstColor = Eigen::Map<const Eigen::Array<unsigned char, Eigen::Dynamic, 3, Eigen::RowMajor>, 0, Eigen::OuterStride<4>>;
 
-    // Factory method for getting the right platform-specific library
-    static std::shared_ptr<OpenGLContext> construct(int width, int height);
+    // Rendering devices (GPUs or software renderers) that contexts can be
+    // placed on; only EGL supports enumerating and selecting devices (through
+    // EGL_EXT_device_enumeration and EGL_EXT_platform_device).
+    enum : int {
+        DEFAULT_DEVICE  = -1, // the platform's default display
+        SOFTWARE_DEVICE = -2  // the first software renderer (e.g., Mesa's llvmpipe device)
+    };
+    struct DeviceInfo {
+        int index;                 // device index to pass to `construct`
+        std::string extensions;    // device extensions
+        std::string drmDeviceFile; // e.g., /dev/dri/card0 (empty if unknown)
+        bool software;
+    };
+    static std::vector<DeviceInfo> devices();
+
+    // Map SOFTWARE_DEVICE to the index of the device it selects (other
+    // devices are returned unchanged).
+    static int resolveDevice(int device);
+
+    // Factory method for getting the right platform-specific library, creating
+    // the context on `device` (an index into `devices()`, DEFAULT_DEVICE or
+    // SOFTWARE_DEVICE) as a member of share group `group` (a new group of its
+    // own if null).
+    static std::shared_ptr<OpenGLContext> construct(int width, int height, int device = DEFAULT_DEVICE,
+                                                    std::shared_ptr<ShareGroup> group = nullptr);
+
+    const std::shared_ptr<ShareGroup> &shareGroup() const { return m_shareGroup; }
+
+    // Device the context was created on (after `resolveDevice`).
+    int device() const { return m_device; }
+
+    // Number of contexts currently alive on `device`.
+    static size_t numContextsOnDevice(int device) {
+        device = resolveDevice(device);
+        std::lock_guard<std::mutex> lock(m_deviceCountMutex());
+        auto it = m_deviceCounts().find(device);
+        return (it == m_deviceCounts().end()) ? 0 : it->second;
+    }
 
     void resize(int width, int height, bool skipViewportCall = false) {
+        // Frames queued for asynchronous readback have the old size;
+        // discard them (and the PBOs sized to hold them).
+        if (m_readbackPBOs.size()) {
+            makeCurrent();
+            m_releaseReadbackBuffers();
+        }
         m_width = width;
         m_height = height;
         m_buffer.resize(width * height * 4);
@@ -49,7 +135,73 @@ struct OpenGLContext {
     int getWidth()  const { return m_width;  }
     int getHeight() const { return m_height; }
 
-    void makeCurrent() { m_makeCurrent(); }
+    // Making the context current is skipped if this thread already made it
+    // current (through this class). Code switching contexts behind our back
+    // must call `invalidateCurrentContext()`. Either way, objects queued for
+    // deletion (see `deletionQueue()`) are deleted.
+    void makeCurrent() {
+        CurrentContext &cur = m_currentContext();
+        if ((cur.ctx == this) && (cur.serial == m_serial) && (cur.generation == m_bindingGeneration())) {
+            stateCache().countElided(); m_flushDeletions(); return;
+        }
+        m_makeCurrent();
+        cur.ctx = this;
+        cur.serial = m_serial;
+        cur.generation = m_bindingGeneration();
+        stateCache().countIssued();
+        m_flushDeletions();
+    }
+
+    // Objects released by `RAIIGLResource`s (from any thread) awaiting
+    // deletion; they are deleted in batches by the next `makeCurrent` or
+    // `finish` call.
+    GLDeletionQueue &deletionQueue() { return m_deletionQueue; }
+
+    // Delete the queued objects now.
+    void flushDeletions() { makeCurrent(); }
+
+    // A context can be current on only one thread at a time: release it on
+    // this thread before making it current on another.
+    void releaseCurrent() {
+        m_releaseCurrent();
+        CurrentContext &cur = m_currentContext();
+        if (cur.ctx == this) cur = CurrentContext();
+    }
+
+    // Forget which context this thread made current, forcing the next
+    // `makeCurrent` call to be issued.
+    static void invalidateCurrentContext() { m_currentContext() = CurrentContext(); }
+
+    // State cache of the context this thread made current (if any).
+    static GLStateCache *currentStateCache() {
+        OpenGLContext *ctx = m_currentContext().ctx;
+        return ctx ? &ctx->stateCache() : nullptr;
+    }
+
+    // Whether the context supports OpenGL extension `name` (e.g.,
+    // "GL_ARB_buffer_storage"); the extension list is queried once.
+    bool hasExtension(const std::string &name) {
+        if (!m_extensionsQueried) {
+            makeCurrent();
+            GLint n = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+            for (GLint i = 0; i < n; ++i) {
+                const GLubyte *ext = glGetStringi(GL_EXTENSIONS, i);
+                if (ext) m_extensions.emplace(reinterpret_cast<const char *>(ext));
+            }
+            glCheckError("query extensions");
+            m_extensionsQueried = true;
+        }
+        return m_extensions.count(name) != 0;
+    }
+
+    // Shadow copy of this context's GL state, used to skip redundant calls.
+    virtual GLStateCache &stateCache() { return m_stateCache; }
+    const GLStateCache::Counters &stateCacheCounters() { return stateCache().counters(); }
+
+    // Must be called after modifying any of the tracked state (see
+    // `GLStateCache`) with direct GL calls.
+    void invalidateStateCache() { stateCache().invalidate(); }
 
     template<class F> void render(F &&f) {
         makeCurrent();
@@ -60,130 +212,317 @@ struct OpenGLContext {
         makeCurrent();
         if ((color.size() < 3) || (color.size() > 4))
             throw std::runtime_error("Unexpected color size");
-        glClearColor(color[0], color[1], color[2], (color.size() == 3)  ? 1.0 : color[3]);
+        stateCache().clearColor(color[0], color[1], color[2], (color.size() == 3)  ? 1.0 : color[3]);
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     }
 
     void enable(GLenum capability) {
         makeCurrent();
-        glEnable(capability);
+        stateCache().enable(capability);
         glCheckError("glEnable");
     }
 
     void disable(GLenum capability) {
         makeCurrent();
-        glDisable(capability);
+        stateCache().disable(capability);
         glCheckError("glDisable");
     }
 
     void cullFace(GLenum face) {
         makeCurrent();
-        glEnable(GL_CULL_FACE);
-        glCullFace(face);
+        stateCache().enable(GL_CULL_FACE);
+        stateCache().cullFace(face);
         glCheckError("cull face");
     }
 
     void finish() {
+        makeCurrent(); // (also deletes the names queued for deletion)
         glFinish();
         m_readImage();
     }
 
+    // Framebuffer object this context renders into (0 for the default
+    // framebuffer). Code that renders into its own framebuffers must rebind
+    // this one afterward, e.g., with `bindRenderTarget()`.
+    virtual GLuint renderTargetFramebuffer() const { return 0; }
+    // Depth renderbuffer attached to `renderTargetFramebuffer()` (0 if the
+    // default framebuffer is used or there is no depth buffer).
+    virtual GLuint renderTargetDepthBuffer() const { return 0; }
+
+    void bindRenderTarget() {
+        makeCurrent();
+        glBindFramebuffer(GL_FRAMEBUFFER, renderTargetFramebuffer());
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Asynchronous readback
+    ////////////////////////////////////////////////////////////////////////////
+    // `requestReadback()` queues a copy of the current frame into one of a
+    // ring of pixel buffer objects and returns immediately, so that the next
+    // frame can be rendered while the copy is in flight.
+    // `isReady()` polls (without blocking) whether the oldest queued frame
+    // has arrived, and `acquireFrame()` copies it into `buffer()`, blocking
+    // only if the copy has not finished yet.
+    // Frames are acquired in the order they were requested; at most
+    // `readbackRingSize()` frames can be in flight at once.
+    void requestReadback() {
+        if (m_pendingReadbacks.size() >= m_readbackRingSize)
+            throw std::runtime_error("All readback buffers are in flight; call acquireFrame() first");
+        makeCurrent();
+        m_allocateReadbackBuffers();
+
+        // Since frames are acquired in FIFO order, the next PBO in the ring is always free.
+        GLuint pbo = m_readbackPBOs[m_nextReadbackPBO];
+        m_nextReadbackPBO = (m_nextReadbackPBO + 1) % m_readbackPBOs.size();
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        m_readImageAsync();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush(); // Make sure the fence is actually submitted so that polling `isReady` eventually succeeds.
+        glCheckError("requestReadback");
+        m_pendingReadbacks.push_back({pbo, fence});
+    }
+
+    bool isReady() {
+        if (m_pendingReadbacks.empty()) return false;
+        makeCurrent();
+        GLenum status = glClientWaitSync(m_pendingReadbacks.front().fence, 0, 0);
+        if (status == GL_WAIT_FAILED) throw std::runtime_error("glClientWaitSync failed");
+        return (status == GL_ALREADY_SIGNALED) || (status == GL_CONDITION_SATISFIED);
+    }
+
+    const ImageBuffer &acquireFrame() {
+        if (m_pendingReadbacks.empty()) throw std::runtime_error("No frame was requested with requestReadback()");
+        makeCurrent();
+        PendingReadback r = m_pendingReadbacks.front();
+        m_pendingReadbacks.pop_front();
+
+        GLenum status;
+        do { status = glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, /* 1s */ 1000000000); }
+        while (status == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(r.fence);
+        if (status == GL_WAIT_FAILED) throw std::runtime_error("glClientWaitSync failed");
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+        const void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, m_buffer.size(), GL_MAP_READ_BIT);
+        if (data) {
+            std::memcpy(m_buffer.data(), data, m_buffer.size());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (!data) throw std::runtime_error("Failed to map readback buffer");
+        glCheckError("acquireFrame");
+        return m_buffer;
+    }
+
+    size_t pendingReadbacks() const { return m_pendingReadbacks.size(); }
+    size_t readbackRingSize() const { return m_readbackRingSize; }
+    void setReadbackRingSize(size_t n) {
+        if (n == 0) throw std::runtime_error("Readback ring must hold at least one buffer");
+        if (m_readbackPBOs.size()) {
+            makeCurrent();
+            m_releaseReadbackBuffers();
+        }
+        m_readbackRingSize = n;
+    }
+
     void blendFunc(GLenum sfactor, GLenum dfactor) { blendFunc(sfactor, dfactor, sfactor, dfactor); }
     void blendFunc(GLenum sfactor, GLenum dfactor, GLenum alpha_sfactor, GLenum alpha_dfactor) {
         makeCurrent();
-        glBlendFuncSeparate(sfactor, dfactor, alpha_sfactor, alpha_dfactor);
+        stateCache().blendFuncSeparate(sfactor, dfactor, alpha_sfactor, alpha_dfactor);
         glCheckError("blend func");
     }
 
     const ImageBuffer &buffer() const { return m_buffer; }
 
     const ImageBuffer unpremultipliedBuffer() const {
-        // For transparent images, the render output has a "premultiplied alpha"
-        // (i.e., the color components are scaled by the alpha component, and
-        // the image has already effectively been composited against a black background).
-        // We must divide by the alpha channel before saving.
-#if 0
-        const int numPixels = m_width * m_height;
-        MapConstCmpnt alpha(m_buffer.data() + 3, numPixels);
-        Eigen::ArrayXf colorScale = (alpha != 0).select(255.0f / alpha.cast<float>(), 1.0f);
-
-        // ImageBuffer result(m_buffer.size());
-        // MapColor(result.data(),     numPixels, 3) = ((MapConstColor(m_buffer.data(), numPixels, 3).cast<float>().colwise() * colorScale).round()).cast<unsigned char>();
-        // MapCmpnt(result.data() + 3, numPixels, 1) = alpha;
-        // MapColor(result.data(), numPixels, 3) = (MapColor(result.data(), numPixels, 3).cast<float>().colwise() * colorScale).cast<unsigned char>();
-
-        // Surpisingly this appears to be the fastest Eigen implementation
-        ImageBuffer result(m_buffer);
-        MapCmpnt(result.data() + 0, numPixels) = (MapCmpnt(result.data() + 0, numPixels).cast<float>() * colorScale).round().cast<unsigned char>();
-        MapCmpnt(result.data() + 1, numPixels) = (MapCmpnt(result.data() + 1, numPixels).cast<float>() * colorScale).round().cast<unsigned char>();
-        MapCmpnt(result.data() + 2, numPixels) = (MapCmpnt(result.data() + 2, numPixels).cast<float>() * colorScale).round().cast<unsigned char>();
-
-        // ImageBuffer result(m_buffer.size());
-        // MapCmpnt(result.data() + 0, numPixels) = (MapConstCmpnt(m_buffer.data() + 0, numPixels).cast<float>() * colorScale).round().cast<unsigned char>();
-        // MapCmpnt(result.data() + 1, numPixels) = (MapConstCmpnt(m_buffer.data() + 1, numPixels).cast<float>() * colorScale).round().cast<unsigned char>();
-        // MapCmpnt(result.data() + 2, numPixels) = (MapConstCmpnt(m_buffer.data() + 2, numPixels).cast<float>() * colorScale).round().cast<unsigned char>();
-        // MapCmpnt(result.data() + 3, numPixels) =  MapConstCmpnt(m_buffer.data() + 3, numPixels);
-#else
-        // More cache friendly, direct implementation (somehow ~20x faster than the fastest Eigen variant above!)
-        ImageBuffer result = m_buffer;
-        unsigned char *end = result.data() + m_buffer.size();
-        for (unsigned char *pixel = result.data(); pixel != end; pixel += 4) {
-            // const unsigned char alpha_uchar = pixel[3] == 0 ? 1 : pixel[3];
-            // float scale = 255.0f / alpha_uchar;
-            const unsigned char alpha_uchar = pixel[3];
-            float scale = (alpha_uchar == 0) ? 1.0f : 255.0f / alpha_uchar;
-            pixel[0] = (unsigned char) (float(pixel[0]) * scale + 0.5f);
-            pixel[1] = (unsigned char) (float(pixel[1]) * scale + 0.5f);
-            pixel[2] = (unsigned char) (float(pixel[2]) * scale + 0.5f);
-        }
-#endif
+        ImageBuffer result(m_buffer.size());
+        readInto(result.data(), /* unpremultiply = */ true, /* flip = */ false);
         return result;
     }
 
-    void writePPM(const std::string &path, bool unpremultiply = true) const {
-        std::ofstream outFile(path, std::ofstream::binary);
-        if (!outFile.is_open())
-            throw std::runtime_error("Failed to open " + path);
-
-        outFile << "P6\n";
-        outFile << m_width << " " << m_height << "\n";
-        outFile << "255\n";
-
-        const ImageBuffer &buf = unpremultiply ? unpremultipliedBuffer() : buffer();
+    // Write the image into caller-provided storage `out` of size
+    // `width * height * (rgb ? 3 : 4)`, optionally unpremultiplying it,
+    // flipping it vertically (into the top-to-bottom scanline order used by
+    // image files and numpy) and dropping its alpha channel in a single pass.
+    // This avoids the temporary allocated by `unpremultipliedBuffer()`.
+    void readInto(unsigned char *out, bool unpremultiply = true, bool flip = true, bool rgb = false) const {
+        convertImage(m_buffer.data(), m_width, m_height, out, unpremultiply, flip, rgb);
+    }
 
-        // Write the RGB components of the image in PPM format.
+    void writePPM(const std::string &path, bool unpremultiply = true) const {
         // Due to the opposite vertical axis conventions of OpenGL and PPM, the
-        // buffer holds a vertically flipped image; we flip it while writing.
-        for (int row = 0; row < m_height; ++row) {
-            for (int col = 0; col < m_width; ++col) {
-                int pixel = (m_height - row - 1) * m_width + col;
-                outFile.write((const char *) &buf[4 * pixel], 3);
-            }
-        }
+        // buffer holds a vertically flipped image; we flip it while converting.
+        std::vector<unsigned char> rgb(3 * size_t(m_width) * m_height);
+        readInto(rgb.data(), unpremultiply, /* flip = */ true, /* rgb = */ true);
+        write_ppm_RGB(path, m_width, m_height, rgb.data());
     }
 
-    void writePNG(const std::string &path, bool unpremultiply = true) const {
+    // See `write_png_RGBA` for the compression parameters.
+    void writePNG(const std::string &path, bool unpremultiply = true, int compressionLevel = -1, int filters = -1) const {
 #if PNG_WRITER
-        const ImageBuffer &buf = unpremultiply ? unpremultipliedBuffer() : buffer();
-        write_png_RGBA(path, m_width, m_height, buf.data(), /* verticalFlip = */ true);
+        if (!unpremultiply) {
+            write_png_RGBA(path, m_width, m_height, m_buffer.data(), /* verticalFlip = */ true, compressionLevel, filters);
+            return;
+        }
+        ImageBuffer buf(m_buffer.size());
+        readInto(buf.data(), /* unpremultiply = */ true, /* flip = */ true);
+        write_png_RGBA(path, m_width, m_height, buf.data(), /* verticalFlip = */ false, compressionLevel, filters);
 #else
-        throw std::runtime_error("writePNG enabled because libpng is not available");
+        throw std::runtime_error("writePNG disabled because libpng is not available");
 #endif
     }
 
-    virtual ~OpenGLContext()  { }
+    // Versions of `writePNG`/`writePPM` that snapshot the current image and
+    // encode/write it on the shared `AsyncImageWriter::global()` pool
+    // (blocking only if that pool's queue is full).
+    std::future<void> writePNGAsync(const std::string &path, bool unpremultiply = true, int compressionLevel = -1, int filters = -1) const {
+        return AsyncImageWriter::global().writePNG(path, m_width, m_height, m_buffer.data(), unpremultiply, compressionLevel, filters);
+    }
+
+    std::future<void> writePPMAsync(const std::string &path, bool unpremultiply = true) const {
+        return AsyncImageWriter::global().writePPM(path, m_width, m_height, m_buffer.data(), unpremultiply);
+    }
+
+    OpenGLContext() { m_setDevice(DEFAULT_DEVICE); }
+
+    virtual ~OpenGLContext()  {
+        // Our container objects die with us, but shared objects still queued
+        // for deletion must be deleted by another context of the group.
+        if (!m_deletionQueue.empty() && m_shareGroup) {
+            if (auto other = m_shareGroup->anyContext()) {
+                GLDeletionQueue::Batch pending = m_deletionQueue.take();
+                other->m_deletionQueue.enqueue([&](GLDeletionQueue::Batch &b) { pending.moveShared(b); });
+            }
+        }
+        CurrentContext &cur = m_currentContext();
+        if (cur.ctx == this) cur = CurrentContext();
+        m_setDevice(NO_DEVICE);
+    }
 
 protected:
+    friend struct ShareGroup;
+
     int m_width, m_height;
     ImageBuffer m_buffer;
 
+    struct PendingReadback { GLuint pbo; GLsync fence; };
+    std::vector<GLuint> m_readbackPBOs;
+    size_t m_readbackRingSize = 3, m_nextReadbackPBO = 0;
+    std::deque<PendingReadback> m_pendingReadbacks;
+
+    GLStateCache m_stateCache;
+    GLDeletionQueue m_deletionQueue;
+    std::set<std::string> m_extensions;
+    bool m_extensionsQueried = false;
+
+    // Record the device this context lives on (for `numContextsOnDevice`);
+    // backends supporting devices call this from their constructors.
+    enum : int { NO_DEVICE = -3 };
+    void m_setDevice(int device) {
+        std::lock_guard<std::mutex> lock(m_deviceCountMutex());
+        if (m_device != NO_DEVICE) --m_deviceCounts()[m_device];
+        m_device = device;
+        if (m_device != NO_DEVICE) ++m_deviceCounts()[m_device];
+    }
+    int m_device = NO_DEVICE;
+
+    std::shared_ptr<ShareGroup> m_shareGroup;
+
+    // Create a context of the build's backend sharing objects with
+    // `shareWith` (if not null).
+    static std::shared_ptr<OpenGLContext> m_constructBackend(int width, int height, int device, const OpenGLContext *shareWith);
+
+    // The backend context `shareWith` (null if not sharing), which must be
+    // of the same type as the context being created.
+    template<class Wrapper>
+    static const Wrapper *m_shareContext(const OpenGLContext *shareWith) {
+        if (shareWith == nullptr) return nullptr;
+        auto result = dynamic_cast<const Wrapper *>(shareWith);
+        if (result == nullptr) throw std::runtime_error("Contexts in a share group must be of the same type");
+        return result;
+    }
+
+    static std::mutex &m_deviceCountMutex() { static std::mutex mutex; return mutex; }
+    static std::map<int, size_t> &m_deviceCounts() { static std::map<int, size_t> counts; return counts; }
+
+    // The context most recently made current on this thread through
+    // `makeCurrent`; the serial number guards against a new context being
+    // allocated at the address of a destroyed one, and the binding
+    // generation against the binding having been changed by another thread.
+    struct CurrentContext {
+        OpenGLContext *ctx = nullptr;
+        uint64_t serial = 0, generation = 0;
+    };
+    static CurrentContext &m_currentContext() {
+        static thread_local CurrentContext current;
+        return current;
+    }
+    const uint64_t m_serial = m_nextSerial();
+    static uint64_t m_nextSerial() {
+        static std::atomic<uint64_t> counter(0);
+        return ++counter;
+    }
+
+    // Delete the queued objects (the context must be current); deleting
+    // shared buffers or programs frees their names for reuse by the other
+    // contexts of the group, whose state caches must then forget them.
+    void m_flushDeletions() {
+        if (m_deletionQueue.flush(stateCache()) && m_shareGroup) m_shareGroup->noteDeletion();
+    }
+
+    // Changes whenever the context must be made current again even if this
+    // thread did so last (e.g., when another thread reallocated or rebound
+    // the buffer it renders into).
+    virtual uint64_t m_bindingGeneration() const { return 0; }
+
     virtual void m_makeCurrent() = 0;
+    virtual void m_releaseCurrent() { }
 
     virtual void m_readImage() { }
     virtual void m_resizeImpl(int /* width */, int /* height */) { }
 
+    // Read the image from the render target into `dst` (or, if `dst` is
+    // null, into the currently bound GL_PIXEL_PACK_BUFFER).
+    void m_readPixels(void *dst) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, renderTargetFramebuffer());
+        glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, dst);
+        glCheckError("Read image");
+    }
+
+    // Issue a read of the image into the currently bound GL_PIXEL_PACK_BUFFER.
+    virtual void m_readImageAsync() { m_readPixels(nullptr); }
+
+    void m_allocateReadbackBuffers() {
+        if (m_readbackPBOs.size() == m_readbackRingSize) return;
+        m_releaseReadbackBuffers();
+        m_readbackPBOs.resize(m_readbackRingSize);
+        glGenBuffers(m_readbackPBOs.size(), m_readbackPBOs.data());
+        for (GLuint pbo : m_readbackPBOs) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, m_buffer.size(), nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glCheckError("allocate readback buffers");
+    }
+
+    // Must be called with this context current.
+    void m_releaseReadbackBuffers() {
+        for (const auto &r : m_pendingReadbacks) glDeleteSync(r.fence);
+        m_pendingReadbacks.clear();
+        if (m_readbackPBOs.size()) glDeleteBuffers(m_readbackPBOs.size(), m_readbackPBOs.data());
+        m_readbackPBOs.clear();
+        m_nextReadbackPBO = 0;
+    }
+
     void m_glewInit() {
+        // GLEW's entry points are process-wide globals; serialize their
+        // initialization for contexts created concurrently on several threads.
+        static std::mutex glewMutex;
+        std::lock_guard<std::mutex> lock(glewMutex);
         GLenum status = glewInit();
         // Silence spurious error with headless EGL
         // https://github.com/nigels-com/glew/issues/273
@@ -204,15 +543,65 @@ protected:
 static_assert(false, "No context wrapper available");
 #endif
 
+#if USE_EGL
+inline std::vector<OpenGLContext::DeviceInfo> OpenGLContext::devices() { return detail::EGLDevices::getInstance().info(); }
+inline int OpenGLContext::resolveDevice(int device) { return detail::EGLDevices::getInstance().resolve(device); }
+#else
+inline std::vector<OpenGLContext::DeviceInfo> OpenGLContext::devices() { return std::vector<DeviceInfo>(); }
+inline int OpenGLContext::resolveDevice(int device) { return device; }
+#endif
+
+inline size_t ShareGroup::size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t n = 0;
+    for (const auto &m : m_members) n += !m.expired();
+    return n;
+}
+
+inline std::shared_ptr<OpenGLContext> ShareGroup::anyContext() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::shared_ptr<OpenGLContext> result;
+    OpenGLContext *current = OpenGLContext::m_currentContext().ctx;
+    for (const auto &m : m_members) {
+        auto ctx = m.lock();
+        if (!ctx) continue;
+        if (ctx.get() == current) return ctx;
+        if (!result) result = ctx;
+    }
+    return result;
+}
+
+inline std::shared_ptr<OpenGLContext> OpenGLContext::construct(int width, int height, int device, std::shared_ptr<ShareGroup> group) {
+    if (!group) group = std::make_shared<ShareGroup>();
+    // Creating the group's contexts one at a time ensures that each shares
+    // with the previously created ones.
+    std::lock_guard<std::mutex> joinLock(group->m_joinMutex);
+    auto ctx = m_constructBackend(width, height, device, group->anyContext().get());
+    ctx->m_shareGroup = group;
+    ctx->m_stateCache.trackSharedDeletions(&group->m_deletions);
+    std::lock_guard<std::mutex> lock(group->m_mutex);
+    auto &members = group->m_members;
+    members.erase(std::remove_if(members.begin(), members.end(), [](const std::weak_ptr<OpenGLContext> &m) { return m.expired(); }), members.end());
+    members.push_back(ctx);
+    return ctx;
+}
+
 // Factory method for getting the right platform-specific library
-inline std::shared_ptr<OpenGLContext> OpenGLContext::construct(int width, int height) {
+inline std::shared_ptr<OpenGLContext> OpenGLContext::m_constructBackend(int width, int height, int device, const OpenGLContext *shareWith) {
     #if USE_EGL
-    return std::make_shared<EGLWrapper>(width, height);
-    #elif USE_OSMESA
+    return std::make_shared<EGLWrapper>(width, height, GL_RGBA, 24, 0, 0, device, shareWith);
+    #else
+    if (device != DEFAULT_DEVICE) throw std::runtime_error("Device selection is only supported with EGL");
+    #endif
+    #if USE_OSMESA
+    if (OSMesaWrapper::independentContexts()) return std::make_shared<OSMesaIndependentWrapper>(width, height, m_shareContext<OSMesaIndependentWrapper>(shareWith));
+    // Virtual contexts all render with the same OSMesa context, so they
+    // share everything anyway.
+    m_shareContext<OSMesaWrapper>(shareWith);
     return std::make_shared<OSMesaWrapper>(width, height);
     #elif USE_CGL
-    return std::make_shared<CGLWrapper>(width, height);
-    #else
+    return std::make_shared<CGLWrapper>(width, height, GL_RGBA, 24, 0, 0, m_shareContext<CGLWrapper>(shareWith));
+    #elif !USE_EGL
     static_assert(false, "No context wrapper available");
     #endif
 }
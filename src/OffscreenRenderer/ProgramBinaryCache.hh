@@ -0,0 +1,202 @@
+////////////////////////////////////////////////////////////////////////////////
+// ProgramBinaryCache.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Persistent on-disk cache of linked shader program binaries
+//  (glGetProgramBinary/glProgramBinary), letting short-lived processes skip
+//  shader compilation. Entries are keyed by a hash of the shader sources and
+//  of the GL vendor, renderer and version strings; binaries the driver
+//  rejects (e.g., after a driver update with unchanged version strings) are
+//  simply recompiled and overwritten.
+//
+//  The cache lives in `$OFFSCREEN_RENDERER_SHADER_CACHE` if set (an empty
+//  value disables it), else in `$XDG_CACHE_HOME/offscreen_renderer/shaders`
+//  or `~/.cache/offscreen_renderer/shaders`. Files are written atomically
+//  (write to a temporary file, then rename), so concurrent processes can
+//  share a cache directory.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef PROGRAMBINARYCACHE_HH
+#define PROGRAMBINARYCACHE_HH
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <GL/glew.h>
+
+struct ProgramBinaryCache {
+    struct Stats {
+        size_t hits = 0, misses = 0,
+               rejected = 0, // cached binaries the driver failed to load
+               stores = 0;
+    };
+
+    // 64-bit FNV-1a hash of the program's sources (tagged with their shader
+    // stages) and of the current context's driver identification strings.
+    // The context must be current.
+    static std::string key(const std::vector<std::pair<GLenum, std::string>> &stageSources) {
+        uint64_t h = 14695981039346656037ull;
+        auto hashBytes = [&h](const void *data, size_t size) {
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            for (size_t i = 0; i < size; ++i) { h ^= bytes[i]; h *= 1099511628211ull; }
+        };
+        auto hashString = [&](const std::string &s) {
+            const uint64_t size = s.size();
+            hashBytes(&size, sizeof(size)); // delimit consecutive strings
+            hashBytes(s.data(), s.size());
+        };
+        for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) {
+            const GLubyte *str = glGetString(name);
+            hashString(str ? reinterpret_cast<const char *>(str) : "");
+        }
+        for (const auto &s : stageSources) {
+            hashBytes(&s.first, sizeof(s.first));
+            hashString(s.second);
+        }
+        char buf[17];
+        std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+        return buf;
+    }
+
+    // Whether the cache is enabled and the current context supports
+    // retrieving program binaries.
+    static bool available() {
+        if (directory().empty()) return false;
+        if ((glGetProgramBinary == nullptr) || (glProgramBinary == nullptr) || (glProgramParameteri == nullptr)) return false;
+        GLint numFormats = 0;
+        // (The query is supported wherever the entry points above are.)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+        return numFormats > 0;
+    }
+
+    // Try to load the cached binary for `key` into program `prog`, returning
+    // whether `prog` is now successfully linked.
+    static bool load(GLuint prog, const std::string &key) {
+        std::ifstream in(m_path(key), std::ios::binary);
+        if (!in.is_open()) { ++m_stats().misses; return false; }
+
+        Header header;
+        std::vector<char> binary;
+        if (in.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+                (std::memcmp(header.magic, m_magic(), sizeof(header.magic)) == 0) && (header.length > 0)) {
+            binary.resize(header.length);
+            in.read(binary.data(), binary.size());
+        }
+        if (binary.empty() || !in) { ++m_stats().rejected; return false; }
+
+        glProgramBinary(prog, header.format, binary.data(), GLsizei(binary.size()));
+        // e.g., GL_INVALID_ENUM for a format that is no longer supported
+        if (glGetError() != GL_NO_ERROR) { ++m_stats().rejected; return false; }
+        GLint status = GL_FALSE;
+        glGetProgramiv(prog, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) { ++m_stats().rejected; return false; }
+        ++m_stats().hits;
+        return true;
+    }
+
+    // Request that the binary of `prog` be retrievable; must be called before linking.
+    static void prepare(GLuint prog) { glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE); }
+
+    // Write the binary of the successfully linked program `prog` to the cache.
+    // Failures are ignored: the cache is only an optimization.
+    static void store(GLuint prog, const std::string &key) {
+        GLint length = 0;
+        glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        std::vector<char> binary(length);
+        Header header;
+        std::memcpy(header.magic, m_magic(), sizeof(header.magic));
+        glGetProgramBinary(prog, length, nullptr, &header.format, binary.data());
+        if (glGetError() != GL_NO_ERROR) return;
+        header.length = binary.size();
+
+        if (!m_makeDirectories(directory())) return;
+        const std::string path = m_path(key);
+        const std::string tmpPath = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream out(tmpPath, std::ios::binary);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(binary.data(), binary.size());
+            if (!out) { out.close(); std::remove(tmpPath.c_str()); return; }
+        }
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) { std::remove(tmpPath.c_str()); return; }
+        ++m_stats().stores;
+    }
+
+    static std::string directory() {
+        std::lock_guard<std::mutex> lock(m_configMutex());
+        return m_directory();
+    }
+
+    // Override the cache location; an empty path disables the cache.
+    static void setDirectory(const std::string &dir) {
+        std::lock_guard<std::mutex> lock(m_configMutex());
+        m_directory() = dir;
+    }
+
+    static Stats stats() {
+        Stats result;
+        result.hits     = m_stats().hits;
+        result.misses   = m_stats().misses;
+        result.rejected = m_stats().rejected;
+        result.stores   = m_stats().stores;
+        return result;
+    }
+
+    static void resetStats() {
+        m_stats().hits = 0; m_stats().misses = 0; m_stats().rejected = 0; m_stats().stores = 0;
+    }
+
+private:
+    static const char *m_magic() { return "ORPB"; }
+    struct Header {
+        char magic[4];
+        GLenum format;
+        uint64_t length;
+    };
+
+    struct AtomicStats {
+        std::atomic<size_t> hits{0}, misses{0}, rejected{0}, stores{0};
+    };
+    static AtomicStats &m_stats() { static AtomicStats stats; return stats; }
+
+    static std::mutex &m_configMutex() { static std::mutex mutex; return mutex; }
+
+    static std::string &m_directory() {
+        static std::string dir = []() -> std::string {
+            if (const char *env = std::getenv("OFFSCREEN_RENDERER_SHADER_CACHE")) return env;
+            if (const char *xdg = std::getenv("XDG_CACHE_HOME")) { if (*xdg) return std::string(xdg) + "/offscreen_renderer/shaders"; }
+            if (const char *home = std::getenv("HOME")) { if (*home) return std::string(home) + "/.cache/offscreen_renderer/shaders"; }
+            return std::string();
+        }();
+        return dir;
+    }
+
+    static std::string m_path(const std::string &key) { return directory() + "/" + key + ".bin"; }
+
+    // mkdir -p
+    static bool m_makeDirectories(const std::string &dir) {
+        for (size_t pos = 1; pos <= dir.size(); ++pos) {
+            if ((pos == dir.size()) || (dir[pos] == '/')) {
+                const std::string prefix = dir.substr(0, pos);
+                if ((mkdir(prefix.c_str(), 0755) != 0) && (errno != EEXIST)) return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif /* end of include guard: PROGRAMBINARYCACHE_HH */
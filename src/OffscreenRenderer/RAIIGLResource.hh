@@ -4,6 +4,16 @@
 /*! @file
 //  CRTP class providing a safe wrapper around an OpenGL resource (shader,
 //  buffer, etc.) guarding against leaks, dangling ids, and double frees.
+//
+//  Resources that GL shares between the contexts of a share group (see
+//  `ShareGroup`) live as long as any context of their creator's group;
+//  derived classes wrapping container objects (VAOs, FBOs) must declare
+//  `static constexpr bool shareable = false` to stay tied to their creator.
+//
+//  Releasing a resource does not touch GL: derived classes implement
+//  `m_enqueueDeletion(batch)`, adding their object names to the context's
+//  `GLDeletionQueue`, so that resources can be released on any thread
+//  without making the context current there.
 */
 //  Author:  Julian Panetta (jpanetta), julian.panetta@gmail.com
 //  Created:  09/23/2020 17:37:35
@@ -13,40 +23,72 @@
 
 #include "OpenGLContext.hh"
 
-// Resource linked to a particular context
+// Resource linked to a particular context (or share group)
 template<class Derived>
 struct RAIIGLResource {
-    RAIIGLResource(std::weak_ptr<OpenGLContext> ctx) : m_ctx(ctx) { }
+    static constexpr bool shareable = true;
+
+    RAIIGLResource(std::weak_ptr<OpenGLContext> ctx) : m_ctx(ctx) { m_initGroup(); }
     RAIIGLResource(std::weak_ptr<OpenGLContext> ctx, GLuint _id) : id(_id), m_ctx(ctx) {
+        m_initGroup();
         m_validateConstruction();
     }
 
     // Eliminate dangerous copy constructor/assignment;
     // provide move constructor/assignment instead.
     RAIIGLResource(const RAIIGLResource &) = delete;
-    RAIIGLResource(RAIIGLResource &&b) : id(b.id) { b.id = 0; }
+    RAIIGLResource(RAIIGLResource &&b) : id(b.id), m_ctx(std::move(b.m_ctx)), m_group(std::move(b.m_group)) { b.id = 0; }
 
     RAIIGLResource &operator=(const RAIIGLResource &  ) = delete;
-    RAIIGLResource &operator=(      RAIIGLResource &&b) { id = b.id; b.id = 0; m_ctx = b.m_ctx; b.m_ctx.reset(); return *this; }
+    RAIIGLResource &operator=(      RAIIGLResource &&b) {
+        if (this == &b) return *this;
+        m_release(); // free the resource being replaced
+        id = b.id; b.id = 0; m_ctx = b.m_ctx; b.m_ctx.reset(); m_group = std::move(b.m_group); return *this;
+    }
 
     // Note: if a context is destroyed, the driver should automatically
     // deallocate all of its resources (assuming they are not shared by
     // another context).
-    bool allocated() const { return (id != 0) && !m_ctx.expired(); }
+    bool allocated() const { return (id != 0) && (!m_ctx.expired() || (m_shared() && !m_group->empty())); }
+
+    // Share group of the context that created the resource.
+    const std::shared_ptr<ShareGroup> &shareGroup() const { return m_group; }
+
+    ~RAIIGLResource() { m_release(); }
+
+    GLuint id = 0;
+protected:
+    std::weak_ptr<OpenGLContext> m_ctx;
+    std::shared_ptr<ShareGroup> m_group;
 
-    ~RAIIGLResource() {
+    static constexpr bool m_shareable() { return Derived::shareable; }
+    bool m_shared() const { return m_shareable() && m_group; }
+
+    // A context through which the resource can be accessed: its creator or,
+    // for shared resources, another context of the group (null if none is
+    // left).
+    std::shared_ptr<OpenGLContext> m_context() const {
+        auto ctx = m_ctx.lock();
+        if (!ctx && m_shared()) ctx = m_group->anyContext();
+        return ctx;
+    }
+
+    // Queue the resource (if any) for deletion. Derived classes whose
+    // `m_enqueueDeletion` accesses their own members must call this from
+    // their destructor, since those members are already destroyed when ours
+    // runs.
+    void m_release() {
         if (allocated()) {
             // std::cout << "Deleting resource " << id << std::endl;
-            auto ctx = m_ctx.lock();
+            auto ctx = m_context();
             if (!ctx) { std::cerr << "WARNING: could not lock context" << std::endl; return; }
-            ctx->makeCurrent();
-            static_cast<Derived *>(this)->m_delete();
+            ctx->deletionQueue().enqueue([this](GLDeletionQueue::Batch &b) { static_cast<Derived *>(this)->m_enqueueDeletion(b); });
         }
+        id = 0;
+    }
+    void m_initGroup() {
+        if (auto ctx = m_ctx.lock()) m_group = ctx->shareGroup();
     }
-
-    GLuint id = 0;
-protected:
-    std::weak_ptr<OpenGLContext> m_ctx;
     void m_validateConstruction() {
         glCheckError("resource creation");
         if (id == 0) throw std::runtime_error("Resource creation failed");
@@ -0,0 +1,188 @@
+////////////////////////////////////////////////////////////////////////////////
+// RectPacker.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Shelf packing of rectangles into a canvas that grows as needed, used to
+//  place the OSMesa virtual contexts in the shared canvas. Rectangles are
+//  placed in horizontal shelves spanning the canvas width; each shelf keeps a
+//  free list of (coalesced) horizontal spans, so released space is reused by
+//  later allocations. Allocated rectangles never move: the canvas grows by
+//  adding shelves at the top or by widening (which extends every shelf to the
+//  right), and shrinks by dropping empty shelves at the top or free columns
+//  at the right.
+//
+//  The canvas height is rounded up to a multiple of `slabHeight` and its
+//  width to a multiple of `widthGranularity`, so that a sequence of
+//  allocations reallocates the canvas only occasionally.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef RECTPACKER_HH
+#define RECTPACKER_HH
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+struct RectPacker {
+    struct Rect { int x, y, width, height; };
+
+    RectPacker(int slabHeight = 64, int widthGranularity = 16)
+        : m_slabHeight(slabHeight), m_widthGranularity(widthGranularity)
+    {
+        if ((slabHeight <= 0) || (widthGranularity <= 0)) throw std::runtime_error("Invalid packing granularity");
+    }
+
+    // Allocate a `width` x `height` rectangle, growing the canvas if needed.
+    Rect allocate(int width, int height) {
+        if ((width <= 0) || (height <= 0)) throw std::runtime_error("Invalid rectangle size");
+        if (width > m_width) m_widen(m_roundUp(width, m_widthGranularity));
+
+        // Best fit: the shelf wasting the least area, and within it the
+        // narrowest span that fits. The top shelf can also be raised to fit a
+        // taller rectangle.
+        auto best = m_shelves.end();
+        size_t bestSpan = 0;
+        long bestWaste = 0;
+        int bestLeftover = 0;
+        for (auto it = m_shelves.begin(); it != m_shelves.end(); ++it) {
+            const Shelf &s = it->second;
+            const bool isTop = std::next(it) == m_shelves.end();
+            if ((s.height < height) && !isTop) continue;
+            // Empty shelves are split to the rectangle's height (below), and
+            // raising the top shelf grows the canvas by less than opening a
+            // new shelf would; count that growth as waste.
+            const long waste = (s.height < height) ? long(height - s.height) * m_width
+                             : (s.numRects == 0)   ? 0
+                                                   : long(s.height - height) * width;
+            for (size_t i = 0; i < s.spans.size(); ++i) {
+                const int leftover = s.spans[i].width - width;
+                if (leftover < 0) continue;
+                if ((best == m_shelves.end()) || (waste < bestWaste) || ((waste == bestWaste) && (leftover < bestLeftover)))
+                    { best = it; bestSpan = i; bestWaste = waste; bestLeftover = leftover; }
+            }
+        }
+        // Prefer opening a new shelf over wasting more than half of the area
+        // used in a partially filled one.
+        if ((best != m_shelves.end()) && (best->second.height >= height) && (bestWaste > long(width) * height))
+            best = m_shelves.end();
+
+        if (best == m_shelves.end()) {
+            Shelf s;
+            s.height = height;
+            s.spans.push_back(Span{0, m_width});
+            best = m_shelves.emplace(m_top(), s).first;
+            bestSpan = 0;
+        }
+        else if ((best->second.numRects == 0) && (best->second.height > height)) {
+            // Leave the rest of an empty shelf's height free as a new shelf.
+            Shelf rest;
+            rest.height = best->second.height - height;
+            rest.spans.push_back(Span{0, m_width});
+            m_shelves.emplace(best->first + height, rest);
+            best->second.height = height;
+        }
+
+        Shelf &s = best->second;
+        s.height = std::max(s.height, height);
+        Span &span = s.spans[bestSpan];
+        const Rect r{span.x, best->first, width, height};
+        span.x     += width;
+        span.width -= width;
+        if (span.width == 0) s.spans.erase(s.spans.begin() + bestSpan);
+        ++s.numRects;
+        m_updateHeight();
+        return r;
+    }
+
+    // Return a rectangle previously obtained from `allocate` to the free list.
+    void release(const Rect &r) {
+        auto it = m_shelves.find(r.y);
+        if ((it == m_shelves.end()) || (it->second.numRects == 0) || (r.height > it->second.height))
+            throw std::runtime_error("Rectangle was not allocated by this packer");
+        Shelf &s = it->second;
+        auto pos = std::lower_bound(s.spans.begin(), s.spans.end(), r.x, [](const Span &span, int x) { return span.x < x; });
+        pos = s.spans.insert(pos, Span{r.x, r.width});
+        // Coalesce with the neighboring free spans.
+        if ((std::next(pos) != s.spans.end()) && (pos->x + pos->width == std::next(pos)->x)) {
+            pos->width += std::next(pos)->width;
+            s.spans.erase(std::next(pos));
+        }
+        if ((pos != s.spans.begin()) && (std::prev(pos)->x + std::prev(pos)->width == pos->x)) {
+            std::prev(pos)->width += pos->width;
+            s.spans.erase(pos);
+        }
+        --s.numRects;
+
+        if (s.numRects == 0) {
+            // Merge runs of empty shelves so that taller rectangles fit there.
+            if (it != m_shelves.begin() && (std::prev(it)->second.numRects == 0)) {
+                std::prev(it)->second.height += s.height;
+                it = std::prev(m_shelves.erase(it));
+            }
+            auto next = std::next(it);
+            if ((next != m_shelves.end()) && (next->second.numRects == 0)) {
+                it->second.height += next->second.height;
+                m_shelves.erase(next);
+            }
+            // Drop an empty top shelf.
+            if (std::next(it) == m_shelves.end()) m_shelves.erase(it);
+        }
+        m_shrinkWidth();
+        m_updateHeight();
+    }
+
+    // Canvas size needed to hold all allocated rectangles.
+    int width()  const { return m_width;  }
+    int height() const { return m_height; }
+
+    bool empty() const { return m_shelves.empty(); }
+
+private:
+    struct Span { int x, width; };
+    struct Shelf {
+        int height = 0;
+        size_t numRects = 0;
+        std::vector<Span> spans; // free spans, sorted by x
+    };
+
+    static int m_roundUp(int val, int multiple) { return ((val + multiple - 1) / multiple) * multiple; }
+
+    int m_top() const { return m_shelves.empty() ? 0 : m_shelves.rbegin()->first + m_shelves.rbegin()->second.height; }
+
+    void m_updateHeight() { m_height = m_roundUp(m_top(), m_slabHeight); }
+
+    // Extend every shelf (and its free list) to the new canvas width.
+    void m_widen(int width) {
+        for (auto &entry : m_shelves) {
+            auto &spans = entry.second.spans;
+            if (!spans.empty() && (spans.back().x + spans.back().width == m_width)) spans.back().width += width - m_width;
+            else spans.push_back(Span{m_width, width - m_width});
+        }
+        m_width = width;
+    }
+
+    // Drop free columns at the right edge of the canvas.
+    void m_shrinkWidth() {
+        int used = 0;
+        for (const auto &entry : m_shelves) {
+            const auto &spans = entry.second.spans;
+            used = std::max(used, (!spans.empty() && (spans.back().x + spans.back().width == m_width)) ? spans.back().x : m_width);
+        }
+        const int width = m_roundUp(used, m_widthGranularity);
+        if (width == m_width) return;
+        for (auto &entry : m_shelves) {
+            auto &spans = entry.second.spans;
+            if (spans.back().x >= width) spans.pop_back();
+            else spans.back().width = width - spans.back().x;
+        }
+        m_width = width;
+    }
+
+    int m_slabHeight, m_widthGranularity;
+    int m_width = 0, m_height = 0;
+    std::map<int, Shelf> m_shelves; // keyed by the shelf's y coordinate
+};
+
+#endif /* end of include guard: RECTPACKER_HH */
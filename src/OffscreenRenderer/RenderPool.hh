@@ -0,0 +1,191 @@
+////////////////////////////////////////////////////////////////////////////////
+// RenderPool.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Parallel rendering within a single process: a pool of worker threads,
+//  each owning its own OpenGL context (created on, and kept current on, that
+//  thread). Jobs are callables receiving the context of whichever worker
+//  picks them up; `render` additionally reads back the resulting frame on the
+//  worker and returns it through a future.
+//
+//  Since a job may run on any worker, per-context state (shaders, buffers)
+//  must either be created by the job itself or set up once per worker (e.g.,
+//  lazily, keyed on the context). Alternatively, a factory creating every
+//  worker's context into one `ShareGroup` lets the workers share shaders and
+//  buffers (with a VAO view per worker).
+//
+//  OSMesa's virtual contexts share a single real context, so the pool is
+//  limited to one worker in that case unless independent OSMesa contexts are
+//  enabled (see `maxWorkers()` and `OSMesaWrapper::setIndependentContexts`).
+//
+//  On machines with several EGL devices, `deviceFactory` spreads the
+//  workers' contexts over the devices (round-robin or to the device with the
+//  fewest live contexts).
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef RENDERPOOL_HH
+#define RENDERPOOL_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "OpenGLContext.hh"
+#include "ThreadPool.hh"
+
+struct RenderPool {
+    // Called on each worker thread to create its context.
+    using ContextFactory = std::function<std::shared_ptr<OpenGLContext>(int, int)>;
+
+    enum class Placement { ROUND_ROBIN, LEAST_LOADED };
+
+    struct Frame {
+        int width = 0, height = 0;
+        // RGBA pixels in the order requested from `render`
+        OpenGLContext::ImageBuffer rgba;
+    };
+
+    // numWorkers = 0: one worker per hardware thread (clamped to `maxWorkers()`).
+    // maxQueued:      number of jobs that may wait for a worker before `submit`
+    //                 and `render` start blocking (0: twice the worker count).
+    // The constructor returns once every worker's context has been created,
+    // rethrowing the first context creation failure (if any).
+    RenderPool(int width, int height, size_t numWorkers = 0, size_t maxQueued = 0,
+               ContextFactory factory = [](int w, int h) { return OpenGLContext::construct(w, h); })
+        : m_contexts(m_clampWorkers(numWorkers)),
+          m_pool(m_contexts.size(), maxQueued,
+                 [this, width, height, factory](size_t i) { m_startWorker(i, width, height, factory); },
+                 [this](size_t i) { m_contexts[i].reset(); })
+    {
+        std::unique_lock<std::mutex> lock(m_startMutex);
+        m_startCV.wait(lock, [this]() { return m_numStarted == m_contexts.size(); });
+        if (m_startError) std::rethrow_exception(m_startError);
+    }
+
+    RenderPool(const RenderPool &) = delete;
+    RenderPool &operator=(const RenderPool &) = delete;
+
+    // Run `f(ctx)` on the next free worker with its context `ctx` current,
+    // returning a future for its result. Blocks while the job queue is full.
+    template<class F>
+    auto submit(F &&f) -> std::future<decltype(f(std::declval<OpenGLContext &>()))> {
+        using Fn = typename std::decay<F>::type;
+        return m_pool.submit([this, fn = Fn(std::forward<F>(f))]() mutable {
+            return fn(m_workerContext());
+        });
+    }
+
+    // Run the drawing commands `f(ctx)` on the next free worker and read back
+    // the result. The frame is optionally unpremultiplied and/or flipped into
+    // top-to-bottom scanline order on the worker.
+    template<class F>
+    std::future<Frame> render(F &&f, bool unpremultiply = false, bool flip = false) {
+        using Fn = typename std::decay<F>::type;
+        return submit([fn = Fn(std::forward<F>(f)), unpremultiply, flip](OpenGLContext &ctx) mutable {
+            fn(ctx);
+            ctx.finish();
+            Frame frame;
+            frame.width  = ctx.getWidth();
+            frame.height = ctx.getHeight();
+            frame.rgba.resize(ctx.buffer().size());
+            ctx.readInto(frame.rgba.data(), unpremultiply, flip);
+            return frame;
+        });
+    }
+
+    // Block until every submitted job has completed.
+    void wait() { m_pool.wait(); }
+
+    size_t numWorkers() const { return m_contexts.size(); }
+    size_t maxQueued()  const { return m_pool.maxQueued(); }
+
+    // Factory placing each context on one of `devices` (indices into
+    // `OpenGLContext::devices()`; by default, all hardware devices, or all
+    // devices if there are none), either in turn or on the device currently
+    // holding the fewest contexts (counting contexts created elsewhere).
+    static ContextFactory deviceFactory(Placement placement, std::vector<int> devices = std::vector<int>()) {
+        if (devices.empty()) {
+            const auto info = OpenGLContext::devices();
+            for (const auto &d : info) if (!d.software) devices.push_back(d.index);
+            if (devices.empty()) for (const auto &d : info) devices.push_back(d.index);
+            if (devices.empty()) devices.push_back(OpenGLContext::DEFAULT_DEVICE);
+        }
+        for (int &d : devices) d = OpenGLContext::resolveDevice(d);
+
+        if (placement == Placement::ROUND_ROBIN) {
+            auto next = std::make_shared<std::atomic<size_t>>(0);
+            return [devices, next](int w, int h) { return OpenGLContext::construct(w, h, devices[(*next)++ % devices.size()]); };
+        }
+        // Choosing and creating under a lock so that concurrently started
+        // workers see each other's contexts.
+        auto mutex = std::make_shared<std::mutex>();
+        return [devices, mutex](int w, int h) {
+            std::lock_guard<std::mutex> lock(*mutex);
+            int best = devices[0];
+            for (int d : devices)
+                if (OpenGLContext::numContextsOnDevice(d) < OpenGLContext::numContextsOnDevice(best)) best = d;
+            return OpenGLContext::construct(w, h, best);
+        };
+    }
+
+    // Upper bound on the number of workers supported by the context backend.
+    static size_t maxWorkers() {
+#if USE_OSMESA
+        if (!OSMesaWrapper::independentContexts()) return 1;
+#endif
+        return size_t(-1);
+    }
+
+private:
+    static size_t m_clampWorkers(size_t numWorkers) {
+        if (numWorkers == 0) numWorkers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        return std::min(numWorkers, maxWorkers());
+    }
+
+    void m_startWorker(size_t i, int width, int height, const ContextFactory &factory) {
+        std::exception_ptr error;
+        try {
+            auto ctx = factory(width, height);
+            if (!ctx) throw std::runtime_error("RenderPool context factory returned null");
+            ctx->makeCurrent();
+            m_contexts[i] = std::move(ctx);
+        }
+        catch (...) { error = std::current_exception(); }
+
+        {
+            std::lock_guard<std::mutex> lock(m_startMutex);
+            if (error && !m_startError) m_startError = error;
+            ++m_numStarted;
+        }
+        m_startCV.notify_all();
+    }
+
+    OpenGLContext &m_workerContext() {
+        const size_t i = ThreadPool::currentWorkerIndex();
+        if ((i >= m_contexts.size()) || !m_contexts[i]) throw std::logic_error("RenderPool job is not running on a worker with a context");
+        OpenGLContext &ctx = *m_contexts[i];
+        ctx.makeCurrent();
+        return ctx;
+    }
+
+    // Each worker writes only its own entry.
+    std::vector<std::shared_ptr<OpenGLContext>> m_contexts;
+
+    std::mutex m_startMutex;
+    std::condition_variable m_startCV;
+    size_t m_numStarted = 0;
+    std::exception_ptr m_startError;
+
+    // The pool is declared last so that its destructor (which finishes the
+    // queued jobs and destroys the contexts on their threads) runs first.
+    ThreadPool m_pool;
+};
+
+#endif /* end of include guard: RENDERPOOL_HH */
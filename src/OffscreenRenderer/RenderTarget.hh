@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////////////
+// RenderTarget.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Framebuffer object with an RGBA8 color renderbuffer and a depth
+//  renderbuffer, used as the render target of contexts that do not draw
+//  into a window-system surface. Resizing reallocates the attachments'
+//  storage but keeps the framebuffer (and the context owning it) alive.
+//
+//  The owning context manages the lifetime explicitly (it must be current
+//  for every call), since the framebuffer dies with the context anyway.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef RENDERTARGET_HH
+#define RENDERTARGET_HH
+
+#include <stdexcept>
+#include <GL/glew.h>
+#include "GLErrors.hh"
+
+struct RenderTarget {
+    // Depth renderbuffer format for a requested number of depth bits.
+    static GLenum depthFormat(GLint depthBits) {
+        if (depthBits <= 0)  return GL_NONE;
+        if (depthBits <= 16) return GL_DEPTH_COMPONENT16;
+        if (depthBits <= 24) return GL_DEPTH_COMPONENT24;
+        return GL_DEPTH_COMPONENT32F;
+    }
+
+    void create(GLenum depthFormat = GL_DEPTH_COMPONENT24) {
+        if (m_fbo) throw std::logic_error("RenderTarget already created");
+        m_depthFormat = depthFormat;
+        glGenFramebuffers(1, &m_fbo);
+        glGenRenderbuffers(1, &m_color);
+        if (m_depthFormat != GL_NONE) glGenRenderbuffers(1, &m_depth);
+        glCheckError("create render target");
+    }
+
+    // (Re)allocate the attachments and leave the framebuffer bound.
+    void resize(int width, int height) {
+        if (!m_fbo) throw std::logic_error("RenderTarget not created");
+        glBindRenderbuffer(GL_RENDERBUFFER, m_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        if (m_depth) {
+            glBindRenderbuffer(GL_RENDERBUFFER, m_depth);
+            glRenderbufferStorage(GL_RENDERBUFFER, m_depthFormat, width, height);
+        }
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_color);
+        if (m_depth) glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+        glCheckError("allocate framebuffers");
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            throw std::runtime_error("framebuffer is not complete!");
+    }
+
+    void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, m_fbo); }
+
+    void release() {
+        if (m_depth) glDeleteRenderbuffers(1, &m_depth);
+        if (m_color) glDeleteRenderbuffers(1, &m_color);
+        if (m_fbo)   glDeleteFramebuffers (1, &m_fbo);
+        m_fbo = m_color = m_depth = 0;
+    }
+
+    GLuint framebuffer() const { return m_fbo;   }
+    GLuint colorBuffer() const { return m_color; }
+    GLuint depthBuffer() const { return m_depth; }
+
+private:
+    GLuint m_fbo = 0, m_color = 0, m_depth = 0;
+    GLenum m_depthFormat = GL_DEPTH_COMPONENT24;
+};
+
+#endif /* end of include guard: RENDERTARGET_HH */
@@ -20,6 +20,8 @@
 #include "GLErrors.hh"
 #include "RAIIGLResource.hh"
 #include "UASetters.hh"
+#include "UniformBuffer.hh"
+#include "ProgramBinaryCache.hh"
 
 // A vertex/fragment/geometry/etc shader object that can be compiled and linked
 // into a program
@@ -44,7 +46,7 @@ struct ShaderObject : RAIIGLResource<ShaderObject> {
     }
 private:
     friend struct RAIIGLResource<ShaderObject>;
-    void m_delete() { glDeleteShader(id); /* std::cout << "Deleted shader " << id << std::endl; */ }
+    void m_enqueueDeletion(GLDeletionQueue::Batch &b) { b.add(GLDeletionQueue::SHADER, id); }
 };
 
 struct Uniform {
@@ -98,7 +100,7 @@ struct Shader {
 
     private:
         friend struct RAIIGLResource<Program>;
-        void m_delete() { glDeleteProgram(id); /* std::cout << "Deleted program " << id << std::endl; */ }
+        void m_enqueueDeletion(GLDeletionQueue::Batch &b) { b.add(GLDeletionQueue::PROGRAM, id); }
     };
 
     using Sources = std::vector<std::string>;
@@ -108,25 +110,47 @@ struct Shader {
            const Sources &geoSources = Sources())
         : m_prog(ctx)
     {
-        for (const auto &s :  vtxSources) m_objects.emplace_back(ctx, s, GL_VERTEX_SHADER);
-        for (const auto &s : fragSources) m_objects.emplace_back(ctx, s, GL_FRAGMENT_SHADER);
-        for (const auto &s :  geoSources) m_objects.emplace_back(ctx, s, GL_GEOMETRY_SHADER);
-
-        // Compile and attach all shader objects
-        for (auto &obj : m_objects) {
-            obj.compile();
-            glAttachShader(m_prog.id, obj.id);
-            glCheckError("attach shader");
-        }
+        std::vector<std::pair<GLenum, std::string>> stageSources;
+        for (const auto &s :  vtxSources) stageSources.emplace_back(GL_VERTEX_SHADER,   s);
+        for (const auto &s : fragSources) stageSources.emplace_back(GL_FRAGMENT_SHADER, s);
+        for (const auto &s :  geoSources) stageSources.emplace_back(GL_GEOMETRY_SHADER, s);
+
+        // Try the on-disk program binary cache before compiling from scratch.
+        const bool useCache = ProgramBinaryCache::available();
+        std::string cacheKey;
+        if (useCache) cacheKey = ProgramBinaryCache::key(stageSources);
+        m_loadedFromCache = useCache && ProgramBinaryCache::load(m_prog.id, cacheKey);
+
+        if (!m_loadedFromCache) {
+            for (const auto &s : stageSources) m_objects.emplace_back(ctx, s.second, s.first);
+
+            // Compile and attach all shader objects
+            for (auto &obj : m_objects) {
+                obj.compile();
+                glAttachShader(m_prog.id, obj.id);
+                glCheckError("attach shader");
+            }
 
-        glLinkProgram(m_prog.id);
-        glCheckStatus(m_prog.id, GL_LINK_STATUS);
+            if (useCache) ProgramBinaryCache::prepare(m_prog.id);
+            glLinkProgram(m_prog.id);
+            glCheckStatus(m_prog.id, GL_LINK_STATUS);
+            if (useCache) ProgramBinaryCache::store(m_prog.id, cacheKey);
+        }
 
-        // Get uniform information
+        // Get uniform information; members of uniform blocks have no location
+        // and are set through a `UniformBuffer` instead.
         GLint numUniforms;
         glGetProgramiv(m_prog.id, GL_ACTIVE_UNIFORMS, &numUniforms);
-        for (GLuint i = 0; i < GLuint(numUniforms); ++i)
-            m_uniforms.emplace_back(m_prog.id, i);
+        for (GLuint i = 0; i < GLuint(numUniforms); ++i) {
+            GLint blockIndex;
+            glGetActiveUniformsiv(m_prog.id, 1, &i, GL_UNIFORM_BLOCK_INDEX, &blockIndex);
+            if (blockIndex < 0) m_uniforms.emplace_back(m_prog.id, i);
+        }
+
+        GLint numBlocks;
+        glGetProgramiv(m_prog.id, GL_ACTIVE_UNIFORM_BLOCKS, &numBlocks);
+        for (GLuint i = 0; i < GLuint(numBlocks); ++i)
+            m_uniformBlocks.emplace_back(m_prog.id, i);
 
         GLint numAttributes;
         glGetProgramiv(m_prog.id, GL_ACTIVE_ATTRIBUTES, &numAttributes);
@@ -146,7 +170,9 @@ struct Shader {
         m_prog(std::move(b.m_prog)),
         m_objects(std::move(b.m_objects)),
         m_uniforms(std::move(b.m_uniforms)),
-        m_attributes(std::move(b.m_attributes))
+        m_uniformBlocks(std::move(b.m_uniformBlocks)),
+        m_attributes(std::move(b.m_attributes)),
+        m_loadedFromCache(b.m_loadedFromCache)
     { }
 
     static std::string readFile(const std::string &path) {
@@ -164,7 +190,10 @@ struct Shader {
         return std::make_unique<Shader>(ctx, readFile(vtxFile), readFile(fragFile));
     }
 
-    void use() const { glUseProgram(m_prog.id); }
+    void use() const {
+        if (auto *cache = OpenGLContext::currentStateCache()) cache->useProgram(m_prog.id);
+        else glUseProgram(m_prog.id);
+    }
 
     template<typename T>
     void setUniform(const std::string &name, const T &val, bool optional = false) {
@@ -180,19 +209,124 @@ struct Shader {
         if (!optional) throw std::runtime_error("Uniform not present: " + name);
     }
 
+    // Index of uniform `name` for use with `setUniform(handle, val)`, or -1 if
+    // there is no such active uniform (and `optional` is true).
+    int uniformHandle(const std::string &name, bool optional = false) const {
+        for (size_t i = 0; i < m_uniforms.size(); ++i)
+            if (m_uniforms[i].name == name) return int(i);
+        if (!optional) throw std::runtime_error("Uniform not present: " + name);
+        return -1;
+    }
+
+    // Set a uniform by handle without any name lookup (handle -1 is ignored).
+    // Unlike the by-name version, this does not call `use()`: the program
+    // must already be in use.
+    template<typename T>
+    void setUniform(int handle, const T &val) {
+        if (handle < 0) return;
+        m_uniforms.at(handle).set(val);
+    }
+
+    // Make sampler uniform `name` read from texture unit `unit`.
+    void setSampler(const std::string &name, GLint unit, bool optional = false) {
+        for (Uniform &u : m_uniforms) {
+            if (u.name == name) {
+                use();
+                glUniform1i(u.loc, unit);
+                glCheckError("setSampler");
+                u.isSet = true;
+                return;
+            }
+        }
+        if (!optional) throw std::runtime_error("Uniform not present: " + name);
+    }
+
+    // Attach uniform block `name` to uniform buffer binding point `binding`
+    // (see `UniformBuffer`).
+    void bindUniformBlock(const std::string &name, GLuint binding, bool optional = false) {
+        const UniformBlockLayout *block = uniformBlock(name, optional);
+        if (block == nullptr) return;
+        glUniformBlockBinding(m_prog.id, block->index, binding);
+        glCheckError("bindUniformBlock");
+    }
+
+    const UniformBlockLayout *uniformBlock(const std::string &name, bool optional = false) const {
+        for (const auto &b : m_uniformBlocks)
+            if (b.name == name) return &b;
+        if (!optional) throw std::runtime_error("Uniform block not present: " + name);
+        return nullptr;
+    }
+
+    // Values of the uniforms (e.g., those set up for one of several meshes
+    // drawn with this program), saved by `saveUniforms` and reinstated by
+    // `restoreUniforms` so that the meshes' draws can be interleaved.
+    struct UniformValues {
+        GLuint program = 0;
+        std::vector<GLfloat> f;
+        std::vector<GLint>   i;
+        std::vector<GLuint>  u;
+    };
+
+    UniformValues saveUniforms() const {
+        UniformValues v;
+        v.program = m_prog.id;
+        for (const Uniform &u : m_uniforms) {
+            if (u.size != 1) throw std::runtime_error("Saving array uniform " + u.name + " is not supported");
+            const GLTypeComponents c = getGLTypeComponents(u.type);
+            std::array<GLfloat, 16> f;
+            std::array<GLint,    4> i;
+            std::array<GLuint,   4> ui;
+            if      (c.kind == 'f') { glGetUniformfv (m_prog.id, u.loc, f.data());  v.f.insert(v.f.end(), f.begin(),  f.begin()  + c.count); }
+            else if (c.kind == 'i') { glGetUniformiv (m_prog.id, u.loc, i.data());  v.i.insert(v.i.end(), i.begin(),  i.begin()  + c.count); }
+            else                    { glGetUniformuiv(m_prog.id, u.loc, ui.data()); v.u.insert(v.u.end(), ui.begin(), ui.begin() + c.count); }
+        }
+        glCheckError("saveUniforms");
+        return v;
+    }
+
+    // Also makes the program current.
+    void restoreUniforms(const UniformValues &v) {
+        if (v.program != m_prog.id) throw std::runtime_error("Uniform values were saved from a different program");
+        use();
+        const GLfloat *f = v.f.data();
+        const GLint   *i = v.i.data();
+        const GLuint  *u = v.u.data();
+        for (Uniform &uni : m_uniforms) {
+            const GLTypeComponents c = getGLTypeComponents(uni.type);
+            if      (uni.type == GL_FLOAT_MAT2) glUniformMatrix2fv(uni.loc, 1, false, f);
+            else if (uni.type == GL_FLOAT_MAT3) glUniformMatrix3fv(uni.loc, 1, false, f);
+            else if (uni.type == GL_FLOAT_MAT4) glUniformMatrix4fv(uni.loc, 1, false, f);
+            else if (c.kind == 'f') detail::setUniformComponents(uni.loc, c.count, f);
+            else if (c.kind == 'i') detail::setUniformComponents(uni.loc, c.count, i);
+            else                    detail::setUniformComponents(uni.loc, c.count, u);
+            if      (c.kind == 'f') f += c.count;
+            else if (c.kind == 'i') i += c.count;
+            else                    u += c.count;
+            uni.isSet = true;
+        }
+        glCheckError("restoreUniforms");
+    }
+
     bool allUniformsSet() const {
         for (const Uniform &u : m_uniforms)
             if (!u.isSet) return false;
         return true;
     }
 
+    // Whether the program was loaded from the program binary cache (rather
+    // than compiled).
+    bool loadedFromCache() const { return m_loadedFromCache; }
+
     const std::vector<Uniform>   &getUniforms  () const { return m_uniforms; }
+    const std::vector<UniformBlockLayout> &getUniformBlocks() const { return m_uniformBlocks; }
     const std::vector<Attribute> &getAttributes() const { return m_attributes; }
 private:
     Program m_prog;
     std::vector<ShaderObject> m_objects;
     std::vector<Uniform>      m_uniforms;
+    std::vector<UniformBlockLayout> m_uniformBlocks;
     std::vector<Attribute>    m_attributes;
+    bool m_loadedFromCache = false;
 };
 
 #endif /* end of include guard: SHADER_HH */
@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////////////////////////
+// ThreadPool.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Minimal fixed-size worker pool with a bounded task queue.
+//  Submitting a task to a full queue blocks the caller until a worker frees
+//  up a slot, which applies back-pressure to producers (e.g., a render loop)
+//  that would otherwise outpace the workers and accumulate unbounded memory.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef THREADPOOL_HH
+#define THREADPOOL_HH
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct ThreadPool {
+    // numThreads = 0: use one worker per hardware thread.
+    // maxQueued:      number of tasks that may wait for a worker before
+    //                 `submit` starts blocking.
+    // onWorkerStart/onWorkerExit (optional): called on each worker thread with
+    //                 its index before it runs any task/after it runs its last;
+    //                 used to set up and tear down per-thread state (e.g., a GL
+    //                 context). Exceptions must not escape these callbacks.
+    using WorkerHook = std::function<void(size_t)>;
+    ThreadPool(size_t numThreads = 0, size_t maxQueued = 0,
+               WorkerHook onWorkerStart = WorkerHook(), WorkerHook onWorkerExit = WorkerHook())
+        : m_onWorkerStart(std::move(onWorkerStart)), m_onWorkerExit(std::move(onWorkerExit))
+    {
+        if (numThreads == 0) numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        if (maxQueued  == 0) maxQueued  = 2 * numThreads;
+        m_maxQueued = maxQueued;
+        m_workers.reserve(numThreads);
+        for (size_t i = 0; i < numThreads; ++i)
+            m_workers.emplace_back([this, i]() { m_workerMain(i); });
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Finish all queued tasks before shutting down.
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_shutdown = true;
+        }
+        m_taskAvailable.notify_all();
+        for (auto &w : m_workers) w.join();
+    }
+
+    // Run `f()` on a worker thread, returning a future for its result
+    // (exceptions thrown by `f` are rethrown by `future::get`).
+    // Blocks while the queue is full.
+    template<class F>
+    auto submit(F &&f) -> std::future<decltype(f())> {
+        using R = decltype(f());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        std::future<R> result = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_slotAvailable.wait(lock, [this]() { return m_tasks.size() < m_maxQueued; });
+            if (m_shutdown) throw std::runtime_error("submit called on a stopped ThreadPool");
+            m_tasks.emplace_back([task]() { (*task)(); });
+        }
+        m_taskAvailable.notify_one();
+        return result;
+    }
+
+    // Call `f(chunkBegin, chunkEnd)` on contiguous chunks (of at least
+    // `minChunkSize` indices) covering [begin, end), spread across the workers
+    // and the calling thread; returns once all chunks are processed.
+    // If any chunk throws, the first exception is rethrown after all
+    // chunks have finished (they reference `f` and its captures).
+    // Must not be called from one of this pool's own workers.
+    template<class F>
+    void parallelFor(size_t begin, size_t end, F &&f, size_t minChunkSize = 1) {
+        if (end <= begin) return;
+        const size_t size = end - begin;
+        const size_t numChunks = std::min(numThreads() + 1, std::max<size_t>(size / std::max<size_t>(minChunkSize, 1), 1));
+        auto chunkStart = [&](size_t c) { return begin + (size * c) / numChunks; };
+        std::vector<std::future<void>> pending;
+        pending.reserve(numChunks - 1);
+        std::exception_ptr error;
+        try {
+            for (size_t c = 1; c < numChunks; ++c) {
+                const size_t cb = chunkStart(c), ce = chunkStart(c + 1);
+                pending.push_back(submit([&f, cb, ce]() { f(cb, ce); }));
+            }
+            f(begin, chunkStart(1));
+        }
+        catch (...) { error = std::current_exception(); }
+        for (auto &p : pending) {
+            try { p.get(); }
+            catch (...) { if (!error) error = std::current_exception(); }
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Block until every submitted task has completed.
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this]() { return m_tasks.empty() && (m_numBusy == 0); });
+    }
+
+    size_t numThreads() const { return m_workers.size(); }
+    size_t maxQueued()  const { return m_maxQueued; }
+    size_t numQueued()  const { std::lock_guard<std::mutex> lock(m_mutex); return m_tasks.size(); }
+
+    // Index of the calling worker thread within its pool, or NOT_A_WORKER when
+    // called from a thread not owned by any ThreadPool.
+    enum : size_t { NOT_A_WORKER = size_t(-1) };
+    static size_t currentWorkerIndex() { return m_workerIndex(); }
+
+private:
+    static size_t &m_workerIndex() {
+        static thread_local size_t index = NOT_A_WORKER;
+        return index;
+    }
+
+    void m_workerMain(size_t i) {
+        m_workerIndex() = i;
+        if (m_onWorkerStart) m_onWorkerStart(i);
+        m_workerLoop();
+        if (m_onWorkerExit) m_onWorkerExit(i);
+    }
+
+    void m_workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_taskAvailable.wait(lock, [this]() { return m_shutdown || !m_tasks.empty(); });
+                if (m_tasks.empty()) return; // shutdown requested and nothing left to do
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+                ++m_numBusy;
+            }
+            m_slotAvailable.notify_one();
+            task();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_numBusy;
+            }
+            m_idle.notify_all();
+        }
+    }
+
+    WorkerHook m_onWorkerStart, m_onWorkerExit;
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    size_t m_maxQueued;
+    size_t m_numBusy = 0;
+    bool m_shutdown = false;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_taskAvailable, m_slotAvailable, m_idle;
+};
+
+#endif /* end of include guard: THREADPOOL_HH */
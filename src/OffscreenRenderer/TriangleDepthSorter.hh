@@ -0,0 +1,281 @@
+////////////////////////////////////////////////////////////////////////////////
+// TriangleDepthSorter.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Back-to-front ordering of the triangles of one or more translucent meshes
+//  for correct alpha blending. All meshes' triangles are sorted together by
+//  the eye-space depth of their barycenters (quantized to `KEY_BITS` bits)
+//  with a parallel LSD radix sort. The result is, for each mesh, its
+//  triangles in back-to-front order (for its index buffer), along with the
+//  sequence of per-mesh runs in which the triangles must be drawn.
+//
+//  In incremental mode (the default), each sort starts from the previous
+//  frame's order; when the view changes only slightly that order is nearly
+//  sorted and an insertion sort finishes it in close to linear time. If the
+//  insertion sort exceeds its work budget, we fall back to the radix sort
+//  (and attempt fewer incremental sorts until one succeeds again). Sorting
+//  again with unchanged geometry and matrices is free.
+//
+//  Triangle barycenters are precomputed by `setMesh`, which must be called
+//  again when a mesh's geometry changes.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef TRIANGLEDEPTHSORTER_HH
+#define TRIANGLEDEPTHSORTER_HH
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "Shader.hh" // (needed by Buffers.hh)
+#include "Buffers.hh"
+#include "ThreadPool.hh"
+
+namespace detail {
+
+// Helper threads for depth sorting (the calling thread also participates).
+inline ThreadPool &depthSortPool() {
+    static ThreadPool pool(std::max<int>(int(std::thread::hardware_concurrency()) - 1, 1));
+    return pool;
+}
+
+}
+
+struct TriangleDepthSorter {
+    // Triangles [begin, begin + count) of mesh `mesh`'s sorted triangles.
+    struct Run { size_t mesh, begin, count; };
+
+    using MatrixList = std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>;
+
+    static constexpr int KEY_BITS = 22, RADIX_BITS = 11;
+
+    size_t numMeshes() const { return m_meshes.size(); }
+    void setNumMeshes(size_t n) {
+        if (n == m_meshes.size()) return;
+        m_meshes.resize(n);
+        m_order.clear();
+        m_modelViews.clear();
+    }
+
+    // Set the vertex positions and triangles of mesh `i`, adding meshes as needed.
+    void setMesh(size_t i, const Eigen::Ref<const MXfR> &V, const Eigen::Ref<const MXuiR> &F) {
+        if ((V.cols() != 3) || (F.cols() != 3)) throw std::runtime_error("Expected 3D vertices and triangles");
+        if ((F.size() > 0) && (F.maxCoeff() >= V.rows())) throw std::runtime_error("Corner index out of bounds");
+        if (i >= m_meshes.size()) setNumMeshes(i + 1);
+        Mesh &m = m_meshes[i];
+        if (m.F.rows() != F.rows()) m_order.clear(); // triangle numbering changed
+        m_modelViews.clear(); // force the next sort
+        m.F = F;
+        m.barycenters.resize(F.rows(), 3);
+        for (int t = 0; t < F.rows(); ++t)
+            m.barycenters.row(t) = (V.row(F(t, 0)) + V.row(F(t, 1)) + V.row(F(t, 2))) / 3.0f;
+    }
+
+    // Sort the triangles of all meshes back to front, with mesh `i` placed by
+    // model-view matrix `modelViews[i]`. Returns false if the sort was skipped
+    // (since neither the meshes nor the matrices changed).
+    bool sort(const MatrixList &modelViews) {
+        if (modelViews.size() != m_meshes.size()) throw std::runtime_error("Expected one model-view matrix per mesh");
+        if (modelViews == m_modelViews) { m_lastSortIncremental = true; return false; }
+        m_modelViews = modelViews;
+        m_offsets.assign(1, 0);
+        for (const Mesh &m : m_meshes) m_offsets.push_back(m_offsets.back() + m.F.rows());
+        const size_t n = m_offsets.back();
+        if (n > std::numeric_limits<uint32_t>::max()) throw std::runtime_error("Too many triangles to sort");
+
+        m_computeDepths(modelViews);
+
+        // Quantize the depths relative to the current range.
+        float zmin = std::numeric_limits<float>::max(), zmax = std::numeric_limits<float>::lowest();
+        for (float z : m_depth) { zmin = std::min(zmin, z); zmax = std::max(zmax, z); }
+        const uint32_t maxKey = (uint32_t(1) << KEY_BITS) - 1;
+        const float scale = (zmax > zmin) ? maxKey / (zmax - zmin) : 0.0f;
+        auto key = [&](uint32_t g) { return uint64_t(std::min(uint32_t((m_depth[g] - zmin) * scale), maxKey)) << 32 | g; };
+
+        // Start from the previous order if it is still valid. After `k`
+        // consecutive failed attempts, the next 2^k - 1 (at most 31) sorts
+        // skip the attempt.
+        m_lastSortIncremental = m_incremental && (m_order.size() == n) && (m_skipIncremental == 0);
+        if (m_skipIncremental > 0) --m_skipIncremental;
+        m_items.resize(n);
+        if (m_lastSortIncremental) {
+            m_parallelChunks(n, [&](size_t, size_t b, size_t e) { for (size_t i = b; i < e; ++i) m_items[i] = key(m_order[i]); });
+            if (m_insertionSort(2 * n + 1024)) m_incrementalFailures = 0;
+            else {
+                m_lastSortIncremental = false;
+                m_incrementalFailures = std::min(m_incrementalFailures + 1, 5);
+                m_skipIncremental = (1 << m_incrementalFailures) - 1;
+                m_radixSort();
+            }
+        }
+        else {
+            m_parallelChunks(n, [&](size_t, size_t b, size_t e) { for (size_t i = b; i < e; ++i) m_items[i] = key(uint32_t(i)); });
+            m_radixSort();
+        }
+
+        // Gather each mesh's triangles and the runs in which to draw them.
+        m_order.resize(n);
+        m_sorted.resize(m_meshes.size());
+        std::vector<size_t> filled(m_meshes.size(), 0);
+        for (size_t i = 0; i < m_meshes.size(); ++i) m_sorted[i].resize(m_meshes[i].F.rows(), 3);
+        m_runs.clear();
+        size_t mi = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const uint32_t g = uint32_t(m_items[i]);
+            m_order[i] = g;
+            if ((g < m_offsets[mi]) || (g >= m_offsets[mi + 1]))
+                mi = std::upper_bound(m_offsets.begin(), m_offsets.end(), size_t(g)) - m_offsets.begin() - 1;
+            if (m_runs.empty() || (m_runs.back().mesh != mi)) m_runs.push_back(Run{mi, filled[mi], 0});
+            ++m_runs.back().count;
+            m_sorted[mi].row(filled[mi]++) = m_meshes[mi].F.row(g - m_offsets[mi]);
+        }
+        return true;
+    }
+
+    // Triangles of mesh `i` in back-to-front order (as of the last `sort`).
+    const MXuiR &sortedTriangles(size_t i) const { return m_sorted.at(i); }
+
+    // Upload mesh `i`'s sorted triangles into the index buffer of `vao`.
+    void writeIndexBuffer(size_t i, VertexArrayObject &vao) const { vao.setIndexBuffer(sortedTriangles(i)); }
+
+    // Per-mesh runs of triangles in back-to-front order; drawing each run's
+    // triangles (3 * begin, 3 * count indices) in sequence draws all
+    // triangles back to front.
+    const std::vector<Run> &runs() const { return m_runs; }
+
+    // How to draw mesh `i`'s runs: its VAO (holding the sorted triangles
+    // written by `writeIndexBuffer`), its shader with the uniform values set
+    // up for the mesh, and the values of its constant vertex attributes
+    // (which are context state, not VAO state).
+    struct MeshDraw {
+        const VertexArrayObject *vao = nullptr;
+        Shader *shader = nullptr;
+        Shader::UniformValues uniforms;
+        std::vector<std::pair<GLuint, std::array<GLfloat, 4>>> constantAttributes;
+    };
+
+    // Draw `runs()` in order, switching the VAO and constant attributes
+    // whenever the mesh changes; a shader's uniforms are restored only if
+    // another mesh used the shader since.
+    void drawRuns(const std::vector<MeshDraw> &draws) const {
+        if (draws.size() != m_meshes.size()) throw std::runtime_error("Expected one draw per mesh");
+        for (const MeshDraw &d : draws)
+            if (!d.vao || !d.shader) throw std::runtime_error("Missing VAO or shader");
+        std::vector<std::pair<const Shader *, size_t>> shaderUser; // mesh whose uniforms each shader holds
+        size_t current = m_meshes.size();
+        for (const Run &r : m_runs) {
+            const MeshDraw &d = draws[r.mesh];
+            if (r.mesh != current) {
+                current = r.mesh;
+                auto it = std::find_if(shaderUser.begin(), shaderUser.end(), [&](const std::pair<const Shader *, size_t> &s) { return s.first == d.shader; });
+                if (it == shaderUser.end()) it = shaderUser.emplace(shaderUser.end(), d.shader, m_meshes.size());
+                if (it->second != current) { d.shader->restoreUniforms(d.uniforms); it->second = current; }
+                for (const auto &a : d.constantAttributes) glVertexAttrib4fv(a.first, a.second.data());
+            }
+            d.vao->drawRange(*d.shader, 3 * r.begin, 3 * r.count);
+        }
+    }
+
+    bool incremental() const { return m_incremental; }
+    void setIncremental(bool incremental) { m_incremental = incremental; }
+
+    // Whether the last sort was finished by the incremental insertion sort.
+    bool lastSortIncremental() const { return m_lastSortIncremental; }
+
+private:
+    struct Mesh {
+        MXuiR F;
+        Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> barycenters;
+    };
+
+    // Call `f(chunk, begin, end)` on chunks of [0, n), in parallel for large `n`.
+    // The chunking depends only on `n`.
+    template<class F>
+    void m_parallelChunks(size_t n, F &&f) const {
+        const size_t numChunks = m_numChunks(n);
+        detail::depthSortPool().parallelFor(0, numChunks, [&](size_t cb, size_t ce) {
+            for (size_t c = cb; c < ce; ++c) f(c, (n * c) / numChunks, (n * (c + 1)) / numChunks);
+        });
+    }
+
+    static size_t m_numChunks(size_t n) {
+        return std::max<size_t>(std::min(detail::depthSortPool().numThreads() + 1, n / 16384), 1);
+    }
+
+    // Eye-space z coordinate of every triangle's barycenter (increasing from
+    // back to front).
+    void m_computeDepths(const MatrixList &modelViews) {
+        const size_t n = m_offsets.back();
+        m_depth.resize(n);
+        m_parallelChunks(n, [&](size_t, size_t b, size_t e) {
+            size_t mi = std::upper_bound(m_offsets.begin(), m_offsets.end(), b) - m_offsets.begin() - 1;
+            for (size_t g = b; g < e; ++g) {
+                while (g >= m_offsets[mi + 1]) ++mi;
+                const Eigen::Matrix4f &mv = modelViews[mi];
+                m_depth[g] = mv.block<1, 3>(2, 0).dot(m_meshes[mi].barycenters.row(g - m_offsets[mi])) + mv(2, 3);
+            }
+        });
+    }
+
+    // Stable insertion sort of `m_items` by key, giving up (and returning
+    // false) after `budget` element moves.
+    bool m_insertionSort(size_t budget) {
+        size_t moves = 0;
+        for (size_t i = 1; i < m_items.size(); ++i) {
+            const uint64_t item = m_items[i];
+            const uint32_t k = item >> 32;
+            size_t j = i;
+            while ((j > 0) && (uint32_t(m_items[j - 1] >> 32) > k)) { m_items[j] = m_items[j - 1]; --j; }
+            m_items[j] = item;
+            moves += i - j;
+            if (moves > budget) return false;
+        }
+        return true;
+    }
+
+    // Stable LSD radix sort of `m_items` by key; each pass histograms the
+    // chunks' digits in parallel, then scatters each chunk into its slots.
+    void m_radixSort() {
+        constexpr size_t RADIX = size_t(1) << RADIX_BITS;
+        const size_t n = m_items.size(), numChunks = m_numChunks(n);
+        m_scratch.resize(n);
+        m_histograms.resize(numChunks);
+        for (int shift = 32; shift < 32 + KEY_BITS; shift += RADIX_BITS) {
+            m_parallelChunks(n, [&](size_t c, size_t b, size_t e) {
+                auto &h = m_histograms[c];
+                h.fill(0);
+                for (size_t i = b; i < e; ++i) ++h[(m_items[i] >> shift) & (RADIX - 1)];
+            });
+            size_t sum = 0;
+            for (size_t d = 0; d < RADIX; ++d) {
+                for (size_t c = 0; c < numChunks; ++c) {
+                    const size_t count = m_histograms[c][d];
+                    m_histograms[c][d] = sum;
+                    sum += count;
+                }
+            }
+            m_parallelChunks(n, [&](size_t c, size_t b, size_t e) {
+                auto &h = m_histograms[c];
+                for (size_t i = b; i < e; ++i) m_scratch[h[(m_items[i] >> shift) & (RADIX - 1)]++] = m_items[i];
+            });
+            std::swap(m_items, m_scratch);
+        }
+    }
+
+    std::vector<Mesh> m_meshes;
+    std::vector<size_t> m_offsets;  // index of each mesh's first triangle in the global numbering
+    std::vector<float> m_depth;
+    std::vector<uint64_t> m_items, m_scratch; // (quantized depth << 32) | global triangle index
+    std::vector<std::array<size_t, size_t(1) << RADIX_BITS>> m_histograms;
+    std::vector<uint32_t> m_order;  // global triangle indices in the last sort's order
+    std::vector<MXuiR> m_sorted;
+    std::vector<Run> m_runs;
+    MatrixList m_modelViews; // matrices of the last sort (empty if the next sort must not be skipped)
+    bool m_incremental = true, m_lastSortIncremental = false;
+    int m_incrementalFailures = 0, m_skipIncremental = 0;
+};
+
+#endif /* end of include guard: TRIANGLEDEPTHSORTER_HH */
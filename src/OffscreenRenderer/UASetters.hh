@@ -27,6 +27,26 @@ inline void setUniform(GLint loc, const Eigen::Matrix2f &mat) { glUniformMatrix2
 inline void setUniform(GLint loc, const Eigen::Matrix3f &mat) { glUniformMatrix3fv(loc, 1, false, mat.data());          }
 inline void setUniform(GLint loc, const Eigen::Matrix4f &mat) { glUniformMatrix4fv(loc, 1, false, mat.data());          }
 
+// Set a (non-matrix) uniform from its `count` components.
+inline void setUniformComponents(GLint loc, int count, const GLfloat *v) {
+    if      (count == 1) glUniform1fv(loc, 1, v);
+    else if (count == 2) glUniform2fv(loc, 1, v);
+    else if (count == 3) glUniform3fv(loc, 1, v);
+    else                 glUniform4fv(loc, 1, v);
+}
+inline void setUniformComponents(GLint loc, int count, const GLint *v) {
+    if      (count == 1) glUniform1iv(loc, 1, v);
+    else if (count == 2) glUniform2iv(loc, 1, v);
+    else if (count == 3) glUniform3iv(loc, 1, v);
+    else                 glUniform4iv(loc, 1, v);
+}
+inline void setUniformComponents(GLint loc, int count, const GLuint *v) {
+    if      (count == 1) glUniform1uiv(loc, 1, v);
+    else if (count == 2) glUniform2uiv(loc, 1, v);
+    else if (count == 3) glUniform3uiv(loc, 1, v);
+    else                 glUniform4uiv(loc, 1, v);
+}
+
 // Constant vertex attribute setters (to be used when glDisableVertexAttribArray is called)
 // Note: matrix-valued attributes are accessed as sequential column vector attributes.
 inline void setAttribute(GLuint index,                  GLfloat f) { glVertexAttrib1f  (index, f);                   }
@@ -0,0 +1,166 @@
+////////////////////////////////////////////////////////////////////////////////
+// UniformBuffer.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Uniform buffer objects holding the data of `layout(std140)` uniform blocks.
+//  State shared by many programs (e.g., the camera and lights) is written
+//  into the buffer's CPU-side copy, uploaded once per frame with `upload()`,
+//  and read by every program whose block is bound to the same binding point
+//  (see `Shader::bindUniformBlock`).
+//  Since the std140 layout of a block depends only on its declaration, the
+//  layout queried from any program declaring the block applies to all of them.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef UNIFORMBUFFER_HH
+#define UNIFORMBUFFER_HH
+
+#include <array>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "GLTypeTraits.hh"
+#include "GLErrors.hh"
+#include "RAIIGLResource.hh"
+
+// Layout of an active uniform block of a linked program.
+struct UniformBlockLayout {
+    struct Member {
+        std::string name;
+        GLenum type;
+        GLint size;         // array size (1 for non-arrays)
+        GLint offset;       // byte offset from the start of the block
+        GLint arrayStride;
+        GLint matrixStride; // byte offset between a matrix's columns
+    };
+
+    UniformBlockLayout(GLuint prog, GLuint blockIndex) : index(blockIndex) {
+        std::array<char, 512> buf;
+        glGetActiveUniformBlockName(prog, blockIndex, buf.size(), NULL, buf.data());
+        name = std::string(buf.data());
+        glGetActiveUniformBlockiv(prog, blockIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &dataSize);
+
+        GLint numMembers;
+        glGetActiveUniformBlockiv(prog, blockIndex, GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &numMembers);
+        std::vector<GLint> indices(numMembers);
+        glGetActiveUniformBlockiv(prog, blockIndex, GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES, indices.data());
+
+        auto query = [&](const GLuint *u, GLenum pname) { GLint result; glGetActiveUniformsiv(prog, 1, u, pname, &result); return result; };
+        for (GLint i : indices) {
+            const GLuint u = i;
+            Member m;
+            glGetActiveUniformName(prog, u, buf.size(), NULL, buf.data());
+            m.name         = std::string(buf.data());
+            m.type         = query(&u, GL_UNIFORM_TYPE);
+            m.size         = query(&u, GL_UNIFORM_SIZE);
+            m.offset       = query(&u, GL_UNIFORM_OFFSET);
+            m.arrayStride  = query(&u, GL_UNIFORM_ARRAY_STRIDE);
+            m.matrixStride = query(&u, GL_UNIFORM_MATRIX_STRIDE);
+            members.push_back(m);
+        }
+        glCheckError("uniform block introspection");
+    }
+
+    // Index of member `name`, or -1 if there is no such member.
+    int memberIndex(const std::string &memberName) const {
+        for (size_t i = 0; i < members.size(); ++i)
+            if (members[i].name == memberName) return int(i);
+        return -1;
+    }
+
+    std::string name;
+    GLuint index;   // block index within the program this layout was queried from
+    GLint dataSize; // minimum buffer size in bytes
+    std::vector<Member> members;
+};
+
+namespace detail {
+
+// Write a value into a std140 block member at `dst`.
+template<typename T>
+std::enable_if_t<std::is_arithmetic<T>::value> writeStd140(unsigned char *dst, const UniformBlockLayout::Member &/* m */, T val) {
+    std::memcpy(dst, &val, sizeof(T));
+}
+
+inline void writeStd140(unsigned char *dst, const UniformBlockLayout::Member &/* m */, bool val) {
+    const GLint ival = val; // booleans occupy a full 32-bit word
+    std::memcpy(dst, &ival, sizeof(ival));
+}
+
+// Vectors and (column-major) matrices: each column starts on a new
+// `matrixStride`-aligned slot.
+template<int Rows, int Cols>
+void writeStd140(unsigned char *dst, const UniformBlockLayout::Member &m, const Eigen::Matrix<float, Rows, Cols> &val) {
+    for (int c = 0; c < Cols; ++c)
+        std::memcpy(dst + c * m.matrixStride, val.col(c).data(), Rows * sizeof(float));
+}
+
+}
+
+struct UniformBuffer : RAIIGLResource<UniformBuffer> {
+    using Base = RAIIGLResource<UniformBuffer>;
+    using Base::id;
+
+    // Create a buffer for blocks with the given layout that will be attached
+    // to uniform buffer binding point `binding`.
+    UniformBuffer(std::weak_ptr<OpenGLContext> ctx, const UniformBlockLayout &layout, GLuint binding)
+        : Base(ctx), m_layout(layout), m_binding(binding), m_data(layout.dataSize, 0)
+    {
+        glGenBuffers(1, &id);
+        this->m_validateConstruction();
+        glBindBuffer(GL_UNIFORM_BUFFER, id);
+        glBufferData(GL_UNIFORM_BUFFER, m_data.size(), m_data.data(), GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glCheckError("uniform buffer allocation");
+    }
+
+    // Index of member `name` for use with `set(handle, val)`, or -1 if the
+    // block has no such member (and `optional` is true).
+    int memberHandle(const std::string &name, bool optional = false) const {
+        int h = m_layout.memberIndex(name);
+        if ((h < 0) && !optional) throw std::runtime_error("Uniform block member not present: " + name);
+        return h;
+    }
+
+    // Update the CPU-side copy of a member (handle -1 is ignored); the change
+    // takes effect at the next `upload()`.
+    template<typename T>
+    void set(int handle, const T &val) {
+        if (handle < 0) return;
+        const auto &m = m_layout.members.at(handle);
+        if (GLTypeTraits<T>::type != m.type) throw std::runtime_error("Uniform type mismatch for " + m.name);
+        detail::writeStd140(m_data.data() + m.offset, m, val);
+        m_dirty = true;
+    }
+
+    template<typename T>
+    void set(const std::string &name, const T &val, bool optional = false) { set(memberHandle(name, optional), val); }
+
+    // Copy any modified data to the GPU and attach the buffer to its binding point.
+    void upload() {
+        if (m_dirty) {
+            glBindBuffer(GL_UNIFORM_BUFFER, id);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, m_data.size(), m_data.data());
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            m_dirty = false;
+        }
+        bind();
+        glCheckError("uniform buffer upload");
+    }
+
+    void bind() const { glBindBufferBase(GL_UNIFORM_BUFFER, m_binding, id); }
+
+    GLuint binding() const { return m_binding; }
+    const UniformBlockLayout &layout() const { return m_layout; }
+
+private:
+    friend struct RAIIGLResource<UniformBuffer>;
+    void m_enqueueDeletion(GLDeletionQueue::Batch &b) { b.add(GLDeletionQueue::BUFFER, id); }
+
+    UniformBlockLayout m_layout;
+    GLuint m_binding;
+    std::vector<unsigned char> m_data;
+    bool m_dirty = true;
+};
+
+#endif /* end of include guard: UNIFORMBUFFER_HH */
@@ -0,0 +1,219 @@
+////////////////////////////////////////////////////////////////////////////////
+// WeightedBlendedOIT.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Order-independent transparency using weighted blended compositing
+//  (McGuire and Bavoil 2013): translucent fragments are accumulated in any
+//  order into off-screen targets, then composited over the opaque scene in a
+//  single full-screen pass. This replaces per-frame CPU depth sorting of
+//  triangles at the cost of an approximate (depth-weighted) ordering.
+//
+//  Usage, with depth testing enabled and the opaque geometry already drawn:
+//      oit.beginTransparentPass();
+//      // draw translucent geometry with shaders writing the OIT outputs
+//      oit.composite();
+//  During the transparent pass, fragment shaders must write
+//      location 0: vec4(color.rgb * color.a * w, color.a)
+//      location 1: vec4(color.a * w)
+//  for a depth-dependent weight `w` (see `phong_with_wireframe.frag`).
+//  Both targets are blended with a single blend function (sums in the color
+//  channels, a product of transparencies in the alpha channel), so no
+//  per-draw-buffer blending support is needed.
+//
+//  The transparent pass tests against the context's depth buffer, shared
+//  directly when the context renders into a framebuffer object and copied
+//  otherwise (OSMesa).
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef WEIGHTEDBLENDEDOIT_HH
+#define WEIGHTEDBLENDEDOIT_HH
+
+#include <array>
+
+#include "RAIIGLResource.hh"
+#include "Shader.hh"
+
+struct WeightedBlendedOIT : RAIIGLResource<WeightedBlendedOIT> {
+    using Base = RAIIGLResource<WeightedBlendedOIT>;
+    using Base::id; // framebuffer holding the accumulation targets
+    static constexpr bool shareable = false; // container objects (framebuffer, VAO)
+
+    // The context must be current.
+    WeightedBlendedOIT(std::weak_ptr<OpenGLContext> ctx)
+        : Base(ctx), m_composite(ctx, m_compositeVertexSource(), m_compositeFragmentSource())
+    {
+        glGenFramebuffers(1, &id);
+        this->m_validateConstruction();
+        glGenTextures(3, m_textures.data());
+        glGenVertexArrays(1, &m_emptyVAO);
+        m_composite.setSampler("accumulation", 0);
+        m_composite.setSampler("weights",      1);
+        glCheckError("OIT construction");
+    }
+
+    WeightedBlendedOIT(WeightedBlendedOIT &&) = default;
+    ~WeightedBlendedOIT() { this->m_release(); } // `m_enqueueDeletion` needs `m_textures`
+
+    // Redirect rendering into the (cleared) accumulation targets, sized to
+    // the current viewport, and set up blending and depth writes for
+    // drawing translucent geometry.
+    void beginTransparentPass() {
+        auto ctx = m_lockContext();
+        ctx->makeCurrent();
+        GLStateCache &cache = ctx->stateCache();
+
+        glGetIntegerv(GL_VIEWPORT, m_viewport.data());
+        const GLint w = m_viewport[2], h = m_viewport[3];
+        const GLuint depth = ctx->renderTargetDepthBuffer();
+        m_allocate(w, h, depth);
+        if (depth == 0) {
+            // Copy the opaque geometry's depth from the context's framebuffer.
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->renderTargetFramebuffer());
+            glBindTexture(GL_TEXTURE_2D, m_textures[DEPTH]);
+            glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_viewport[0], m_viewport[1], w, h);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, id);
+        glViewport(0, 0, w, h);
+        // Any scissor box (e.g., an OSMesa virtual context's sub-rectangle)
+        // refers to the context's framebuffer.
+        m_scissorTest = glIsEnabled(GL_SCISSOR_TEST);
+        cache.disable(GL_SCISSOR_TEST);
+
+        const GLfloat clearAccumulation[4] = {0.0f, 0.0f, 0.0f, 1.0f}, // alpha: revealage (product of transparencies)
+                      clearWeights[4]      = {0.0f, 0.0f, 0.0f, 0.0f};
+        glClearBufferfv(GL_COLOR, 0, clearAccumulation);
+        glClearBufferfv(GL_COLOR, 1, clearWeights);
+
+        glDepthMask(GL_FALSE);
+        cache.enable(GL_BLEND);
+        cache.blendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+        glCheckError("begin transparent pass");
+    }
+
+    // Blend the accumulated translucent geometry over the context's render
+    // target, restoring the viewport, scissor test, depth test and depth
+    // writes. The blend function is left set for premultiplied colors.
+    void composite() {
+        auto ctx = m_lockContext();
+        ctx->makeCurrent();
+        GLStateCache &cache = ctx->stateCache();
+
+        glDepthMask(GL_TRUE);
+        ctx->bindRenderTarget();
+        glViewport(m_viewport[0], m_viewport[1], m_viewport[2], m_viewport[3]);
+        cache.setCapability(GL_SCISSOR_TEST, m_scissorTest);
+
+        const bool depthTest = glIsEnabled(GL_DEPTH_TEST);
+        cache.disable(GL_DEPTH_TEST);
+        cache.enable(GL_BLEND);
+        cache.blendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, m_textures[WEIGHTS]);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_textures[ACCUMULATION]);
+
+        m_composite.use();
+        m_composite.setUniform("viewportOrigin", Eigen::Vector2f(m_viewport[0], m_viewport[1]));
+        cache.bindVertexArray(m_emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+        cache.setCapability(GL_DEPTH_TEST, depthTest);
+        glCheckError("OIT composite");
+    }
+
+    int getWidth()  const { return m_width;  }
+    int getHeight() const { return m_height; }
+
+private:
+    friend struct RAIIGLResource<WeightedBlendedOIT>;
+    void m_enqueueDeletion(GLDeletionQueue::Batch &b) {
+        b.add(GLDeletionQueue::VERTEX_ARRAY, m_emptyVAO);
+        for (GLuint t : m_textures) b.add(GLDeletionQueue::TEXTURE, t);
+        b.add(GLDeletionQueue::FRAMEBUFFER, id);
+    }
+
+    std::shared_ptr<OpenGLContext> m_lockContext() const {
+        auto ctx = m_ctx.lock();
+        if (!ctx) throw std::runtime_error("OIT context was destroyed");
+        return ctx;
+    }
+
+    // (Re)allocate the targets if the size or depth source changed;
+    // `sharedDepth` is the context's depth renderbuffer (or 0 to use our own
+    // depth texture).
+    void m_allocate(GLint width, GLint height, GLuint sharedDepth) {
+        if ((width == m_width) && (height == m_height) && (sharedDepth == m_sharedDepth)) return;
+        auto allocTexture = [&](GLuint tex, GLenum internalFormat, GLenum format, GLenum type) {
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        };
+        allocTexture(m_textures[ACCUMULATION], GL_RGBA16F, GL_RGBA, GL_FLOAT);
+        allocTexture(m_textures[WEIGHTS],      GL_R16F,    GL_RED,  GL_FLOAT);
+        if (sharedDepth == 0) allocTexture(m_textures[DEPTH], GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, id);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_textures[ACCUMULATION], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_textures[WEIGHTS],      0);
+        if (sharedDepth) glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sharedDepth);
+        else             glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_textures[DEPTH], 0);
+        const GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, drawBuffers);
+        glCheckError("allocate OIT targets");
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            throw std::runtime_error("OIT framebuffer is not complete!");
+
+        m_width = width;
+        m_height = height;
+        m_sharedDepth = sharedDepth;
+    }
+
+    // Full-screen triangle generated from gl_VertexID (drawn with an empty VAO).
+    static const char *m_compositeVertexSource() {
+        return R"(#version 140
+void main() {
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(2.0 * p - 1.0, 0.0, 1.0);
+}
+)";
+    }
+
+    static const char *m_compositeFragmentSource() {
+        return R"(#version 140
+uniform sampler2D accumulation; // rgb: sum of weighted premultiplied colors, a: revealage
+uniform sampler2D weights;      // r: sum of weighted alphas
+uniform vec2 viewportOrigin;
+out vec4 result;
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy - viewportOrigin);
+    vec4 accum = texelFetch(accumulation, p, 0);
+    float revealage = accum.a;
+    if (revealage == 1.0) discard; // no translucent fragments
+    vec3 avgColor = accum.rgb / max(texelFetch(weights, p, 0).r, 1e-5);
+    result = vec4(avgColor * (1.0 - revealage), 1.0 - revealage); // premultiplied
+}
+)";
+    }
+
+    enum { ACCUMULATION = 0, WEIGHTS = 1, DEPTH = 2 };
+    std::array<GLuint, 3> m_textures{{0, 0, 0}};
+    GLuint m_emptyVAO = 0;
+    Shader m_composite;
+
+    GLint m_width = 0, m_height = 0;
+    GLuint m_sharedDepth = 0;
+    std::array<GLint, 4> m_viewport{{0, 0, 0, 0}};
+    bool m_scissorTest = false;
+};
+
+#endif /* end of include guard: WEIGHTEDBLENDEDOIT_HH */
@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////////////
+// YUVConversion.hh
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Conversion of the premultiplied RGBA images read back from OpenGL into
+//  planar 8 bit YUV 4:2:0 (BT.709, limited range) for video encoders, with
+//  optional compositing over a background color.
+//
+//  Each 2x2 block of pixels shares a chroma sample computed from the block's
+//  average color (centered chroma siting, i.e., Y4M's `C420jpeg`).
+//  The image is processed in pairs of rows that are distributed across a
+//  thread pool; each pair is converted by SSE4.1/AVX2 kernels selected at
+//  runtime (see ImageConversion.hh). All kernels use the same fixed-point
+//  arithmetic and produce identical results.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#ifndef YUVCONVERSION_HH
+#define YUVCONVERSION_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "ImageConversion.hh"
+#include "ThreadPool.hh"
+
+namespace detail {
+
+// BT.709 limited range coefficients in 2^-14 fixed point:
+//      Y  =  16 + ( 2991 R + 10064 G + 1016 B) / 2^14
+//      Cb = 128 + (-1649 R -  5547 G + 7196 B) / 2^14
+//      Cr = 128 + ( 7196 R -  6536 G -  660 B) / 2^14
+// The chroma coefficients sum to zero so that grays map exactly to 128.
+// Chroma is computed from the sum of a 2x2 block's colors (i.e., 4x the
+// average), so it is shifted by two more bits.
+enum : int32_t {
+    YUV_SHIFT = 14,
+    Y_R =  2991, Y_G = 10064, Y_B = 1016,
+    U_R = -1649, U_G = -5547, U_B = 7196,
+    V_R =  7196, V_G = -6536, V_B = -660,
+    Y_OFFSET  = ( 16 << YUV_SHIFT)       + (1 << (YUV_SHIFT - 1)), // includes rounding
+    UV_OFFSET = (128 << (YUV_SHIFT + 2)) + (1 << (YUV_SHIFT + 1))
+};
+
+// Background color for compositing; `enabled = false` leaves the
+// premultiplied colors as-is (i.e., composited over black).
+struct YUVBackground {
+    bool enabled = false;
+    uint8_t r = 0, g = 0, b = 0;
+};
+
+// Composite premultiplied color component `c` with alpha `a` over
+// background component `bg`: c + round((255 - a) * bg / 255), clamped.
+inline int32_t compositeScalar(int32_t c, int32_t a, int32_t bg) {
+    int32_t t = (255 - a) * bg + 128;
+    return std::min(c + ((t + (t >> 8)) >> 8), 255);
+}
+
+// Convert `numPixels` pixels of rows `top` and `bottom` (which may coincide
+// for odd heights) into `numPixels` luma samples of each row and
+// ceil(numPixels / 2) chroma samples. An odd final pixel forms a 1x2 block
+// whose colors are counted twice.
+inline void yuvRowPairScalar(const uint8_t *top, const uint8_t *bottom, size_t numPixels,
+                             uint8_t *yTop, uint8_t *yBottom, uint8_t *u, uint8_t *v,
+                             const YUVBackground &bg) {
+    for (size_t i = 0; i < numPixels; i += 2) {
+        int32_t rs = 0, gs = 0, bs = 0;
+        for (size_t j = i; j < i + 2; ++j) {
+            const size_t p = std::min(j, numPixels - 1);
+            const uint8_t *rows[2] = { top + 4 * p, bottom + 4 * p };
+            uint8_t *yOut[2] = { yTop + p, yBottom + p };
+            for (int k = 0; k < 2; ++k) {
+                int32_t r = rows[k][0], g = rows[k][1], b = rows[k][2];
+                if (bg.enabled) {
+                    const int32_t a = rows[k][3];
+                    r = compositeScalar(r, a, bg.r);
+                    g = compositeScalar(g, a, bg.g);
+                    b = compositeScalar(b, a, bg.b);
+                }
+                *yOut[k] = uint8_t((Y_R * r + Y_G * g + Y_B * b + Y_OFFSET) >> YUV_SHIFT);
+                rs += r; gs += g; bs += b;
+            }
+        }
+        u[i / 2] = uint8_t((U_R * rs + U_G * gs + U_B * bs + UV_OFFSET) >> (YUV_SHIFT + 2));
+        v[i / 2] = uint8_t((V_R * rs + V_G * gs + V_B * bs + UV_OFFSET) >> (YUV_SHIFT + 2));
+    }
+}
+
+using YUVRowPairFn = void (*)(const uint8_t *top, const uint8_t *bottom, size_t numPixels,
+                              uint8_t *yTop, uint8_t *yBottom, uint8_t *u, uint8_t *v,
+                              const YUVBackground &bg);
+
+#if OSR_X86_DISPATCH
+////////////////////////////////////////////////////////////////////////////////
+// SSE4.1: 4 pixels (2 chroma samples) of each row at a time.
+////////////////////////////////////////////////////////////////////////////////
+struct RGBLanesSSE { __m128i r, g, b; };
+
+OSR_INLINE_TARGET("sse4.1") __m128i compositeSSE(__m128i c, __m128i oneMinusA, __m128i bg) {
+    __m128i t = _mm_add_epi32(_mm_mullo_epi32(oneMinusA, bg), _mm_set1_epi32(128));
+    t = _mm_srli_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 8)), 8);
+    return _mm_min_epi32(_mm_add_epi32(c, t), _mm_set1_epi32(255));
+}
+
+OSR_INLINE_TARGET("sse4.1") RGBLanesSSE loadRGBSSE(const uint8_t *src, const YUVBackground &bg) {
+    const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    RGBLanesSSE result{_mm_and_si128(px, byteMask),
+                       _mm_and_si128(_mm_srli_epi32(px,  8), byteMask),
+                       _mm_and_si128(_mm_srli_epi32(px, 16), byteMask)};
+    if (bg.enabled) {
+        const __m128i oneMinusA = _mm_sub_epi32(byteMask, _mm_srli_epi32(px, 24));
+        result.r = compositeSSE(result.r, oneMinusA, _mm_set1_epi32(bg.r));
+        result.g = compositeSSE(result.g, oneMinusA, _mm_set1_epi32(bg.g));
+        result.b = compositeSSE(result.b, oneMinusA, _mm_set1_epi32(bg.b));
+    }
+    return result;
+}
+
+// Weighted sum c0 * x + c1 * y + c2 * z + offset, shifted right.
+OSR_INLINE_TARGET("sse4.1") __m128i dotSSE(const __m128i &x, const __m128i &y, const __m128i &z, int32_t c0, int32_t c1, int32_t c2, int32_t offset, int shift) {
+    __m128i sum = _mm_add_epi32(_mm_mullo_epi32(x, _mm_set1_epi32(c0)), _mm_mullo_epi32(y, _mm_set1_epi32(c1)));
+    sum = _mm_add_epi32(sum, _mm_mullo_epi32(z, _mm_set1_epi32(c2)));
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(offset)), shift);
+}
+
+// Store the low bytes of the four 32 bit lanes of `x`.
+OSR_INLINE_TARGET("sse4.1") void store4BytesSSE(uint8_t *dst, __m128i x) {
+    x = _mm_packus_epi16(_mm_packus_epi32(x, x), x);
+    const int32_t bytes = _mm_cvtsi128_si32(x);
+    std::memcpy(dst, &bytes, 4);
+}
+
+OSR_TARGET("sse4.1") void yuvRowPairSSE41(const uint8_t *top, const uint8_t *bottom, size_t numPixels,
+                                          uint8_t *yTop, uint8_t *yBottom, uint8_t *u, uint8_t *v,
+                                          const YUVBackground &bg) {
+    size_t i = 0;
+    for (; i + 4 <= numPixels; i += 4) {
+        const RGBLanesSSE t = loadRGBSSE(top    + 4 * i, bg),
+                          b = loadRGBSSE(bottom + 4 * i, bg);
+        store4BytesSSE(yTop    + i, dotSSE(t.r, t.g, t.b, Y_R, Y_G, Y_B, Y_OFFSET, YUV_SHIFT));
+        store4BytesSSE(yBottom + i, dotSSE(b.r, b.g, b.b, Y_R, Y_G, Y_B, Y_OFFSET, YUV_SHIFT));
+
+        // Horizontally add adjacent pixels' sums: lanes {0, 1} hold the blocks' sums.
+        const __m128i rs = _mm_add_epi32(t.r, b.r), gs = _mm_add_epi32(t.g, b.g), bs = _mm_add_epi32(t.b, b.b);
+        const __m128i rp = _mm_hadd_epi32(rs, rs), gp = _mm_hadd_epi32(gs, gs), bp = _mm_hadd_epi32(bs, bs);
+        const __m128i uv = _mm_unpacklo_epi64(dotSSE(rp, gp, bp, U_R, U_G, U_B, UV_OFFSET, YUV_SHIFT + 2),
+                                              dotSSE(rp, gp, bp, V_R, V_G, V_B, UV_OFFSET, YUV_SHIFT + 2));
+        const __m128i uvBytes = _mm_packus_epi16(_mm_packus_epi32(uv, uv), uv);
+        const uint16_t uBytes = uint16_t(_mm_extract_epi16(uvBytes, 0)),
+                       vBytes = uint16_t(_mm_extract_epi16(uvBytes, 1));
+        std::memcpy(u + i / 2, &uBytes, 2);
+        std::memcpy(v + i / 2, &vBytes, 2);
+    }
+    yuvRowPairScalar(top + 4 * i, bottom + 4 * i, numPixels - i, yTop + i, yBottom + i, u + i / 2, v + i / 2, bg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 pixels (4 chroma samples) of each row at a time.
+////////////////////////////////////////////////////////////////////////////////
+struct RGBLanesAVX2 { __m256i r, g, b; };
+
+OSR_INLINE_TARGET("avx2") __m256i compositeAVX2(__m256i c, __m256i oneMinusA, __m256i bg) {
+    __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(oneMinusA, bg), _mm256_set1_epi32(128));
+    t = _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8);
+    return _mm256_min_epi32(_mm256_add_epi32(c, t), _mm256_set1_epi32(255));
+}
+
+OSR_INLINE_TARGET("avx2") RGBLanesAVX2 loadRGBAVX2(const uint8_t *src, const YUVBackground &bg) {
+    const __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    RGBLanesAVX2 result{_mm256_and_si256(px, byteMask),
+                        _mm256_and_si256(_mm256_srli_epi32(px,  8), byteMask),
+                        _mm256_and_si256(_mm256_srli_epi32(px, 16), byteMask)};
+    if (bg.enabled) {
+        const __m256i oneMinusA = _mm256_sub_epi32(byteMask, _mm256_srli_epi32(px, 24));
+        result.r = compositeAVX2(result.r, oneMinusA, _mm256_set1_epi32(bg.r));
+        result.g = compositeAVX2(result.g, oneMinusA, _mm256_set1_epi32(bg.g));
+        result.b = compositeAVX2(result.b, oneMinusA, _mm256_set1_epi32(bg.b));
+    }
+    return result;
+}
+
+OSR_INLINE_TARGET("avx2") __m256i dotAVX2(const __m256i &x, const __m256i &y, const __m256i &z, int32_t c0, int32_t c1, int32_t c2, int32_t offset, int shift) {
+    __m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(x, _mm256_set1_epi32(c0)), _mm256_mullo_epi32(y, _mm256_set1_epi32(c1)));
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(z, _mm256_set1_epi32(c2)));
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(offset)), shift);
+}
+
+// Store the low bytes of the eight 32 bit lanes of `x`.
+OSR_INLINE_TARGET("avx2") void store8BytesAVX2(uint8_t *dst, __m256i x) {
+    const __m128i lo = _mm256_castsi256_si128(x), hi = _mm256_extracti128_si256(x, 1);
+    const __m128i words = _mm_packus_epi32(lo, hi);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(words, words));
+}
+
+OSR_TARGET("avx2") void yuvRowPairAVX2(const uint8_t *top, const uint8_t *bottom, size_t numPixels,
+                                       uint8_t *yTop, uint8_t *yBottom, uint8_t *u, uint8_t *v,
+                                       const YUVBackground &bg) {
+    size_t i = 0;
+    for (; i + 8 <= numPixels; i += 8) {
+        const RGBLanesAVX2 t = loadRGBAVX2(top    + 4 * i, bg),
+                           b = loadRGBAVX2(bottom + 4 * i, bg);
+        store8BytesAVX2(yTop    + i, dotAVX2(t.r, t.g, t.b, Y_R, Y_G, Y_B, Y_OFFSET, YUV_SHIFT));
+        store8BytesAVX2(yBottom + i, dotAVX2(b.r, b.g, b.b, Y_R, Y_G, Y_B, Y_OFFSET, YUV_SHIFT));
+
+        // Within each 128 bit half, lanes {0, 1} of the horizontal sums hold the blocks' sums.
+        const __m256i rs = _mm256_add_epi32(t.r, b.r), gs = _mm256_add_epi32(t.g, b.g), bs = _mm256_add_epi32(t.b, b.b);
+        const __m256i rp = _mm256_hadd_epi32(rs, rs), gp = _mm256_hadd_epi32(gs, gs), bp = _mm256_hadd_epi32(bs, bs);
+        // Blend into [u0 u1 v0 v1 | u2 u3 v2 v3] and reorder as [u0 u1 u2 u3 | v0 v1 v2 v3]
+        const __m256i uv = _mm256_permutevar8x32_epi32(
+                _mm256_blend_epi32(dotAVX2(rp, gp, bp, U_R, U_G, U_B, UV_OFFSET, YUV_SHIFT + 2),
+                                   dotAVX2(rp, gp, bp, V_R, V_G, V_B, UV_OFFSET, YUV_SHIFT + 2),
+                                   0xCC),
+                _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+        uint8_t uvBytes[8];
+        store8BytesAVX2(uvBytes, uv);
+        std::memcpy(u + i / 2, uvBytes,     4);
+        std::memcpy(v + i / 2, uvBytes + 4, 4);
+    }
+    yuvRowPairSSE41(top + 4 * i, bottom + 4 * i, numPixels - i, yTop + i, yBottom + i, u + i / 2, v + i / 2, bg);
+}
+#endif // OSR_X86_DISPATCH
+
+inline YUVRowPairFn selectYUVKernel() {
+#if OSR_X86_DISPATCH
+    const std::string name = imageKernel().name;
+    if ((name == "avx512") || (name == "avx2")) return yuvRowPairAVX2;
+    if (name == "sse4.1")                       return yuvRowPairSSE41;
+#endif
+    return yuvRowPairScalar;
+}
+
+// Helper threads for the conversion (the calling thread also participates).
+inline ThreadPool &yuvConversionPool() {
+    static ThreadPool pool(std::max<int>(int(std::thread::hardware_concurrency()) - 1, 1));
+    return pool;
+}
+
+} // namespace detail
+
+// Size in bytes of a planar YUV 4:2:0 image (the Y plane followed by the
+// subsampled U and V planes, as in ffmpeg's `yuv420p`).
+inline size_t yuv420Size(int width, int height) {
+    const size_t cw = (width + 1) / 2, ch = (height + 1) / 2;
+    return size_t(width) * height + 2 * cw * ch;
+}
+
+// Convert the `width` x `height` premultiplied RGBA image `src` (in OpenGL's
+// bottom-to-top row order if `flip` is true) into the yuv420p image `dst`
+// holding `yuv420Size(width, height)` bytes, optionally compositing it over
+// `background`.
+inline void rgbaToYUV420(const unsigned char *src, int width, int height, unsigned char *dst,
+                         bool flip = true, const detail::YUVBackground &background = detail::YUVBackground()) {
+    static const detail::YUVRowPairFn convertRowPair = detail::selectYUVKernel();
+    const size_t cw = (width + 1) / 2, ch = (height + 1) / 2, rowSize = 4 * size_t(width);
+    uint8_t *yPlane = dst,
+            *uPlane = yPlane + size_t(width) * height,
+            *vPlane = uPlane + cw * ch;
+    auto srcRow = [&](int row) { return src + rowSize * (flip ? (height - 1 - row) : row); };
+
+    // Process chunks of at least 16 row pairs per thread.
+    detail::yuvConversionPool().parallelFor(0, ch, [&](size_t pairBegin, size_t pairEnd) {
+        for (size_t pair = pairBegin; pair < pairEnd; ++pair) {
+            const int r0 = 2 * pair, r1 = std::min(r0 + 1, height - 1);
+            convertRowPair(srcRow(r0), srcRow(r1), width,
+                           yPlane + size_t(width) * r0, yPlane + size_t(width) * r1,
+                           uPlane + cw * pair, vPlane + cw * pair, background);
+        }
+    }, 16);
+}
+
+#endif /* end of include guard: YUVCONVERSION_HH */
@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////////////////////////
+// benchmark_osmesa_threads.cc
+////////////////////////////////////////////////////////////////////////////////
+/*! @file
+//  Finds the best split of a machine's cores between independent OSMesa
+//  contexts (`RenderPool` workers) and llvmpipe rasterizer threads per
+//  context, by measuring the frame throughput of each split on a
+//  rasterization-heavy scene. Since llvmpipe reads its thread count once per
+//  process, each split is measured in a child process.
+*/
+////////////////////////////////////////////////////////////////////////////////
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Dense>
+#include "OpenGLContext.hh"
+#include "Shader.hh"
+#include "Buffers.hh"
+#include "RenderPool.hh"
+
+struct Settings {
+    int width = 1024, height = 1024, frames = 200, layers = 8, grid = 64;
+};
+
+// `layers` overlapping grids of `grid` x `grid` quads, each covering the viewport.
+struct Scene {
+    Scene(const std::shared_ptr<OpenGLContext> &ctx, const Settings &s) {
+        shader = Shader::fromFiles(ctx, SHADER_PATH "/demo.vert", SHADER_PATH "/demo.frag");
+        const int nv = (s.grid + 1) * (s.grid + 1);
+        Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> positions(s.layers * nv, 3);
+        Eigen::Matrix<float, Eigen::Dynamic, 4, Eigen::RowMajor> colors(s.layers * nv, 4);
+        Eigen::Matrix<unsigned int, Eigen::Dynamic, 3, Eigen::RowMajor> indices(s.layers * 2 * s.grid * s.grid, 3);
+        int t = 0;
+        for (int l = 0; l < s.layers; ++l) {
+            const float z = 0.9f - 1.8f * l / std::max(s.layers - 1, 1);
+            for (int i = 0; i <= s.grid; ++i) {
+                for (int j = 0; j <= s.grid; ++j) {
+                    const int v = l * nv + i * (s.grid + 1) + j;
+                    positions.row(v) << 2.0f * j / s.grid - 1.0f, 2.0f * i / s.grid - 1.0f, z;
+                    colors.row(v) << float(i) / s.grid, float(j) / s.grid, float(l) / s.layers, 1.0f;
+                    if ((i == s.grid) || (j == s.grid)) continue;
+                    indices.row(t++) << v, v + 1, v + s.grid + 2;
+                    indices.row(t++) << v, v + s.grid + 2, v + s.grid + 1;
+                }
+            }
+        }
+        vao = std::make_unique<VertexArrayObject>(ctx);
+        vao->setAttribute(0, positions);
+        vao->setAttribute(1, colors);
+        vao->setIndexBuffer(indices);
+    }
+
+    void render(OpenGLContext &ctx) {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        ctx.enable(GL_DEPTH_TEST);
+        vao->draw(*shader);
+    }
+
+    std::unique_ptr<Shader> shader;
+    std::unique_ptr<VertexArrayObject> vao;
+};
+
+// Frames per second rendered (and read back) by `numContexts` workers each
+// using `numThreads` rasterizer threads.
+double measure(int numContexts, int numThreads, const Settings &s) {
+    OSMesaWrapper::setRasterizerThreadCount(numThreads);
+    OSMesaWrapper::setIndependentContexts(true);
+
+    std::vector<std::unique_ptr<Scene>> scenes(numContexts);
+    RenderPool pool(s.width, s.height, numContexts, 0, [&](int w, int h) {
+        auto ctx = OpenGLContext::construct(w, h);
+        ctx->makeCurrent();
+        scenes[ThreadPool::currentWorkerIndex()] = std::make_unique<Scene>(ctx, s);
+        return ctx;
+    });
+    auto job = [&](OpenGLContext &ctx) { scenes[ThreadPool::currentWorkerIndex()]->render(ctx); };
+
+    auto run = [&](int frames) {
+        std::vector<std::future<RenderPool::Frame>> results;
+        for (int i = 0; i < frames; ++i) results.push_back(pool.render(job));
+        for (auto &r : results) r.get();
+    };
+    run(numContexts); // warm up (shader compilation, buffer uploads)
+    const auto start = std::chrono::steady_clock::now();
+    run(s.frames);
+    const double fps = s.frames / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Release each worker's scene on that worker (with its context current);
+    // the jobs wait for each other so that every worker takes exactly one.
+    std::atomic<int> arrived(0);
+    std::vector<std::future<void>> released;
+    for (int i = 0; i < numContexts; ++i) {
+        released.push_back(pool.submit([&](OpenGLContext &) {
+            scenes[ThreadPool::currentWorkerIndex()].reset();
+            ++arrived;
+            while (arrived < numContexts) std::this_thread::yield();
+        }));
+    }
+    for (auto &r : released) r.get();
+    return fps;
+}
+
+int main(int argc, char *argv[]) {
+    Settings s;
+    int cores = std::max<int>(std::thread::hardware_concurrency(), 1);
+    int runContexts = 0, runThreads = -1;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for %s\n", arg.c_str()); exit(1); }
+            return atoi(argv[++i]);
+        };
+        if      (arg == "--cores")  cores    = next();
+        else if (arg == "--width")  s.width  = next();
+        else if (arg == "--height") s.height = next();
+        else if (arg == "--frames") s.frames = next();
+        else if (arg == "--layers") s.layers = next();
+        else if (arg == "--grid")   s.grid   = next();
+        else if (arg == "--run") { runContexts = next(); runThreads = next(); }
+        else {
+            fprintf(stderr, "Usage:\n");
+            fprintf(stderr, "  %s [--cores P] [--width W] [--height H] [--frames N] [--layers L] [--grid G]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (runContexts > 0) {
+        // Child process: measure a single split.
+        printf("fps %f\n", measure(runContexts, runThreads, s));
+        return 0;
+    }
+
+    // Splits of the cores: `c` contexts with `cores / c` rasterizer threads
+    // each, or one fewer (leaving a core for the thread issuing GL calls).
+    struct Split { int contexts, threads; double fps; };
+    std::vector<Split> splits;
+    for (int c = 1; c <= cores; ++c) {
+        if (cores % c) continue;
+        splits.push_back(Split{c, cores / c, 0.0});
+        splits.push_back(Split{c, cores / c - 1, 0.0});
+    }
+
+    const std::string settings = " --width " + std::to_string(s.width) + " --height " + std::to_string(s.height)
+                               + " --frames " + std::to_string(s.frames) + " --layers " + std::to_string(s.layers)
+                               + " --grid " + std::to_string(s.grid);
+    printf("%d cores, %d x %d, %d frames, %d layers\n", cores, s.width, s.height, s.frames, s.layers);
+    printf("contexts  threads/context        fps\n");
+    const Split *best = nullptr;
+    for (Split &split : splits) {
+        const std::string cmd = std::string(argv[0]) + " --run " + std::to_string(split.contexts) + " " + std::to_string(split.threads) + settings;
+        FILE *child = popen(cmd.c_str(), "r");
+        if (child == nullptr) { perror("popen"); return 1; }
+        char line[256];
+        while (fgets(line, sizeof(line), child)) sscanf(line, "fps %lf", &split.fps);
+        if (pclose(child) != 0) split.fps = 0.0;
+        printf("%8d  %15d  %9.2f%s\n", split.contexts, split.threads, split.fps, (split.fps > 0) ? "" : "  (failed)");
+        fflush(stdout);
+        if (!best || (split.fps > best->fps)) best = &split;
+    }
+    if (best && (best->fps > 0))
+        printf("Best: %d contexts with %d rasterizer threads each (%.2f fps)\n", best->contexts, best->threads, best->fps);
+    return 0;
+}
@@ -51,7 +51,7 @@ int main(int argc, char *argv[])
 
     ctx->render([&]() {
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glEnable(GL_DEPTH_TEST);
+        ctx->enable(GL_DEPTH_TEST);
 
         vao.draw(*shader);
     });
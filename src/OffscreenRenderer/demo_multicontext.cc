@@ -3,6 +3,8 @@
 
 #include <Eigen/Dense>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include "OpenGLContext.hh"
 #include "Shader.hh"
 #include "Buffers.hh"
@@ -35,7 +37,7 @@ struct RenderState {
         ctx->render([&]() {
             // glClearColor(0, 0, 0, 1);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            glEnable(GL_DEPTH_TEST);
+            ctx->enable(GL_DEPTH_TEST);
 
             vao->draw(*shader);
         });
@@ -79,8 +81,28 @@ int main(int argc, char *argv[])
 
     // Test deletion
     render2.reset();
-    render1->render(); // this is essential since for our OSMesa virtual contexts, removing one leaves the others' buffers undefined!
-    render1->ctx->writePNG(filename + std::string("4.png"));
+    render1->ctx->finish();
+    render1->ctx->writePNG(filename + std::string("4.png")); // Make sure context 1's image survived context 2's deletion!
+
+    // Small contexts are packed side by side into OSMesa's shared canvas;
+    // make sure each one reads back its own pixels, both synchronously and
+    // through the asynchronous readback.
+    std::vector<std::shared_ptr<OpenGLContext>> tiles;
+    for (int i = 0; i < 3; ++i) tiles.push_back(OpenGLContext::construct(64, 64));
+    for (int i = 0; i < 3; ++i) tiles[i]->clear(Eigen::Vector3f::Unit(i));
+    for (int i = 0; i < 3; ++i) {
+        auto check = [&](const OpenGLContext::ImageBuffer &image, const char *path) {
+            Eigen::Array<unsigned char, 4, 1> expected(0, 0, 0, 255);
+            expected[i] = 255;
+            Eigen::Map<const Eigen::Array<unsigned char, 4, Eigen::Dynamic>> pixels(image.data(), 4, 64 * 64);
+            if (((pixels.colwise() - expected) != 0).any())
+                throw std::runtime_error("Context " + std::to_string(i) + " read back the wrong pixels (" + path + " readback)");
+        };
+        tiles[i]->finish();
+        check(tiles[i]->buffer(), "synchronous");
+        tiles[i]->requestReadback();
+        check(tiles[i]->acquireFrame(), "asynchronous");
+    }
 
     return 0;
 }
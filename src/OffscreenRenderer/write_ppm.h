@@ -0,0 +1,21 @@
+#ifndef WRITE_PPM_H
+#define WRITE_PPM_H
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+// Write an 8 bit RGB image (rows ordered top to bottom) in binary PPM format.
+inline void write_ppm_RGB(const std::string &path, int width, int height, const unsigned char *data) {
+    std::ofstream outFile(path, std::ofstream::binary);
+    if (!outFile.is_open())
+        throw std::runtime_error("Failed to open " + path);
+
+    outFile << "P6\n";
+    outFile << width << " " << height << "\n";
+    outFile << "255\n";
+    outFile.write((const char *) data, 3 * size_t(width) * height);
+    if (!outFile) throw std::runtime_error("Failed to write " + path);
+}
+
+#endif /* end of include guard: WRITE_PPM_H */
@@ -1,11 +1,17 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/eigen.h>
+#include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 #include <pybind11/iostream.h>
 
 #include <OffscreenRenderer/Shader.hh>
 #include <OffscreenRenderer/OpenGLContext.hh>
 #include <OffscreenRenderer/Buffers.hh>
+#include <OffscreenRenderer/UniformBuffer.hh>
+#include <OffscreenRenderer/FrameSink.hh>
+#include <OffscreenRenderer/RenderPool.hh>
+#include <OffscreenRenderer/TriangleDepthSorter.hh>
+#include <OffscreenRenderer/WeightedBlendedOIT.hh>
 
 namespace py = pybind11;
 
@@ -32,7 +38,17 @@ template<typename T>
 struct BindSetUniform {
     template<class PyShader>
     static void run(PyShader &pyShader) {
-        pyShader.def("setUniform", &Shader::setUniform<T>, py::arg("name"), py::arg("val"), py::arg("optional") = false);
+        pyShader.def("setUniform", static_cast<void (Shader::*)(const std::string &, const T &, bool)>(&Shader::setUniform<T>), py::arg("name"), py::arg("val"), py::arg("optional") = false);
+        pyShader.def("setUniform", static_cast<void (Shader::*)(int, const T &)>(&Shader::setUniform<T>), py::arg("handle"), py::arg("val"));
+    }
+};
+
+template<typename T>
+struct BindUniformBufferSet {
+    template<class PyUBO>
+    static void run(PyUBO &pyUBO) {
+        pyUBO.def("set", static_cast<void (UniformBuffer::*)(const std::string &, const T &, bool)>(&UniformBuffer::set<T>), py::arg("name"), py::arg("val"), py::arg("optional") = false);
+        pyUBO.def("set", static_cast<void (UniformBuffer::*)(int, const T &)>(&UniformBuffer::set<T>), py::arg("handle"), py::arg("val"));
     }
 };
 
@@ -46,16 +62,203 @@ struct BindSetConstAttribute {
 
 #include "py_gl_enum.inl"
 
+// Entry points that may block on the GPU, readback, large uploads or file
+// output release the GIL so other Python threads can drive their own contexts
+// in the meantime. OSMesa's virtual contexts all share one real context that
+// must not be used from several threads at once, so while any exist the GIL
+// is kept to serialize them (independent OSMesa contexts need no such care).
+#if USE_OSMESA
+struct OSMesaGILRelease {
+    OSMesaGILRelease() {
+        if (OSMesaWrapper::numVirtualContexts() == 0) m_release = std::make_unique<py::gil_scoped_release>();
+    }
+private:
+    std::unique_ptr<py::gil_scoped_release> m_release;
+};
+using GLCallGILRelease = OSMesaGILRelease;
+#else
+using GLCallGILRelease = py::gil_scoped_release;
+#endif
+using GLCallGuard = py::call_guard<GLCallGILRelease>;
+
+// Python objects referenced by jobs running on RenderPool worker threads must
+// be released with the GIL held.
+std::shared_ptr<py::object> gilSafeObject(py::object obj) {
+    return std::shared_ptr<py::object>(new py::object(std::move(obj)), [](py::object *o) {
+        py::gil_scoped_acquire acquire;
+        delete o;
+    });
+}
+
+// Destroying a pool joins its workers, which may need the GIL to finish their
+// queued Python jobs.
+struct RenderPoolDeleter {
+    void operator()(RenderPool *pool) const {
+        py::gil_scoped_release release;
+        delete pool;
+    }
+};
+
+// View a C-contiguous 1D/2D array of `T`-sized elements as a row-major matrix.
+template<typename T>
+Eigen::Map<const MXR<T>> rowMajorView(const py::array &A) {
+    const ssize_t rows = A.shape(0), cols = (A.ndim() == 2) ? A.shape(1) : 1;
+    return Eigen::Map<const MXR<T>>(static_cast<const T *>(A.data()), rows, cols);
+}
+
+template<typename T>
+void setIntegralAttribute(VertexArrayObject &vao, int loc, py::array A, bool instanced, bool normalized) {
+    A = py::array_t<T, py::array::c_style | py::array::forcecast>::ensure(A);
+    if (!A) throw py::error_already_set();
+    const auto view = rowMajorView<T>(A);
+    GLCallGILRelease release;
+    if (normalized) vao.setNormalizedAttribute<T>(loc, view, instanced);
+    else            vao.setIntegerAttribute<T>   (loc, view, instanced);
+}
+
+// Dispatch `VertexArrayObject.setAttribute` to the attribute format for A's
+// dtype: half floats for float16, float32 (converting) otherwise, unless
+// normalized or integer components are requested for integer data.
+void setAttributeForDType(VertexArrayObject &vao, int loc, py::object data, bool instanced, bool normalized, bool integer) {
+    py::array A = py::array::ensure(data); // also accept nested sequences
+    if (!A) throw py::error_already_set();
+    if ((A.ndim() < 1) || (A.ndim() > 2)) throw std::runtime_error("Attribute data must be a 1D or 2D array");
+    const char kind = A.dtype().kind();
+    const ssize_t size = A.dtype().itemsize();
+    if (normalized || integer) {
+        if (normalized && integer) throw std::runtime_error("An attribute cannot be both normalized and integer");
+        if (((kind != 'i') && (kind != 'u')) || (size > 4))
+            throw std::runtime_error("Normalized and integer attributes need 8, 16 or 32-bit integer data");
+        const bool isSigned = (kind == 'i');
+        if (size == 1) return isSigned ? setIntegralAttribute<GLbyte >(vao, loc, A, instanced, normalized) : setIntegralAttribute<GLubyte >(vao, loc, A, instanced, normalized);
+        if (size == 2) return isSigned ? setIntegralAttribute<GLshort>(vao, loc, A, instanced, normalized) : setIntegralAttribute<GLushort>(vao, loc, A, instanced, normalized);
+        return                isSigned ? setIntegralAttribute<GLint  >(vao, loc, A, instanced, normalized) : setIntegralAttribute<GLuint  >(vao, loc, A, instanced, normalized);
+    }
+    if ((kind == 'f') && (size == 2)) {
+        A = py::array::ensure(A, py::array::c_style);
+        if (!A) throw py::error_already_set();
+        const auto view = rowMajorView<Eigen::half>(A);
+        GLCallGILRelease release;
+        vao.setHalfAttribute(loc, view, instanced);
+        return;
+    }
+    A = py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(A);
+    if (!A) throw py::error_already_set();
+    const auto view = rowMajorView<float>(A);
+    GLCallGILRelease release;
+    vao.setAttribute(loc, view, instanced);
+}
+
 PYBIND11_MODULE(_offscreen_renderer, m) {
     bindGLEnum(m);
 
-    py::class_<OpenGLContext, std::shared_ptr<OpenGLContext>>(m, "OpenGLContext")
-        .def(py::init(&OpenGLContext::construct), py::arg("width"), py::arg("height"))
-        .def("resize",      &OpenGLContext::resize, py::arg("width"), py::arg("height"), py::arg("skipViewportCall") = false)
-        .def("makeCurrent", &OpenGLContext::makeCurrent)
-        .def("finish",      &OpenGLContext::finish)
+    m.def("imageKernelName", &imageKernelName, "SIMD kernel used for unpremultiplying/flipping/converting images on this CPU");
+
+    // Handle for a write queued by `writePNGAsync`/`writePPMAsync`
+    py::class_<std::shared_future<void>>(m, "ImageWriteFuture")
+        .def("wait",   [](const std::shared_future<void> &f) { f.wait(); }, py::call_guard<py::gil_scoped_release>())
+        .def("done",   [](const std::shared_future<void> &f) { return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; })
+        .def("result", [](const std::shared_future<void> &f) { f.get(); }, py::call_guard<py::gil_scoped_release>(),
+             "Wait for the write to finish, raising any error it encountered")
+        ;
+
+    m.def("configureImageWriter", &AsyncImageWriter::configureGlobal, py::arg("numThreads") = 0, py::arg("maxQueued") = 0, py::call_guard<py::gil_scoped_release>(),
+          "Set the number of background image encoding threads and the number of writes that may be queued before `write*Async` blocks (0: defaults)");
+    m.def("waitForImageWrites", []() { AsyncImageWriter::global().wait(); }, py::call_guard<py::gil_scoped_release>());
+#if USE_OSMESA
+    m.def("osmesaIndependentContexts",    &OSMesaWrapper::independentContexts);
+    m.def("setOSMesaIndependentContexts", &OSMesaWrapper::setIndependentContexts, py::arg("enable"),
+          "Create an independent OSMesa context for each new OpenGLContext (allowing parallel RenderPool workers)");
+    m.def("osmesaRasterizerThreadCount",    &OSMesaWrapper::rasterizerThreadCount);
+    m.def("setOSMesaRasterizerThreadCount", &OSMesaWrapper::setRasterizerThreadCount, py::arg("numThreads"),
+          "Set the number of llvmpipe rasterizer threads per context (-1: one per CPU); must precede the first context's creation");
+#endif
+#if PNG_WRITER
+    // Row filters for the `filters` argument of `writePNG`/`writePNGAsync`
+    m.attr("PNG_FILTER_NONE")  = int(PNG_FILTER_NONE);
+    m.attr("PNG_FILTER_SUB")   = int(PNG_FILTER_SUB);
+    m.attr("PNG_FILTER_UP")    = int(PNG_FILTER_UP);
+    m.attr("PNG_FILTER_AVG")   = int(PNG_FILTER_AVG);
+    m.attr("PNG_FILTER_PAETH") = int(PNG_FILTER_PAETH);
+    m.attr("PNG_ALL_FILTERS")  = int(PNG_ALL_FILTERS);
+#endif
+
+    // GL calls (including `makeCurrent`) issued to the driver/skipped as redundant by a context's state cache
+    py::class_<GLStateCache::Counters>(m, "StateCacheCounters")
+        .def_readonly("issued", &GLStateCache::Counters::issued)
+        .def_readonly("elided", &GLStateCache::Counters::elided)
+        .def("__repr__", [](const GLStateCache::Counters &c) {
+                return "StateCacheCounters(issued=" + std::to_string(c.issued) + ", elided=" + std::to_string(c.elided) + ")";
+            })
+        ;
+
+    // Contexts created into the same share group share programs, buffers and textures
+    py::class_<ShareGroup, std::shared_ptr<ShareGroup>>(m, "ShareGroup")
+        .def(py::init<>())
+        .def("__len__", &ShareGroup::size)
+        ;
+
+    py::class_<OpenGLContext, std::shared_ptr<OpenGLContext>> pyOpenGLContext(m, "OpenGLContext", py::buffer_protocol());
+
+    // Rendering devices that contexts can be placed on (EGL only)
+    py::class_<OpenGLContext::DeviceInfo>(pyOpenGLContext, "DeviceInfo")
+        .def_readonly("index",         &OpenGLContext::DeviceInfo::index)
+        .def_readonly("extensions",    &OpenGLContext::DeviceInfo::extensions)
+        .def_readonly("drmDeviceFile", &OpenGLContext::DeviceInfo::drmDeviceFile)
+        .def_readonly("software",      &OpenGLContext::DeviceInfo::software)
+        .def("__repr__", [](const OpenGLContext::DeviceInfo &d) {
+                return "DeviceInfo(index=" + std::to_string(d.index) + ", software=" + (d.software ? "True" : "False")
+                        + ", drmDeviceFile='" + d.drmDeviceFile + "')";
+            })
+        ;
+    pyOpenGLContext.attr("DEFAULT_DEVICE")  = int(OpenGLContext::DEFAULT_DEVICE);
+    pyOpenGLContext.attr("SOFTWARE_DEVICE") = int(OpenGLContext::SOFTWARE_DEVICE);
+
+    pyOpenGLContext
+        .def(py::init(&OpenGLContext::construct), py::arg("width"), py::arg("height"), py::arg("device") = int(OpenGLContext::DEFAULT_DEVICE),
+             py::arg("shareGroup") = std::shared_ptr<ShareGroup>())
+        .def_static("devices", &OpenGLContext::devices)
+        .def_static("numContextsOnDevice", &OpenGLContext::numContextsOnDevice, py::arg("device"))
+        // Zero-copy, read-only view of the internal (premultiplied) image buffer
+        // as a (height, width, 4) array in top-to-bottom scanline order; the
+        // vertical flip is implemented with a negative row stride.
+        // The view is invalidated by `resize`.
+        .def_buffer([](OpenGLContext &ctx) {
+                const ssize_t w = ctx.getWidth(), h = ctx.getHeight(), rowSize = 4 * w;
+                unsigned char *lastRow = const_cast<unsigned char *>(ctx.buffer().data()) + rowSize * (h - 1);
+                return py::buffer_info(lastRow, sizeof(unsigned char), py::format_descriptor<unsigned char>::format(),
+                                       3, { h, w, ssize_t(4) }, { -rowSize, ssize_t(4), ssize_t(1) }, /* readonly = */ true);
+            })
+        .def("resize",      &OpenGLContext::resize, py::arg("width"), py::arg("height"), py::arg("skipViewportCall") = false, GLCallGuard())
+        .def("bindRenderTarget",        &OpenGLContext::bindRenderTarget)
+        .def("renderTargetFramebuffer", &OpenGLContext::renderTargetFramebuffer)
+        .def("makeCurrent",    &OpenGLContext::makeCurrent)
+        .def("releaseCurrent", &OpenGLContext::releaseCurrent)
+        .def("flushDeletions", &OpenGLContext::flushDeletions,
+             "Delete the objects released since the context was last made current (otherwise done by the next `makeCurrent` or `finish`)")
+        .def_property_readonly("numDeletedObjects", [](OpenGLContext &ctx) { return ctx.deletionQueue().numFlushed(); })
+        .def("stateCacheCounters",      [](OpenGLContext &ctx) { return ctx.stateCacheCounters(); })
+        .def("resetStateCacheCounters", [](OpenGLContext &ctx) { ctx.stateCache().resetCounters(); })
+        .def("invalidateStateCache",    &OpenGLContext::invalidateStateCache,
+             "Must be called after changing capabilities, blend/cull state, or program/VAO/buffer bindings with direct GL calls")
+        .def("finish",      &OpenGLContext::finish, GLCallGuard())
         .def("buffer",                &OpenGLContext::buffer,                py::return_value_policy::reference)
-        .def("unpremultipliedBuffer", &OpenGLContext::unpremultipliedBuffer)
+        .def("unpremultipliedBuffer", &OpenGLContext::unpremultipliedBuffer, GLCallGuard())
+        .def("readInto",              [](const OpenGLContext &ctx, py::array_t<unsigned char, py::array::c_style> out, bool unpremultiply, bool flip) {
+                // Write RGBA or RGB pixels depending on the output array's size
+                const size_t numPixels = size_t(ctx.getWidth()) * ctx.getHeight();
+                if ((size_t(out.size()) != 4 * numPixels) && (size_t(out.size()) != 3 * numPixels))
+                    throw std::runtime_error("Output array must hold width * height * 4 (RGBA) or width * height * 3 (RGB) bytes");
+                unsigned char *dst = out.mutable_data();
+                const bool rgb = size_t(out.size()) == 3 * numPixels;
+                GLCallGILRelease release;
+                ctx.readInto(dst, unpremultiply, flip, rgb);
+            }, py::arg("out").noconvert(), py::arg("unpremultiply") = true, py::arg("flip") = true)
+        .def("requestReadback",       &OpenGLContext::requestReadback,       GLCallGuard())
+        .def("isReady",               &OpenGLContext::isReady)
+        .def("acquireFrame",          &OpenGLContext::acquireFrame,          py::return_value_policy::reference, GLCallGuard())
+        .def_property_readonly("pendingReadbacks", &OpenGLContext::pendingReadbacks)
+        .def_property("readbackRingSize", &OpenGLContext::readbackRingSize, &OpenGLContext::setReadbackRingSize)
         .def("enable",      [](OpenGLContext &ctx, GLenumWrapper cap) { ctx. enable(unwrapGLenum(cap)); }, py::arg("capability"))
         .def("disable",     [](OpenGLContext &ctx, GLenumWrapper cap) { ctx.disable(unwrapGLenum(cap)); }, py::arg("capability"))
         .def("blendFunc",   [](OpenGLContext &ctx, GLenumWrapper sf, GLenumWrapper df) {
@@ -65,15 +268,142 @@ PYBIND11_MODULE(_offscreen_renderer, m) {
                               unwrapGLenum(asf), unwrapGLenum(adf)); }, py::arg("sfactor"), py::arg("dfactor"), py::arg("alpha_sfactor"), py::arg("alpha_dfactor"))
         .def("cullFace",    [](OpenGLContext &ctx, GLenumWrapper face) {
                 ctx.cullFace(unwrapGLenum(face)); }, py::arg("face") = GLenumWrapper::wGL_BACK)
-        .def("clear",       &OpenGLContext::clear,    py::arg("color") = Eigen::Vector3f::Zero())
-        .def("writePPM",    &OpenGLContext::writePPM, py::arg("path"), py::arg("unpremultiply") = true)
+        .def("clear",       &OpenGLContext::clear,    py::arg("color") = Eigen::Vector3f::Zero(), GLCallGuard())
+        .def("writePPM",    &OpenGLContext::writePPM, py::arg("path"), py::arg("unpremultiply") = true, GLCallGuard())
+        .def("writePPMAsync", [](const OpenGLContext &ctx, const std::string &path, bool unpremultiply) {
+                return ctx.writePPMAsync(path, unpremultiply).share();
+            }, py::arg("path"), py::arg("unpremultiply") = true, py::call_guard<py::gil_scoped_release>())
 #if PNG_WRITER
-        .def("writePNG",    &OpenGLContext::writePNG, py::arg("path"), py::arg("unpremultiply") = true)
+        .def("writePNG",    &OpenGLContext::writePNG, py::arg("path"), py::arg("unpremultiply") = true, py::arg("compressionLevel") = -1, py::arg("filters") = -1, GLCallGuard())
+        .def("writePNGAsync", [](const OpenGLContext &ctx, const std::string &path, bool unpremultiply, int compressionLevel, int filters) {
+                return ctx.writePNGAsync(path, unpremultiply, compressionLevel, filters).share();
+            }, py::arg("path"), py::arg("unpremultiply") = true, py::arg("compressionLevel") = -1, py::arg("filters") = -1,
+               py::call_guard<py::gil_scoped_release>())
 #endif
         .def_property_readonly("width",  &OpenGLContext::getWidth)
         .def_property_readonly("height", &OpenGLContext::getHeight)
+        .def_property_readonly("device", &OpenGLContext::device)
+        .def_property_readonly("shareGroup", &OpenGLContext::shareGroup)
+        ;
+
+    // Frames are converted/copied into the sink's ring and written from a
+    // background thread; the GIL is released while waiting for a free slot.
+    py::class_<FrameSink, std::shared_ptr<FrameSink>> pyFrameSink(m, "FrameSink");
+
+    py::enum_<FrameSink::Format>(pyFrameSink, "Format")
+        .value("RGBA",   FrameSink::Format::RGBA)
+        .value("YUV420", FrameSink::Format::YUV420)
+        .value("Y4M",    FrameSink::Format::Y4M)
+        ;
+
+    pyFrameSink
+        .def(py::init([](const std::string &path, int width, int height, size_t ringSize, FrameSink::Format format, double framerate) {
+                return std::shared_ptr<FrameSink>(FrameSink::open(path, width, height, ringSize, format, framerate));
+            }), py::arg("path"), py::arg("width"), py::arg("height"), py::arg("ringSize") = 4, py::arg("format") = FrameSink::Format::RGBA, py::arg("framerate") = 30)
+        .def(py::init([](int fd, int width, int height, size_t ringSize, bool closeFD, FrameSink::Format format, double framerate) {
+                return std::make_shared<FrameSink>(fd, width, height, ringSize, closeFD, format, framerate);
+            }), py::arg("fd"), py::arg("width"), py::arg("height"), py::arg("ringSize") = 4, py::arg("closeFD") = true,
+             py::arg("format") = FrameSink::Format::RGBA, py::arg("framerate") = 30)
+        .def("writeFrame", [](FrameSink &sink, const OpenGLContext &ctx, bool unpremultiply) { sink.writeFrame(ctx, unpremultiply); },
+             py::arg("ctx"), py::arg("unpremultiply") = true, py::call_guard<py::gil_scoped_release>())
+        .def("writeFrame", [](FrameSink &sink, py::array_t<unsigned char, py::array::c_style | py::array::forcecast> frame) {
+                if (size_t(frame.size()) != 4 * size_t(sink.getWidth()) * sink.getHeight()) throw std::runtime_error("Unexpected frame data size");
+                py::gil_scoped_release release;
+                sink.writeFrame(frame.data());
+            }, py::arg("frame"))
+        .def("setBackground",   &FrameSink::setBackground, py::arg("color"))
+        .def("clearBackground", &FrameSink::clearBackground)
+        .def("finish", &FrameSink::finish, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("width",         &FrameSink::getWidth)
+        .def_property_readonly("height",        &FrameSink::getHeight)
+        .def_property_readonly("format",        &FrameSink::format)
+        .def_property_readonly("framerate",     [](const FrameSink &sink) { auto r = sink.framerate(); return std::make_pair(r.num, r.den); })
+        .def_property_readonly("frameSize",     &FrameSink::frameSize)
+        .def_property_readonly("ringSize",      &FrameSink::ringSize)
+        .def_property_readonly("framesWritten", &FrameSink::framesWritten)
+        ;
+
+    py::class_<VideoSink, FrameSink, std::shared_ptr<VideoSink>>(m, "VideoSink")
+        .def(py::init([](const std::vector<std::string> &command, int width, int height, size_t ringSize, FrameSink::Format format, double framerate) {
+                return std::make_shared<VideoSink>(command, width, height, ringSize, format, framerate);
+            }), py::arg("command"), py::arg("width"), py::arg("height"), py::arg("ringSize") = 4,
+             py::arg("format") = FrameSink::Format::RGBA, py::arg("framerate") = 30)
+        ;
+
+    // Frames are returned as (height, width, 4) arrays in top-to-bottom order.
+    using RenderFuture = std::shared_future<RenderPool::Frame>;
+    py::class_<RenderFuture>(m, "RenderFuture")
+        .def("wait",   [](const RenderFuture &f) { f.wait(); }, py::call_guard<py::gil_scoped_release>())
+        .def("done",   [](const RenderFuture &f) { return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; })
+        .def("result", [](const RenderFuture &f) {
+                const RenderPool::Frame *frame;
+                {
+                    py::gil_scoped_release release;
+                    frame = &f.get();
+                }
+                py::array_t<unsigned char> result({ ssize_t(frame->height), ssize_t(frame->width), ssize_t(4) });
+                std::memcpy(result.mutable_data(), frame->rgba.data(), frame->rgba.size());
+                return result;
+            }, "Wait for the frame, raising any error raised by its job")
+        ;
+
+    // Each worker's context is created by calling `contextFactory(width, height)`
+    // (the native `OpenGLContext` by default, placed on `devices` according
+    // to `placement` if either is given; `devices` alone implies ROUND_ROBIN)
+    // and stays alive for the pool's lifetime, so jobs may cache per-context
+    // state on it.
+    py::class_<RenderPool, std::unique_ptr<RenderPool, RenderPoolDeleter>> pyRenderPool(m, "RenderPool");
+
+    py::enum_<RenderPool::Placement>(pyRenderPool, "Placement")
+        .value("ROUND_ROBIN",  RenderPool::Placement::ROUND_ROBIN)
+        .value("LEAST_LOADED", RenderPool::Placement::LEAST_LOADED)
+        ;
+
+    pyRenderPool
+        .def(py::init([](int width, int height, size_t numWorkers, size_t maxQueued, py::object contextFactory,
+                         py::object placement, const std::vector<int> &devices) {
+                if (!contextFactory.is_none() && !(placement.is_none() && devices.empty())) throw std::runtime_error("Pass either contextFactory or placement/devices, not both");
+                // Listing devices without a placement policy spreads the contexts round-robin.
+                if (placement.is_none() && !devices.empty()) placement = py::cast(RenderPool::Placement::ROUND_ROBIN);
+                auto factory = gilSafeObject(contextFactory.is_none() ? py::object(py::type::of<OpenGLContext>()) : contextFactory);
+                RenderPool::ContextFactory placed;
+                if (!placement.is_none()) placed = RenderPool::deviceFactory(placement.cast<RenderPool::Placement>(), devices);
+                RenderPool::ContextFactory createContext = [factory, placed](int w, int h) {
+                    py::gil_scoped_acquire acquire;
+                    auto pyCtx = gilSafeObject(placed ? py::cast(placed(w, h)) : (*factory)(w, h));
+                    // Keep the Python object (and any attributes jobs set on it) alive with the context.
+                    return std::shared_ptr<OpenGLContext>(pyCtx->cast<OpenGLContext *>(), [pyCtx](OpenGLContext *) { });
+                };
+                py::gil_scoped_release release;
+                return std::unique_ptr<RenderPool, RenderPoolDeleter>(new RenderPool(width, height, numWorkers, maxQueued, createContext));
+            }), py::arg("width"), py::arg("height"), py::arg("numWorkers") = 0, py::arg("maxQueued") = 0, py::arg("contextFactory") = py::none(),
+               py::arg("placement") = py::none(), py::arg("devices") = std::vector<int>())
+        .def("render", [](RenderPool &pool, py::object job, bool unpremultiply) {
+                auto pyJob = gilSafeObject(std::move(job));
+                py::gil_scoped_release release;
+                return RenderFuture(pool.render([pyJob](OpenGLContext &ctx) {
+                        py::gil_scoped_acquire acquire;
+                        (*pyJob)(py::cast(&ctx, py::return_value_policy::reference));
+                    }, unpremultiply, /* flip = */ true));
+            }, py::arg("job"), py::arg("unpremultiply") = true,
+            "Call `job(ctx)` on the next free worker's context and return a `RenderFuture` for the rendered frame")
+        .def("wait", &RenderPool::wait, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("numWorkers", &RenderPool::numWorkers)
+        .def_property_readonly("maxQueued",  &RenderPool::maxQueued)
+        .def_static("maxWorkers", &RenderPool::maxWorkers)
         ;
 
+    m.def("rgbaToYUV420", [](py::array_t<unsigned char, py::array::c_style | py::array::forcecast> rgba, bool flip) {
+            if ((rgba.ndim() != 3) || (rgba.shape(2) != 4)) throw std::runtime_error("Expected a (height, width, 4) array");
+            const int h = rgba.shape(0), w = rgba.shape(1);
+            py::array_t<unsigned char> result(yuv420Size(w, h));
+            {
+                py::gil_scoped_release release;
+                rgbaToYUV420(rgba.data(), w, h, result.mutable_data(), flip);
+            }
+            return result;
+        }, py::arg("rgba"), py::arg("flip") = false, "Convert premultiplied RGBA pixels into a flat yuv420p (BT.709, limited range) array");
+
     py::class_<Uniform>(m, "Uniform")
         .def_readonly("loc",   &Uniform::loc)
         .def_readonly("size",  &Uniform::size)
@@ -90,36 +420,168 @@ PYBIND11_MODULE(_offscreen_renderer, m) {
         .def("__repr__", [](const Attribute &a) { return "Attribute " + std::to_string(a.loc) + " ('" + a.name + "'): " + getGLenumRepr(a.type); })
         ;
 
+    py::class_<ProgramBinaryCache::Stats>(m, "ShaderCacheStats")
+        .def_readonly("hits",     &ProgramBinaryCache::Stats::hits)
+        .def_readonly("misses",   &ProgramBinaryCache::Stats::misses)
+        .def_readonly("rejected", &ProgramBinaryCache::Stats::rejected)
+        .def_readonly("stores",   &ProgramBinaryCache::Stats::stores)
+        .def("__repr__", [](const ProgramBinaryCache::Stats &st) {
+                return "ShaderCacheStats(hits=" + std::to_string(st.hits) + ", misses=" + std::to_string(st.misses) +
+                       ", rejected=" + std::to_string(st.rejected) + ", stores=" + std::to_string(st.stores) + ")";
+            })
+        ;
+    m.def("shaderCacheStats",        &ProgramBinaryCache::stats);
+    m.def("resetShaderCacheStats",   &ProgramBinaryCache::resetStats);
+    m.def("shaderCacheDirectory",    &ProgramBinaryCache::directory);
+    m.def("setShaderCacheDirectory", &ProgramBinaryCache::setDirectory, py::arg("path"),
+          "Set the directory of the on-disk shader program binary cache (an empty path disables it)");
+
     py::class_<Shader> pyShader(m, "Shader");
+    py::class_<Shader::UniformValues>(pyShader, "UniformValues");
     pyShader
         .def(py::init<std::shared_ptr<OpenGLContext>, const std::string &, const std::string &>(), py::arg("ctx"), py::arg("vtx"), py::arg("frag"), py::call_guard<py::scoped_ostream_redirect, py::scoped_estream_redirect>())
         .def(py::init<std::shared_ptr<OpenGLContext>, const std::string &, const std::string &, const std::string &>(), py::arg("ctx"), py::arg("vtx"), py::arg("frag"), py::arg("geo"), py::call_guard<py::scoped_ostream_redirect, py::scoped_estream_redirect>())
         .def("use", &Shader::use)
+        .def_property_readonly("loadedFromCache", &Shader::loadedFromCache)
+        .def("uniformHandle",    &Shader::uniformHandle,    py::arg("name"), py::arg("optional") = false)
+        .def("saveUniforms",     &Shader::saveUniforms,
+             "Snapshot of the uniform values (e.g., as set up for one of several meshes drawing with the shader)")
+        .def("restoreUniforms",  &Shader::restoreUniforms,  py::arg("values"), "Reinstate values from `saveUniforms` (and use the program)")
+        .def("bindUniformBlock", &Shader::bindUniformBlock, py::arg("name"), py::arg("binding"), py::arg("optional") = false)
+        .def("uniformBlock",     &Shader::uniformBlock,     py::arg("name"), py::arg("optional") = false, py::return_value_policy::reference_internal)
         .def_property_readonly("uniforms",   &Shader::getUniforms,   py::return_value_policy::reference)
+        .def_property_readonly("uniformBlocks", &Shader::getUniformBlocks, py::return_value_policy::reference_internal)
         .def_property_readonly("attributes", &Shader::getAttributes, py::return_value_policy::reference)
         ;
 
-    MetaMap<BindSetUniform, int, float, Eigen::Vector2f, Eigen::Vector3f, Eigen::Vector4f,
+    // (`bool` comes first so that Python booleans don't resolve to the `int` overload)
+    MetaMap<BindSetUniform, bool, int, float, Eigen::Vector2f, Eigen::Vector3f, Eigen::Vector4f,
                                         Eigen::Matrix2f, Eigen::Matrix3f, Eigen::Matrix4f>::run(pyShader);
 
+    py::class_<UniformBlockLayout::Member>(m, "UniformBlockMember")
+        .def_readonly("name",         &UniformBlockLayout::Member::name)
+        .def_readonly("size",         &UniformBlockLayout::Member::size)
+        .def_readonly("offset",       &UniformBlockLayout::Member::offset)
+        .def_readonly("arrayStride",  &UniformBlockLayout::Member::arrayStride)
+        .def_readonly("matrixStride", &UniformBlockLayout::Member::matrixStride)
+        .def_property_readonly("type", [](const UniformBlockLayout::Member &mb) { return wrapGLenum(mb.type); })
+        ;
+
+    py::class_<UniformBlockLayout>(m, "UniformBlockLayout")
+        .def_readonly("name",     &UniformBlockLayout::name)
+        .def_readonly("dataSize", &UniformBlockLayout::dataSize)
+        .def_readonly("members",  &UniformBlockLayout::members)
+        .def("__repr__", [](const UniformBlockLayout &b) { return "UniformBlockLayout '" + b.name + "' (" + std::to_string(b.dataSize) + " bytes)"; })
+        ;
+
+    py::class_<UniformBuffer> pyUBO(m, "UniformBuffer");
+    pyUBO
+        .def(py::init<std::shared_ptr<OpenGLContext>, const UniformBlockLayout &, GLuint>(), py::arg("ctx"), py::arg("layout"), py::arg("binding"))
+        .def("memberHandle", &UniformBuffer::memberHandle, py::arg("name"), py::arg("optional") = false)
+        .def("upload", &UniformBuffer::upload)
+        .def("bind",   &UniformBuffer::bind)
+        .def_property_readonly("binding", &UniformBuffer::binding)
+        .def_property_readonly("layout",  &UniformBuffer::layout, py::return_value_policy::reference_internal)
+        ;
+
+    MetaMap<BindUniformBufferSet, int, float, Eigen::Vector2f, Eigen::Vector3f, Eigen::Vector4f,
+                                              Eigen::Matrix2f, Eigen::Matrix3f, Eigen::Matrix4f>::run(pyUBO);
+
     py::class_<BufferObject>(m, "BufferObject")
         .def("bind", &BufferObject::bind)
-        .def("updateData", [](BufferObject &b, Eigen::Ref<const MXfR > data, GLenumWrapper usage) { b.updateData(data, unwrapGLenum(usage)); }, py::arg("data"), py::arg("usage") = GLenumWrapper::wGL_DYNAMIC_DRAW)
-        .def("updateData", [](BufferObject &b, Eigen::Ref<const MXuiR> data, GLenumWrapper usage) { b.updateData(data, unwrapGLenum(usage)); }, py::arg("data"), py::arg("usage") = GLenumWrapper::wGL_DYNAMIC_DRAW)
+        .def("updateData", [](BufferObject &b, Eigen::Ref<const MXfR > data, GLenumWrapper usage) { b.updateData(data, unwrapGLenum(usage)); }, py::arg("data"), py::arg("usage") = GLenumWrapper::wGL_DYNAMIC_DRAW, GLCallGuard())
+        .def("updateData", [](BufferObject &b, Eigen::Ref<const MXuiR> data, GLenumWrapper usage) { b.updateData(data, unwrapGLenum(usage)); }, py::arg("data"), py::arg("usage") = GLenumWrapper::wGL_DYNAMIC_DRAW, GLCallGuard())
+        .def("updateRange", [](BufferObject &b, size_t rowBegin, Eigen::Ref<const MXfR > data) { b.updateRange(rowBegin, data); }, py::arg("rowBegin"), py::arg("data"), GLCallGuard())
+        .def("updateRange", [](BufferObject &b, size_t rowBegin, Eigen::Ref<const MXuiR> data) { b.updateRange(rowBegin, data); }, py::arg("rowBegin"), py::arg("data"), GLCallGuard())
+        .def("setStreaming", &BufferObject::setStreaming, py::arg("enable"), py::arg("numSegments") = 3)
+        .def_property_readonly("streaming",          &BufferObject::streaming)
+        .def_property_readonly("persistentlyMapped", &BufferObject::persistentlyMapped)
+        .def_property_readonly("offset",             &BufferObject::offset)
+        .def_property_readonly("count",              &BufferObject::count)
         ;
 
     py::class_<VertexArrayObject> pyVAO(m, "VertexArrayObject");
     pyVAO
         .def(py::init<std::shared_ptr<OpenGLContext>>(), py::arg("ctx"))
-        .def("setAttribute",     &VertexArrayObject::setAttribute,   py::arg("index"), py::arg("A"), py::arg("instanced") = false)
-        .def("setIndexBuffer",   &VertexArrayObject::setIndexBuffer, py::arg("A"))
+        .def(py::init([](std::shared_ptr<OpenGLContext> ctx, const VertexArrayObject &source) {
+                // `keep_alive` keeps the Python object owning `source` alive.
+                return std::make_unique<VertexArrayObject>(ctx, std::shared_ptr<const VertexArrayObject>(&source, [](const VertexArrayObject *) { }));
+            }), py::arg("ctx"), py::arg("source"), py::keep_alive<1, 3>(),
+            "View in `ctx` of VAO `source` created by another context of the same share group, drawing its buffers")
+        .def_property_readonly("isView", &VertexArrayObject::isView)
+        .def("setAttribute", &setAttributeForDType, py::arg("index"), py::arg("A"), py::arg("instanced") = false, py::arg("normalized") = false, py::arg("integer") = false,
+             "Set attribute `index` from the rows of `A`. float16 data is uploaded as half floats and other dtypes are converted\n"
+             "to float32, unless for (u)int8/16/32 data one of the following is requested:\n"
+             "    normalized=True:  components normalized by the GL to [0, 1] (unsigned) or [-1, 1] (signed)\n"
+             "    integer=True:     integers (`int`/`uint`/`ivec*`/`uvec*` shader inputs)")
+        .def("setPackedAttribute", &VertexArrayObject::setPackedAttribute, py::arg("index"), py::arg("A"), py::arg("instanced") = false, GLCallGuard(),
+             "Set attribute `index` from vectors with components in [-1, 1] (e.g., normals) packed into 10:10:10:2 bits")
+        .def("setInterleavedAttributes", &VertexArrayObject::setInterleavedAttributes, py::arg("indices"), py::arg("sizes"), py::arg("A"), py::arg("instanced") = false, GLCallGuard(),
+             "Upload the attributes `indices` (with `sizes[i]` columns each) from the columns of `A` into one interleaved buffer")
+        .def("updateAttributeRange",  &VertexArrayObject::updateAttributeRange,  py::arg("index"), py::arg("rowBegin"), py::arg("A"), GLCallGuard())
+        .def("setAttributeStreaming", &VertexArrayObject::setAttributeStreaming, py::arg("index"), py::arg("enable") = true, py::arg("numSegments") = 3)
+        .def("setIndexBuffer",   &VertexArrayObject::setIndexBuffer, py::arg("A"), GLCallGuard())
         .def("unsetIndexBuffer", &VertexArrayObject::unsetIndexBuffer)
+        .def_property("primitiveMode", [](const VertexArrayObject &vao) { return static_cast<PrimitiveModeWrapper>(vao.primitiveMode()); },
+                                       [](VertexArrayObject &vao, PrimitiveModeWrapper mode) { vao.setPrimitiveMode(static_cast<GLenum>(mode)); })
+        .def_property_readonly("indexType", [](const VertexArrayObject &vao) { return wrapGLenum(vao.indexType()); })
         .def("bind", &VertexArrayObject::bind)
-        .def("draw", &VertexArrayObject::draw, py::arg("shader"), py::arg("instances") = 1, py::arg("ignoreExtraneousAttributes") = false)
+        .def("draw", &VertexArrayObject::draw, py::arg("shader"), py::arg("instances") = 1, py::arg("ignoreExtraneousAttributes") = false, GLCallGuard())
+        .def("drawRange", &VertexArrayObject::drawRange, py::arg("shader"), py::arg("first"), py::arg("count"), py::arg("instances") = 1, py::arg("ignoreExtraneousAttributes") = false, GLCallGuard(),
+             "Draw elements [first, first + count) (indices if indexed, vertices otherwise)")
+        .def_property_readonly("numElements", &VertexArrayObject::numElements)
         .def_property_readonly("attributeBuffers", &VertexArrayObject::attributeBuffers, py::return_value_policy::reference)
+        .def("attributeBuffer", &VertexArrayObject::attributeBuffer, py::arg("index"), py::return_value_policy::reference_internal)
         .def_property_readonly("indexBuffer",      &VertexArrayObject::indexBuffer,      py::return_value_policy::reference)
         ;
 
+    py::class_<TriangleDepthSorter::Run>(m, "DepthSortRun")
+        .def_readonly("mesh",  &TriangleDepthSorter::Run::mesh)
+        .def_readonly("begin", &TriangleDepthSorter::Run::begin)
+        .def_readonly("count", &TriangleDepthSorter::Run::count)
+        .def("__repr__", [](const TriangleDepthSorter::Run &r) {
+                return "DepthSortRun(mesh=" + std::to_string(r.mesh) + ", begin=" + std::to_string(r.begin) + ", count=" + std::to_string(r.count) + ")";
+            })
+        ;
+
+    py::class_<TriangleDepthSorter>(m, "TriangleDepthSorter")
+        .def(py::init<>())
+        .def_property("numMeshes", &TriangleDepthSorter::numMeshes, &TriangleDepthSorter::setNumMeshes)
+        .def("setMesh", &TriangleDepthSorter::setMesh, py::arg("index"), py::arg("V"), py::arg("F"), py::call_guard<py::gil_scoped_release>(),
+             "Set the vertex positions and triangles of mesh `index` (adding meshes as needed)")
+        .def("sort", &TriangleDepthSorter::sort, py::arg("modelViews"), py::call_guard<py::gil_scoped_release>(),
+             "Sort all meshes' triangles back to front, with mesh `i` placed by the 4x4 model-view matrix `modelViews[i]`; returns False if nothing changed since the last sort")
+        .def("sortedTriangles",  &TriangleDepthSorter::sortedTriangles,  py::arg("index"), py::return_value_policy::reference_internal)
+        .def("writeIndexBuffer", &TriangleDepthSorter::writeIndexBuffer, py::arg("index"), py::arg("vao"), GLCallGuard(),
+             "Upload mesh `index`'s sorted triangles into the index buffer of `vao`")
+        .def_property_readonly("runs", &TriangleDepthSorter::runs)
+        .def("drawRuns", [](const TriangleDepthSorter &sorter, const std::vector<const VertexArrayObject *> &vaos, const std::vector<Shader *> &shaders,
+                            const std::vector<Shader::UniformValues> &uniforms,
+                            const std::vector<std::vector<std::pair<GLuint, std::array<GLfloat, 4>>>> &constantAttributes) {
+                const size_t n = sorter.numMeshes();
+                if ((vaos.size() != n) || (shaders.size() != n) || (uniforms.size() != n) || (constantAttributes.size() != n))
+                    throw std::runtime_error("Expected one VAO, shader, uniform snapshot and constant attribute list per mesh");
+                std::vector<TriangleDepthSorter::MeshDraw> draws(n);
+                for (size_t i = 0; i < n; ++i) draws[i] = TriangleDepthSorter::MeshDraw{vaos[i], shaders[i], uniforms[i], constantAttributes[i]};
+                GLCallGILRelease release;
+                sorter.drawRuns(draws);
+            }, py::arg("vaos"), py::arg("shaders"), py::arg("uniforms"), py::arg("constantAttributes"),
+            "Draw the runs with mesh `i` drawn by `vaos[i]` and `shaders[i]`, restoring uniform values `uniforms[i]` (from `Shader.saveUniforms`)\n"
+            "and setting the constant attributes `constantAttributes[i]` (a list of (location, RGBA value)) when switching to it")
+        .def_property("incremental", &TriangleDepthSorter::incremental, &TriangleDepthSorter::setIncremental)
+        .def_property_readonly("lastSortIncremental", &TriangleDepthSorter::lastSortIncremental)
+        ;
+
+    py::class_<WeightedBlendedOIT>(m, "WeightedBlendedOIT")
+        .def(py::init<std::shared_ptr<OpenGLContext>>(), py::arg("ctx"))
+        .def("beginTransparentPass", &WeightedBlendedOIT::beginTransparentPass,
+             "Redirect rendering into the cleared accumulation targets and set up blending for translucent geometry")
+        .def("composite",            &WeightedBlendedOIT::composite, GLCallGuard(),
+             "Blend the accumulated translucent geometry over the context's render target")
+        .def_property_readonly("width",  &WeightedBlendedOIT::getWidth)
+        .def_property_readonly("height", &WeightedBlendedOIT::getHeight)
+        ;
+
     MetaMap<BindSetConstAttribute, int, float, Eigen::Vector2f, Eigen::Vector3f, Eigen::Vector4f,
                                                Eigen::Matrix2f, Eigen::Matrix3f, Eigen::Matrix4f>::run(pyVAO);
 }
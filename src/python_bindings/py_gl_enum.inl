@@ -3,6 +3,8 @@ enum class GLenumWrapper : GLenum {
     wGL_FLOAT        = GL_FLOAT       ,
     wGL_INT          = GL_INT         ,
     wGL_UNSIGNED_INT = GL_UNSIGNED_INT,
+    wGL_UNSIGNED_BYTE  = GL_UNSIGNED_BYTE ,
+    wGL_UNSIGNED_SHORT = GL_UNSIGNED_SHORT,
     wGL_BOOL         = GL_BOOL        ,
     wGL_FLOAT_VEC2   = GL_FLOAT_VEC2  ,
     wGL_FLOAT_VEC3   = GL_FLOAT_VEC3  ,
@@ -32,6 +34,18 @@ enum class GLenumWrapper : GLenum {
     wGL_STATIC_DRAW  = GL_STATIC_DRAW
 };
 
+// Primitive modes get their own enum since their values coincide with other
+// constants (GL_POINTS == GL_ZERO, GL_LINES == GL_ONE).
+enum class PrimitiveModeWrapper : GLenum {
+    wGL_POINTS         = GL_POINTS,
+    wGL_LINES          = GL_LINES,
+    wGL_LINE_LOOP      = GL_LINE_LOOP,
+    wGL_LINE_STRIP     = GL_LINE_STRIP,
+    wGL_TRIANGLES      = GL_TRIANGLES,
+    wGL_TRIANGLE_STRIP = GL_TRIANGLE_STRIP,
+    wGL_TRIANGLE_FAN   = GL_TRIANGLE_FAN
+};
+
 GLenumWrapper wrapGLenum(GLenum val) {
     return static_cast<GLenumWrapper>(val);
 }
@@ -52,6 +66,8 @@ void bindGLEnum(py::module &m) {
         .value("GL_FLOAT"       , GLenumWrapper::wGL_FLOAT)
         .value("GL_INT"         , GLenumWrapper::wGL_INT)
         .value("GL_UNSIGNED_INT", GLenumWrapper::wGL_UNSIGNED_INT)
+        .value("GL_UNSIGNED_BYTE" , GLenumWrapper::wGL_UNSIGNED_BYTE)
+        .value("GL_UNSIGNED_SHORT", GLenumWrapper::wGL_UNSIGNED_SHORT)
         .value("GL_BOOL"        , GLenumWrapper::wGL_BOOL)
         .value("GL_FLOAT_VEC2"  , GLenumWrapper::wGL_FLOAT_VEC2)
         .value("GL_FLOAT_VEC3"  , GLenumWrapper::wGL_FLOAT_VEC3)
@@ -80,4 +96,14 @@ void bindGLEnum(py::module &m) {
         .value("GL_DYNAMIC_DRAW", GLenumWrapper::wGL_DYNAMIC_DRAW)
         .value("GL_STATIC_DRAW",  GLenumWrapper::wGL_STATIC_DRAW)
         ;
+
+    py::enum_<PrimitiveModeWrapper>(m, "PrimitiveMode")
+        .value("GL_POINTS",         PrimitiveModeWrapper::wGL_POINTS)
+        .value("GL_LINES",          PrimitiveModeWrapper::wGL_LINES)
+        .value("GL_LINE_LOOP",      PrimitiveModeWrapper::wGL_LINE_LOOP)
+        .value("GL_LINE_STRIP",     PrimitiveModeWrapper::wGL_LINE_STRIP)
+        .value("GL_TRIANGLES",      PrimitiveModeWrapper::wGL_TRIANGLES)
+        .value("GL_TRIANGLE_STRIP", PrimitiveModeWrapper::wGL_TRIANGLE_STRIP)
+        .value("GL_TRIANGLE_FAN",   PrimitiveModeWrapper::wGL_TRIANGLE_FAN)
+        ;
 }